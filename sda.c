@@ -28,40 +28,356 @@
  */
 
 
+//for mremap
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 #include "sda.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SDA_HAVE_MMAP 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/******* Globals *******/
+
+const struct sda_growth sda_growth_geometric = {2.0, 0, NULL, NULL};
+const struct sda_growth sda_growth_legacy = {2.0, SDA_MAX_PREALLOC, NULL, NULL};
+
+static const struct sda_growth *_sda_growth_default = &sda_growth_geometric;
+
+//default allocations at least this big are mmap'd, 0 for never
+static size_t _sda_mmap_threshold = 0;
+
+//threads that get their own counters, any past that share the last ones
+#define _SDA_STATS_SLOTS 64
+
+static struct _sda_stats_slot {
+    struct sda_stats s;
+} __attribute__((aligned(SDA_CACHE_LINE))) _sda_stats_slots[_SDA_STATS_SLOTS];
+//slots handed out so far
+static unsigned _sda_stats_used = 0;
+static __thread struct sda_stats *_sda_stats_mine = NULL;
+//set if _sda_stats_mine is the last slot, which every thread past the others shares
+static __thread unsigned char _sda_stats_shared = 0;
+
 /******* Private helpper functions *******/
 
-static inline size_t _sda_hdr_size(char type) {
-    switch(type&SDA_HTYPE_MASK) {
-        case SDA_HTYPE_SM:
-            return sizeof(SDA_HDR_TYPE(SM));
-        case SDA_HTYPE_MD:
-            return sizeof(SDA_HDR_TYPE(MD));
-        case SDA_HTYPE_LG:
-            return sizeof(SDA_HDR_TYPE(LG));
+/**
+ * Counters of the calling thread, claims a slot the first time.
+ * Slots aren't given back, the counts of a thread that's gone still add up.
+ */
+static inline struct sda_stats *_sda_stats_local(void) {
+    unsigned i;
+    if (__builtin_expect(_sda_stats_mine == NULL, 0)) {
+        i = __atomic_fetch_add(&_sda_stats_used, 1, __ATOMIC_RELAXED);
+        if (i >= _SDA_STATS_SLOTS-1) {
+            i = _SDA_STATS_SLOTS-1;
+            _sda_stats_shared = 1;
+        }
+        _sda_stats_mine = &_sda_stats_slots[i].s;
     }
-    return 0;
+    return _sda_stats_mine;
+}
+/* Add n to counter field. Only the owner writes its own slot, so a plain
+ * load and store does (relaxed atomics so snapshots can read it), the shared
+ * last slot needs the locked add. */
+#define _SDA_STAT(field, n) do { \
+    struct sda_stats *_st = _sda_stats_local(); \
+    if (__builtin_expect(_sda_stats_shared, 0)) __atomic_add_fetch(&_st->field, (n), __ATOMIC_RELAXED); \
+    else __atomic_store_n(&_st->field, __atomic_load_n(&_st->field, __ATOMIC_RELAXED)+(n), __ATOMIC_RELAXED); \
+    } while(0)
+
+/**
+ * Size of everything in front of the header
+ */
+static inline size_t _sda_pre_size(unsigned char flags) {
+    return (flags&SDA_FLAG_EXT) ? sizeof(struct sda_ext) : 0;
+}
+
+/**
+ * Bytes needed after raw so that raw+pad+off is aligned to align (a power of 2)
+ */
+static inline size_t _sda_align_pad(const void *raw, size_t off, size_t align) {
+    return (align - (((uintptr_t)raw + off) & (align-1))) & (align-1);
+}
+
+/**
+ * Alignment of the buffer of s that has to be kept, 1 if it doesn't matter
+ */
+static inline size_t _sda_align(const sda s) {
+    if(!(sda_flags(s)&SDA_FLAG_ALIGNED)) return 1;
+    return _sda_ext(s)->align;
+}
+
+/******* Block allocation *******/
+
+#if defined(SDA_HAVE_MMAP)
+static inline size_t _sda_page_round(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page-1) & ~(page-1);
+}
+
+static void *_sda_mmap(size_t size) {
+    void *ptr = mmap(NULL, _sda_page_round(size), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return NULL;
+#if defined(MADV_HUGEPAGE)
+    //just a hint, doesn't matter if THP is off
+    madvise(ptr, _sda_page_round(size), MADV_HUGEPAGE);
+#endif
+    return ptr;
+}
+
+static void *_sda_mremap(void *ptr, size_t old_size, size_t size) {
+    size_t old_map = _sda_page_round(old_size);
+    size_t new_map = _sda_page_round(size);
+    if (old_map == new_map) return ptr;
+#if defined(MREMAP_MAYMOVE)
+    //pages get moved around instead of copied
+    ptr = mremap(ptr, old_map, new_map, MREMAP_MAYMOVE);
+    if (ptr == MAP_FAILED) return NULL;
+#if defined(MADV_HUGEPAGE)
+    madvise(ptr, new_map, MADV_HUGEPAGE);
+#endif
+    return ptr;
+#else
+    void *newptr = _sda_mmap(size);
+    if (newptr == NULL) return NULL;
+    memcpy(newptr, ptr, (old_size < size) ? old_size : size);
+    munmap(ptr, old_map);
+    return newptr;
+#endif
+}
+#endif //SDA_HAVE_MMAP
+
+/* Allocate a block for an array, *flags gets SDA_FLAG_MMAP set or cleared
+ * depending on where the block came from. */
+static void *_sda_blk_malloc(const struct sda_allocator *a, size_t size, unsigned char *flags) {
+    _SDA_STAT(mallocs, 1);
+#if defined(SDA_HAVE_MMAP)
+    if (a == NULL && _sda_mmap_threshold && size >= _sda_mmap_threshold) {
+        *flags |= SDA_FLAG_MMAP;
+        return _sda_mmap(size);
+    }
+#endif
+    *flags &= ~SDA_FLAG_MMAP;
+    return _sda_malloc(a, size);
+}
+
+/* Resize the block of an array with *flags, moving it in or out of mmap
+ * when it crosses the threshold. */
+static void *_sda_blk_realloc(const struct sda_allocator *a, void *ptr, size_t old_size, size_t size, unsigned char *flags) {
+#if defined(SDA_HAVE_MMAP)
+    int want_mmap = (a == NULL && _sda_mmap_threshold && size >= _sda_mmap_threshold);
+    if (*flags&SDA_FLAG_MMAP) {
+        void *newptr;
+        if (want_mmap) return _sda_mremap(ptr, old_size, size);
+        //small enough for the heap again
+        newptr = _sda_malloc(a, size);
+        if (newptr == NULL) return NULL;
+        memcpy(newptr, ptr, (old_size < size) ? old_size : size);
+        munmap(ptr, _sda_page_round(old_size));
+        *flags &= ~SDA_FLAG_MMAP;
+        return newptr;
+    }
+    if (want_mmap) {
+        //one last copy out of the heap
+        void *newptr = _sda_mmap(size);
+        if (newptr == NULL) return NULL;
+        memcpy(newptr, ptr, (old_size < size) ? old_size : size);
+        _sda_free(a, ptr, old_size);
+        *flags |= SDA_FLAG_MMAP;
+        return newptr;
+    }
+#endif
+    return _sda_realloc(a, ptr, old_size, size);
+}
+
+/* Free the block of an array with flags */
+static void _sda_blk_free(const struct sda_allocator *a, void *ptr, size_t size, unsigned char flags) {
+    _SDA_STAT(frees, 1);
+#if defined(SDA_HAVE_MMAP)
+    if (flags&SDA_FLAG_MMAP) {
+        munmap(ptr, _sda_page_round(size));
+        return;
+    }
+#else
+    (void)flags;
+#endif
+    _sda_free(a, ptr, size);
 }
 
 /**
- * HTYPE required to make sure alloc and len are big enough
+ * Move s into an allocation with a type header and room for new_sz bytes,
+ * keeping the ext block and the contents of the buffer. shadow must be the
+ * current header of s.
+ *
+ * Header promotion/demotion goes through realloc too, the buffer is then
+ * slid into place inside the block instead of copied into a new one.
  */
-static inline char _sda_req_htype(size_t req_size, size_t req_len) {
-    if((req_size < UINT32_MAX) && (req_len < UINT16_MAX))
-        return SDA_HTYPE_SM;
-    if((req_size < UINT64_MAX) && (req_len < UINT32_MAX))
-        return SDA_HTYPE_MD;
-    return SDA_HTYPE_LG;
+static sda _sda_realloc_buf(sda s, const struct sda_hdr_uni *shadow, char type, size_t new_sz) {
+    char *sh, *newsh, *src, *dst;
+    unsigned char oldtype = _sda_htype(shadow->flags);
+    size_t buf_sz = shadow->len*shadow->sz;
+    size_t pre_sz = _sda_pre_size(shadow->flags);
+    size_t old_hdr_sz = _sda_hdr_size(oldtype);
+    size_t hdr_sz = _sda_hdr_size(type);
+    size_t align = _sda_align(s);
+    //aligned arrays keep align-1 extra bytes in front to shift everything into place
+    size_t pad = (align > 1) ? _sda_ext(s)->pad : 0;
+    size_t newpad;
+    const struct sda_allocator *a = _sda_allocator(s);
+    size_t total_sz = sda_total_size(s);
+    unsigned char flags = shadow->flags;
+    struct sda_ext ext;
+
+    //a wrapped ring would be cut apart by the resize
+    if (flags&SDA_FLAG_DEQUE) sda_deque_linearize(s);
+    sh = sda_total_ptr(s);
+    //the header gets rebuilt from shadow, but the ext block has to be kept
+    if (pre_sz) memcpy(&ext, sh+pad, pre_sz);
+    if (hdr_sz < old_hdr_sz) {
+        //smaller header, slide the buffer down before the block shrinks
+        memmove(sh+pad+pre_sz+hdr_sz, s, buf_sz);
+        _SDA_STAT(bytes_copied, buf_sz);
+    }
+    if (flags&SDA_FLAG_STACK) {
+        //inline storage can't be resized, move it to the heap like a realloc would
+        flags &= ~SDA_FLAG_STACK;
+        newsh = _sda_blk_malloc(a, (align-1)+pre_sz+hdr_sz+new_sz, &flags);
+        //the stack array is still there for the caller
+        if (newsh == NULL) return NULL;
+        memcpy(newsh+pre_sz+old_hdr_sz, s, (buf_sz < new_sz) ? buf_sz : new_sz);
+        _SDA_STAT(bytes_copied, (buf_sz < new_sz) ? buf_sz : new_sz);
+    }
+    else {
+        newsh = _sda_blk_realloc(a, sh, total_sz, (align-1)+pre_sz+hdr_sz+new_sz, &flags);
+        if (newsh == NULL) {
+            //serious error...
+            _sda_blk_free(a, sh, total_sz, shadow->flags);
+            return NULL;
+        }
+        _SDA_STAT(reallocs, 1);
+        if (newsh == sh) {
+            _SDA_STAT(reallocs_in_place, 1);
+        }
+        else {
+            _SDA_STAT(reallocs_moved, 1);
+            //mremap moves the pages without copying them
+            if (!(shadow->flags&flags&SDA_FLAG_MMAP)) _SDA_STAT(bytes_copied, (buf_sz < new_sz) ? buf_sz : new_sz);
+        }
+    }
+    if (type > oldtype) {
+        if (type == SDA_HTYPE_MD) _SDA_STAT(promote_md, 1);
+        else _SDA_STAT(promote_lg, 1);
+    }
+    //realloc doesn't care about our alignment or header size, shift it all into place
+    newpad = _sda_align_pad(newsh, pre_sz+hdr_sz, align);
+    src = newsh+pad+pre_sz+((hdr_sz < old_hdr_sz) ? hdr_sz : old_hdr_sz);
+    dst = newsh+newpad+pre_sz+hdr_sz;
+    if (src != dst) {
+        memmove(dst, src, buf_sz);
+        _SDA_STAT(bytes_copied, buf_sz);
+    }
+    if (pre_sz) memcpy(newsh+newpad, &ext, pre_sz);
+    //can't be too careful about that extra padding
+    memset(newsh+newpad+pre_sz, 0, hdr_sz);
+    s = dst;
+    //len stays the same
+    _sda_set_flags(s, (flags&~SDA_HTYPE_MASK)|type);
+    _sda_set_len(s, shadow->len);
+    _sda_set_sz(s, shadow->sz);
+    if (align > 1) _sda_ext(s)->pad = newpad;
+    _sda_set_alloc(s, new_sz);
+    return s;
+}
+
+/**
+ * Number of bytes to allocate so that need bytes fit, according to policy g
+ */
+static size_t _sda_grow_size(const struct sda_growth *g, size_t alloc, size_t need, size_t sz) {
+    size_t new_sz;
+    if(g->fn != NULL) {
+        new_sz = g->fn(alloc, need, sz, g->ctx);
+    }
+    else if(g->factor <= 1.0 || need > (double)SIZE_MAX/g->factor) {
+        new_sz = need;
+    }
+    else {
+        new_sz = (size_t)(need*g->factor);
+        if(g->cap && new_sz-need > g->cap) new_sz = need+g->cap;
+    }
+    if(new_sz < need) return need;
+    //keep alloc a multiple of sz
+    return new_sz - (new_sz-need)%sz;
+}
+
+/**
+ * Make room for an extension block in front of the header of s.
+ */
+static sda _sda_add_ext(sda s) {
+    unsigned char flags = sda_flags(s);
+    size_t total_sz, hdr_sz;
+    void *sh;
+    char *newsh;
+
+    if(flags&SDA_FLAG_EXT) return s;
+    hdr_sz = _sda_hdr_size(flags);
+    total_sz = sda_total_size(s);
+    sh = sda_total_ptr(s);
+    //no ext block means the default allocator
+    if (flags&SDA_FLAG_STACK) {
+        //no room in front of inline storage, move to the heap
+        flags &= ~SDA_FLAG_STACK;
+        newsh = _sda_blk_malloc(NULL, sizeof(struct sda_ext)+total_sz, &flags);
+        if (newsh == NULL) return NULL;
+        memcpy(newsh, sh, total_sz);
+    }
+    else {
+        newsh = _sda_blk_realloc(NULL, sh, total_sz, sizeof(struct sda_ext)+total_sz, &flags);
+        if (newsh == NULL) {
+            _sda_blk_free(NULL, sh, total_sz, sda_flags(s));
+            return NULL;
+        }
+        _SDA_STAT(reallocs, 1);
+        if (newsh == sh) _SDA_STAT(reallocs_in_place, 1);
+        else _SDA_STAT(reallocs_moved, 1);
+    }
+    _SDA_STAT(bytes_copied, total_sz);
+    //shift the header and buffer up to fit the ext block in
+    memmove(newsh+sizeof(struct sda_ext), newsh, total_sz);
+    memset(newsh, 0, sizeof(struct sda_ext));
+    s = newsh+sizeof(struct sda_ext)+hdr_sz;
+    _sda_set_flags(s, flags|SDA_FLAG_EXT);
+    return s;
+}
+
+
+/**
+ * s if the caller can write to it in place, otherwise a private copy
+ */
+static inline sda _sda_writable(sda s) {
+    return (sda_flags(s)&SDA_FLAG_SHARED) ? sda_unshare(s) : s;
 }
 
 
 /******* High-level methods for operating on sda's *******/
 
 sda sda_free(sda s) {
-    if (s != NULL) _sda_free(sda_total_ptr(s));
+    if (s == NULL) return NULL;
+    //the last holder frees it
+    if ((sda_flags(s)&SDA_FLAG_SHARED) && __atomic_sub_fetch(&_sda_ext(s)->refs, 1, __ATOMIC_ACQ_REL) > 0) return NULL;
+    //inline storage from sda_stack goes away with its scope
+    if (!(sda_flags(s)&SDA_FLAG_STACK)) {
+        _SDA_STAT(slack_freed, sda_alloc(s)-sda_size(s));
+        _sda_blk_free(_sda_allocator(s), sda_total_ptr(s), sda_total_size(s), sda_flags(s));
+    }
     return NULL;
 }
 /* Just for sda_raii */
@@ -76,6 +392,8 @@ void _sda_raii_free(void *s) {
 }
 
 sda sda_clear(sda s) {
+    s = _sda_writable(s);
+    if (s == NULL) return NULL;
     _sda_set_len(s, 0);
     //not strictly necessary
     return s;
@@ -87,13 +405,15 @@ sda sda_clear(sda s) {
  */
 sda sda_resize(sda s, size_t len) {
     size_t curlen = sda_len(s);
-    uint8_t sz;
+    size_t sz;
     size_t grow_sz;
 
     //if we're already the right size
     if(len == curlen) {
         return s;
     }
+    s = _sda_writable(s);
+    if (s == NULL) return NULL;
     
     //if shrinking
     if (len < curlen) {
@@ -133,11 +453,56 @@ sda sda_extend(sda s, const sda t) {
     return sda_cpy(s, sda_len(s), t, sda_size(t));
 }
 
+/* Append the n elements pointed by 't' to the end of the sda array 's'.
+ * The header is only decoded once, and there's no division to get the new len.
+ *
+ * After the call, the passed sda array is no longer valid and all the
+ * references must be substituted with the new pointer returned by the call.
+ */
+sda sda_append_n(sda s, const void *t, size_t n) {
+    assert(t != NULL || n == 0);
+    struct sda_hdr_uni shadow;
+    s = _sda_writable(s);
+    if (s == NULL) return NULL;
+    sda_hdr(s, &shadow);
+    size_t end = shadow.len*shadow.sz;
+    size_t size = n*shadow.sz;
+    
+    if((shadow.alloc - end) < size) {
+        s = sda_prealloc(s, size);
+        if (s == NULL) return NULL;
+    }
+    if (size) memcpy(((char*)s)+end, t, size);
+    _sda_set_len(s, shadow.len+n);
+    return s;
+}
+
+/* Make sure that n more elements can be added to the sda array 's' without
+ * reallocating, so they can be added with sda_push_unchecked() or written
+ * straight to sda_end_ptr().
+ *
+ * After the call, the passed sda array is no longer valid and all the
+ * references must be substituted with the new pointer returned by the call.
+ */
+sda sda_reserve(sda s, size_t n) {
+    struct sda_hdr_uni shadow;
+    //the room is for writing into
+    s = _sda_writable(s);
+    if (s == NULL) return NULL;
+    sda_hdr(s, &shadow);
+    size_t size = n*shadow.sz;
+    
+    if((shadow.alloc - shadow.len*shadow.sz) >= size) return s;
+    return sda_prealloc(s, size);
+}
+
 /* Modify the sda array 's' at index i to hold the specified array pointed by 't' of 'size' bytes.
  */
 sda sda_cpy(sda s, size_t i, const void *t, size_t size) {
     assert(t != NULL);
-    uint8_t sz = sda_sz(s);
+    s = _sda_writable(s);
+    if (s == NULL) return NULL;
+    size_t sz = sda_sz(s);
     size_t len = sda_len(s);
     //offset from s where we will start the copy
     size_t off = i*sz;
@@ -167,7 +532,8 @@ sda sda_cpy(sda s, size_t i, const void *t, size_t size) {
  */
 sda sda_replace(sda s, const sda t) {
     sda ret = sda_cpy(s, 0, t, sda_size(t));
-    _sda_set_len(s, sda_len(t));
+    //s might have moved
+    if (ret != NULL) _sda_set_len(ret, sda_len(t));
     return ret;
 }
 
@@ -182,26 +548,27 @@ void *sda_pop_ptr(sda s) {
 }
 
 
-#if 0 //FIXME: Implement?
 /* Turn the array into a smaller (or equal) array containing only the
  * subarray specified by the 'start' and 'end' indexes.
  *
- * start and end can be negative, where -1 means the last character of the
- * array, -2 the penultimate character, and so forth.
+ * start and end can be negative, where -1 means the last element of the
+ * array, -2 the penultimate element, and so forth.
  *
- * The interval is inclusive, so the start and end characters will be part
+ * The interval is inclusive, so the start and end elements will be part
  * of the resulting array.
  *
- * The array is modified in-place.
+ * The array is modified in-place, only the kept elements are moved.
  *
  * Example:
  *
  * sdachar s = sda_new(s, "Hello World");
- * sda_slice(s,1,-1); => "ello World"
+ * sda_slice(s,1,-2); => "ello World"
  */
-void sda_slice(sda s, int start, int end) {
-    size_t newlen
-    size_t len = sda_len(s);
+void sda_slice(sda s, ssize_t start, ssize_t end) {
+    struct sda_hdr_uni shadow;
+    sda_hdr(s, &shadow);
+    ssize_t len = shadow.len;
+    size_t newlen;
 
     if (len == 0) return;
     if (start < 0) {
@@ -212,23 +579,13 @@ void sda_slice(sda s, int start, int end) {
         end = len+end;
         if (end < 0) end = 0;
     }
-    newlen = (start > end) ? 0 : (end-start)+1;
-    if (newlen != 0) {
-        if (start >= (signed)len) {
-            newlen = 0;
-        } else if (end >= (signed)len) {
-            end = len-1;
-            newlen = (start > end) ? 0 : (end-start)+1;
-        }
-    } else {
-        start = 0;
-    }
-    if (start && newlen) memmove(s, s+start, newlen);
-    s[newlen] = 0;
-    _sda_set_len(s,newlen);
+    if (end >= len) end = len-1;
+    newlen = (start > end || start >= len) ? 0 : (end-start)+1;
+    if (start && newlen) memmove(s, ((char*)s)+start*shadow.sz, newlen*shadow.sz);
+    _sda_set_len(s, newlen);
 }
 
-/* Compare two sda strings s1 and s2 with memcmp().
+/* Compare two sda arrays s1 and s2 with memcmp().
  *
  * Return value:
  *
@@ -236,47 +593,162 @@ void sda_slice(sda s, int start, int end) {
  *     negative if s1 < s2.
  *     0 if s1 and s2 are exactly the same binary array.
  *
- * If two strings share exactly the same prefix, but one of the two has
- * additional characters, the longer array is considered to be greater than
+ * If two arrays share exactly the same prefix, but one of the two has
+ * additional elements, the longer array is considered to be greater than
  * the smaller one. */
 int sda_cmp(const sda s1, const sda s2) {
-    size_t l1, l2, minlen;
+    struct sda_hdr_uni h1, h2;
+    size_t minlen;
     int cmp;
 
-    l1 = sda_len(s1);
-    l2 = sda_len(s2);
-    minlen = (l1 < l2) ? l1 : l2;
-    cmp = memcmp(s1,s2,minlen);
-    if (cmp == 0) return l1-l2;
+    sda_hdr(s1, &h1);
+    sda_hdr(s2, &h2);
+    assert(h1.sz == h2.sz);
+    minlen = (h1.len < h2.len) ? h1.len : h2.len;
+    cmp = memcmp(s1, s2, minlen*h1.sz);
+    if (cmp == 0) return (h1.len > h2.len) - (h1.len < h2.len);
     return cmp;
 }
 
+/* Element scans for the common sizes, SSE2 compares 16 bytes at a time */
+static size_t _sda_find16(const uint16_t *p, size_t len, uint16_t x) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i v = _mm_set1_epi16(x);
+    for (; i+8 <= len; i += 8) {
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(p+i)), v));
+        if (m) return i + __builtin_ctz(m)/2;
+    }
+#endif
+    for (; i < len; i++) {
+        if (p[i] == x) return i;
+    }
+    return SDA_NPOS;
+}
+
+static size_t _sda_find32(const uint32_t *p, size_t len, uint32_t x) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i v = _mm_set1_epi32(x);
+    for (; i+4 <= len; i += 4) {
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p+i)), v));
+        if (m) return i + __builtin_ctz(m)/4;
+    }
+#endif
+    for (; i < len; i++) {
+        if (p[i] == x) return i;
+    }
+    return SDA_NPOS;
+}
+
+static size_t _sda_find64(const uint64_t *p, size_t len, uint64_t x) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    //no 64b compare in SSE2, both 32b halves have to match
+    __m128i v = _mm_set1_epi64x(x);
+    for (; i+2 <= len; i += 2) {
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p+i)), v));
+        if ((m & 0x00ff) == 0x00ff) return i;
+        if ((m & 0xff00) == 0xff00) return i+1;
+    }
+#endif
+    for (; i < len; i++) {
+        if (p[i] == x) return i;
+    }
+    return SDA_NPOS;
+}
+
+/* Index of the first element in p matching the sz bytes at x */
+static size_t _sda_find(const char *p, size_t len, size_t sz, const void *x) {
+    switch (sz) {
+        case 1: {
+            const char *hit = memchr(p, *(const unsigned char *)x, len);
+            return (hit != NULL) ? (size_t)(hit-p) : SDA_NPOS;
+        }
+        case 2: {
+            uint16_t v;
+            memcpy(&v, x, sizeof(v));
+            return _sda_find16((const uint16_t *)p, len, v);
+        }
+        case 4: {
+            uint32_t v;
+            memcpy(&v, x, sizeof(v));
+            return _sda_find32((const uint32_t *)p, len, v);
+        }
+        case 8: {
+            uint64_t v;
+            memcpy(&v, x, sizeof(v));
+            return _sda_find64((const uint64_t *)p, len, v);
+        }
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (memcmp(p+i*sz, x, sz) == 0) return i;
+    }
+    return SDA_NPOS;
+}
+
+size_t _sda_index(const sda s, const void *x, size_t size) {
+    struct sda_hdr_uni shadow;
+    size_t n, i, hit;
+    sda_hdr(s, &shadow);
+    assert(size%shadow.sz == 0);
+
+    n = size/shadow.sz;
+    if (n == 0) return 0;
+    if (n > shadow.len) return SDA_NPOS;
+    if (shadow.sz == 1 && n > 1) {
+        const char *found = memmem(s, shadow.len, x, n);
+        return (found != NULL) ? (size_t)(found-(const char *)s) : SDA_NPOS;
+    }
+    //find the first element, then check the rest of the run
+    for (i = 0; i+n <= shadow.len; i += hit+1) {
+        hit = _sda_find((const char *)s + i*shadow.sz, shadow.len-n+1-i, shadow.sz, x);
+        if (hit == SDA_NPOS) return SDA_NPOS;
+        if (n == 1 || memcmp((const char *)s + (i+hit+1)*shadow.sz, (const char *)x + shadow.sz, size-shadow.sz) == 0)
+            return i+hit;
+    }
+    return SDA_NPOS;
+}
+
+/* Join an array of sda arrays with the specified separator (sep_size bytes).
+ * Returns the result as a new sda array with elements of type_sz. */
+sda _sda_join(const sda *argv, size_t argc, const void *sep, size_t sep_size, size_t type_sz) {
+    size_t total = 0;
+    size_t j;
+    sda join;
 
-/* Join an array of C strings using the specified separator (also a C array).
- * Returns the result as an sda array. */
-sda sdajoin(char **argv, int argc, char *sep) {
-    sda join = sda_empty();
-    int j;
+    assert(sep_size%type_sz == 0);
+    for (j = 0; j < argc; j++) {
+        assert(sda_sz(argv[j]) == type_sz);
+        total += sda_size(argv[j]);
+    }
+    if (argc > 1) total += (argc-1)*sep_size;
+    join = _sda_new_sz(NULL, 0, type_sz);
+    if (join == NULL) return NULL;
+    join = sda_reserve(join, total/type_sz);
+    if (join == NULL) return NULL;
 
     for (j = 0; j < argc; j++) {
-        join = sda_cat(join, argv[j]);
-        if (j != argc-1) join = sda_cat(join,sep);
+        join = sda_append_n(join, argv[j], sda_len(argv[j]));
+        if (j != argc-1) join = sda_append_n(join, sep, sep_size/type_sz);
     }
     return join;
 }
 
-/* Like sdajoin, but joins an array of SDA strings. */
-sda sdajoinsda(sda *argv, int argc, const char *sep, size_t seplen) {
-    sda join = sda_empty();
-    int j;
+/* Join an array of C strings using the specified separator (also a C string).
+ * Returns the result as an sda array, with a NUL at the end. */
+sdachar sda_join_str(char **argv, size_t argc, const char *sep) {
+    size_t seplen = strlen(sep);
+    size_t j;
+    sdachar join = sda_empty(join);
 
-    for (j = 0; j < argc; j++) {
-        join = sdacatsda(join, argv[j]);
-        if (j != argc-1) join = sdacatlen(join,sep,seplen);
+    for (j = 0; j < argc && join != NULL; j++) {
+        join = sda_append_n(join, argv[j], strlen(argv[j]));
+        if (j != argc-1 && join != NULL) join = sda_append_n(join, sep, seplen);
     }
+    if (join != NULL) join = sda_append(join, (char)'\0');
     return join;
 }
-#endif //0 not implemented
 
 /******* Lower level methods for operating on sda's *******/
 
@@ -288,118 +760,50 @@ sda sdajoinsda(sda *argv, int argc, const char *sep, size_t seplen) {
  * by sda_len(), but only the free buffer space we have. */
 sda sda_prealloc(sda s, size_t add_sz) {
     struct sda_hdr_uni shadow;
+    s = _sda_writable(s);
+    if (s == NULL) return NULL;
     //get all of the members
     sda_hdr(s, &shadow);
     
     //it's most likely an error if add_sz isn't evenly divisible by shadow.sz
     assert(add_sz%shadow.sz == 0);
     
-    void *sh, *newsh;
     size_t buf_sz = shadow.len*shadow.sz;
     size_t avail_sz = shadow.alloc - buf_sz;
     char type;
-    unsigned char oldtype;
     size_t new_sz;
-    size_t hdr_sz;
 
     // Return ASAP if there is enough space left.
     if (avail_sz >= add_sz) return s;
     
     // Determine how much we need to allocate
-    new_sz = buf_sz + add_sz;
-    if(new_sz < SDA_MAX_PREALLOC) {
-        //add a bit more room
-        new_sz *= 2;
-    }
-    else {
-        //only add up to SDA_MAX_PREALLOC extra bytes
-        new_sz += SDA_MAX_PREALLOC;
-    }
+    new_sz = _sda_grow_size(sda_get_growth(s), shadow.alloc, buf_sz + add_sz, shadow.sz);
     
     //make sure we can address all the new alloc space
-    type = _sda_req_htype(new_sz, new_sz/shadow.sz);
-    oldtype = shadow.flags & SDA_HTYPE_MASK;
-    sh = ((char*)s)-_sda_hdr_size(oldtype);
-    hdr_sz = _sda_hdr_size(type);
-    if (oldtype==type) {
-        //type is still big enough to hold the new allocated mem
-        newsh = _sda_realloc(sh, hdr_sz+new_sz);
-        if (newsh == NULL) {
-            //serious error...
-            _sda_free(sh);
-            return NULL;
-        }
-        s = ((char*)newsh)+hdr_sz;
-    } else {
-        /* Since the header size changes, need to move the array forward,
-         * and can't use realloc */
-        newsh = _sda_malloc(hdr_sz+new_sz);
-        if (newsh == NULL) {
-            //serious error
-            _sda_free(sh);
-            return NULL;
-        }
-        //can't be too careful about that extra padding
-        memset(newsh, 0, hdr_sz);
-        //copy the old array into the new one
-        memcpy(((char*)newsh)+hdr_sz, s, buf_sz);
-        _sda_free(sh);
-        sh = NULL;
-        s = ((char*)newsh)+hdr_sz;
-        //len stays the same
-        _sda_set_flags(s, type);
-        _sda_set_len(s, shadow.len);
-        _sda_set_sz(s, shadow.sz);
-    }
-    _sda_set_alloc(s, new_sz);
+    type = _sda_req_htype(new_sz, new_sz/shadow.sz, shadow.sz);
+    s = _sda_realloc_buf(s, &shadow, type, new_sz);
+    if (s != NULL) _SDA_STAT(slack_grown, new_sz - (buf_sz+add_sz));
     return s;
 }
 
 /* Reallocate the sda array so that it has no free space at the end. The
  * contained array remains not altered, but next concatenation operations
- * will require a reallocation.
+ * will require a reallocation. Arrays from sda_stack are left as they are.
  *
  * After the call, the passed sda array is no longer valid and all the
  * references must be substituted with the new pointer returned by the call. */
 sda sda_compact(sda s) {
     struct sda_hdr_uni shadow;
+    s = _sda_writable(s);
+    if (s == NULL) return NULL;
     //get all of the members
     sda_hdr(s, &shadow);
     
-    void *sh, *newsh;
     size_t buf_sz = shadow.len*shadow.sz; //new_sz
-    char type;
-    unsigned char oldtype;
-    size_t hdr_sz;
-
-    type = _sda_req_htype(buf_sz, shadow.len);
-    oldtype = shadow.flags & SDA_HTYPE_MASK;
-    sh = ((char*)s)-_sda_hdr_size(oldtype);
-    hdr_sz = _sda_hdr_size(type);
-    if (oldtype==type) {
-        newsh = _sda_realloc(sh, hdr_sz+buf_sz);
-        if (newsh == NULL) {
-            _sda_free(sh);
-            return NULL;
-        }
-        s = ((char*)newsh)+hdr_sz;
-    } else {
-        newsh = _sda_malloc(hdr_sz+buf_sz);
-        if (newsh == NULL) {
-            _sda_free(sh);
-            return NULL;
-        }
-        memset(newsh, 0, hdr_sz);
-        memcpy(((char*)newsh)+hdr_sz, s, buf_sz);
-        _sda_free(sh);
-        sh = NULL;
-        s = ((char*)newsh)+hdr_sz;
-        _sda_set_flags(s, type);
-        _sda_set_len(s, shadow.len);
-        _sda_set_sz(s, shadow.sz);
-    }
-    _sda_set_alloc(s, buf_sz);
-    return s;
+    //moving inline storage to the heap wouldn't save anything
+    if (shadow.flags&SDA_FLAG_STACK) return s;
+    char type = _sda_req_htype(buf_sz, shadow.len, shadow.sz);
+    return _sda_realloc_buf(s, &shadow, type, buf_sz);
 }
 
 /* Return the total size of the allocation of the specifed sda array,
@@ -409,18 +813,215 @@ sda sda_compact(sda s) {
  * 3) The free buffer at the end if any.
  */
 size_t sda_total_size(sda s) {
-    return _sda_hdr_size(sda_flags(s))+sda_alloc(s);
+    unsigned char flags = sda_flags(s);
+    return (_sda_align(s)-1)+_sda_pre_size(flags)+_sda_hdr_size(flags)+sda_alloc(s);
 }
 
 /* Return the pointer of the actual SDA allocation (normally SDA arrays
  * are referenced by the start of the array buffer). */
 void *sda_total_ptr(sda s) {
-    return (void*)(((char *)s)-_sda_hdr_size(sda_flags(s)));
+    unsigned char flags = sda_flags(s);
+    size_t pad = (flags&SDA_FLAG_ALIGNED) ? _sda_ext(s)->pad : 0;
+    return (void*)(((char *)s)-_sda_hdr_size(flags)-_sda_pre_size(flags)-pad);
+}
+
+/******* Growth policy *******/
+
+void sda_set_growth_default(const struct sda_growth *g) {
+    _sda_growth_default = (g != NULL) ? g : &sda_growth_geometric;
+}
+
+const struct sda_growth *sda_get_growth_default(void) {
+    return _sda_growth_default;
+}
+
+sda sda_set_growth(sda s, const struct sda_growth *g) {
+    struct sda_ext *ext;
+    //the other holders keep their policy
+    s = _sda_writable(s);
+    if (s == NULL) return NULL;
+    ext = _sda_ext(s);
+    if(ext == NULL) {
+        //nothing to forget
+        if(g == NULL) return s;
+        s = _sda_add_ext(s);
+        if(s == NULL) return NULL;
+        ext = _sda_ext(s);
+    }
+    ext->growth = g;
+    return s;
+}
+
+const struct sda_growth *sda_get_growth(const sda s) {
+    struct sda_ext *ext = _sda_ext(s);
+    if(ext != NULL && ext->growth != NULL) return ext->growth;
+    return _sda_growth_default;
+}
+
+/******* Sharing *******/
+
+sda _sda_share(sda s) {
+    if (!(sda_flags(s)&SDA_FLAG_SHARED)) {
+        //the count lives in the ext block
+        s = _sda_add_ext(s);
+        if (s == NULL) return NULL;
+        _sda_ext(s)->refs = 1;
+        _sda_set_flags(s, sda_flags(s)|SDA_FLAG_SHARED);
+    }
+    __atomic_add_fetch(&_sda_ext(s)->refs, 1, __ATOMIC_RELAXED);
+    return s;
+}
+
+sda sda_unshare(sda s) {
+    struct sda_hdr_uni shadow;
+    struct sda_ext *ext;
+    size_t first;
+    char *t;
+
+    if (!(sda_flags(s)&SDA_FLAG_SHARED)) return s;
+    ext = _sda_ext(s);
+    //everyone else is done with it
+    if (__atomic_load_n(&ext->refs, __ATOMIC_ACQUIRE) == 1) return s;
+    sda_hdr(s, &shadow);
+    if (!(shadow.flags&SDA_FLAG_DEQUE)) {
+        t = _sda_new_ext(s, shadow.len*shadow.sz, shadow.sz, _sda_align(s), ext->allocator);
+    }
+    else {
+        //can't linearize in place under the other holders, copy it out in order
+        t = _sda_new_ext(NULL, shadow.len*shadow.sz, shadow.sz, _sda_align(s), ext->allocator);
+        if (t != NULL && shadow.len) {
+            first = shadow.alloc/shadow.sz - ext->head;
+            if (first > shadow.len) first = shadow.len;
+            memcpy(t, sda_deque_ptr_at(s, 0), first*shadow.sz);
+            memcpy(t+first*shadow.sz, s, (shadow.len-first)*shadow.sz);
+        }
+        if (t != NULL) _sda_set_flags(t, sda_flags(t)|SDA_FLAG_DEQUE);
+    }
+    if (t != NULL) _sda_ext(t)->growth = ext->growth;
+    //drop our hold, it may have been the last one by now
+    sda_free(s);
+    return t;
+}
+
+/******* Deques *******/
+
+/* Reverse the n bytes at p */
+static void _sda_reverse(char *p, size_t n) {
+    char *q = p+n-1, c;
+    for (; p < q; p++, q--) {
+        c = *p;
+        *p = *q;
+        *q = c;
+    }
+}
+
+sda sda_make_deque(sda s) {
+    if (s == NULL) return NULL;
+    if (sda_flags(s)&SDA_FLAG_DEQUE) return s;
+    s = _sda_writable(s);
+    if (s == NULL) return NULL;
+    s = _sda_add_ext(s);
+    if (s == NULL) return NULL;
+    //everything is already in order from index 0
+    _sda_ext(s)->head = 0;
+    _sda_set_flags(s, sda_flags(s)|SDA_FLAG_DEQUE);
+    return s;
+}
+
+sda _sda_deque_push(sda s, const void *x, int front) {
+    struct sda_hdr_uni shadow;
+    struct sda_ext *ext;
+    size_t cap, idx;
+    assert(sda_flags(s)&SDA_FLAG_DEQUE);
+    s = _sda_writable(s);
+    if (s == NULL) return NULL;
+    sda_hdr(s, &shadow);
+    if (shadow.len*shadow.sz == shadow.alloc) {
+        //full, growing puts the head back at 0
+        s = sda_prealloc(s, shadow.sz);
+        if (s == NULL) return NULL;
+        sda_hdr(s, &shadow);
+    }
+    ext = _sda_ext(s);
+    cap = shadow.alloc/shadow.sz;
+    if (front) {
+        idx = ext->head ? ext->head-1 : cap-1;
+        ext->head = idx;
+    }
+    else {
+        idx = ext->head + shadow.len;
+        if (idx >= cap) idx -= cap;
+    }
+    memcpy(((char *)s)+idx*shadow.sz, x, shadow.sz);
+    _sda_set_len(s, shadow.len+1);
+    return s;
+}
+
+void *sda_deque_pop_front_ptr(sda s) {
+    struct sda_hdr_uni shadow;
+    struct sda_ext *ext = _sda_ext(s);
+    size_t head;
+    assert(sda_flags(s)&SDA_FLAG_DEQUE);
+    sda_hdr(s, &shadow);
+    if (shadow.len < 1) return NULL;
+    head = ext->head;
+    //an empty ring might as well start over at 0
+    if (shadow.len == 1) ext->head = 0;
+    else ext->head = (head+1 == shadow.alloc/shadow.sz) ? 0 : head+1;
+    _sda_set_len(s, shadow.len-1);
+    return ((char *)s) + head*shadow.sz;
+}
+
+void *sda_deque_pop_back_ptr(sda s) {
+    void *ret;
+    size_t len = sda_len(s);
+    assert(sda_flags(s)&SDA_FLAG_DEQUE);
+    if (len < 1) return NULL;
+    ret = sda_deque_ptr_at(s, len-1);
+    if (len == 1) _sda_ext(s)->head = 0;
+    _sda_set_len(s, len-1);
+    return ret;
+}
+
+sda sda_deque_linearize(sda s) {
+    struct sda_hdr_uni shadow;
+    struct sda_ext *ext = _sda_ext(s);
+    size_t cap, n_front, n_back;
+    char *p;
+    assert(sda_flags(s)&SDA_FLAG_DEQUE);
+    if (ext->head == 0) return s;
+    //the copy comes out in order
+    if (sda_flags(s)&SDA_FLAG_SHARED) return sda_unshare(s);
+    p = s;
+    sda_hdr(s, &shadow);
+    cap = shadow.alloc/shadow.sz;
+    if (ext->head + shadow.len <= cap) {
+        //not wrapped, just slide it down
+        memmove(p, p+ext->head*shadow.sz, shadow.len*shadow.sz);
+    }
+    else {
+        //[0, n_back) holds the end of the deque, [head, cap) the start
+        n_front = cap - ext->head;
+        n_back = shadow.len - n_front;
+        if (cap - shadow.len >= n_front) {
+            //enough free room between them to move the end out of the way
+            memmove(p+n_front*shadow.sz, p, n_back*shadow.sz);
+            memcpy(p, p+ext->head*shadow.sz, n_front*shadow.sz);
+        }
+        else {
+            //rotate the whole buffer in place
+            _sda_reverse(p, ext->head*shadow.sz);
+            _sda_reverse(p+ext->head*shadow.sz, n_front*shadow.sz);
+            _sda_reverse(p, cap*shadow.sz);
+        }
+    }
+    ext->head = 0;
+    return s;
 }
 
 sda _sda_new_sz(const void *init, size_t init_sz, size_t type_sz) {
-    //can't use crazy large types
-    assert(type_sz <= UINT8_MAX);
+    //has to fit in the biggest header's sz
+    assert(type_sz > 0 && type_sz <= SDA_MAX_SZ);
     //must allocate an even number of elements
     assert(init_sz%type_sz == 0);
     
@@ -430,22 +1031,24 @@ sda _sda_new_sz(const void *init, size_t init_sz, size_t type_sz) {
     char *s;
     //flags pointer
     unsigned char *fp;
-    //converted type_sz
-    uint8_t sz = (uint8_t)type_sz;
+    size_t sz = type_sz;
     //len of new array
     size_t len = init_sz/sz;
     //how many bytes can we hold?
-    char sda_type = _sda_req_htype(init_sz, len);
+    char sda_type = _sda_req_htype(init_sz, len, sz);
     size_t hdr_sz = _sda_hdr_size(sda_type);
 
+    //SDA_FLAG_MMAP if it's big enough
+    unsigned char blk_flags = 0;
+
     //allocate the full sda
-    sh = _sda_malloc(hdr_sz+init_sz);
+    sh = _sda_blk_malloc(NULL, hdr_sz+init_sz, &blk_flags);
     if (sh == NULL) return NULL;
     if(init == NULL)
         memset(sh, 0, hdr_sz+init_sz);
     s = (char*)sh+hdr_sz;
     fp = ((unsigned char*)s)-1;
-    *fp = sda_type;
+    *fp = sda_type|blk_flags;
     switch(sda_type) {
         case SDA_HTYPE_SM: {
             SDA_HDR_VAR(SM,s);
@@ -474,12 +1077,310 @@ sda _sda_new_sz(const void *init, size_t init_sz, size_t type_sz) {
     return s;
 }
 
+sda _sda_new_ext(const void *init, size_t init_sz, size_t type_sz, size_t align, const struct sda_allocator *a) {
+    //has to fit in the biggest header's sz
+    assert(type_sz > 0 && type_sz <= SDA_MAX_SZ);
+    //must allocate an even number of elements
+    assert(init_sz%type_sz == 0);
+    //power of 2 that fits in the ext block
+    assert(align && (align&(align-1)) == 0 && align <= SDA_MAX_ALIGN);
+    
+    //ptr to the allocation
+    char *sh;
+    //ptr that we'll return
+    char *s;
+    struct sda_ext *ext;
+    size_t len = init_sz/type_sz;
+    char sda_type = _sda_req_htype(init_sz, len, type_sz);
+    size_t hdr_sz = _sda_hdr_size(sda_type);
+    size_t pre_sz = sizeof(struct sda_ext);
+    size_t pad;
+    unsigned char flags = sda_type|SDA_FLAG_EXT;
+
+    //need align-1 extra bytes to be able to shift buf into place
+    sh = _sda_blk_malloc(a, (align-1)+pre_sz+hdr_sz+init_sz, &flags);
+    if (sh == NULL) return NULL;
+    pad = _sda_align_pad(sh, pre_sz+hdr_sz, align);
+    memset(sh+pad, 0, pre_sz+hdr_sz);
+    s = sh+pad+pre_sz+hdr_sz;
+    if (align > 1) flags |= SDA_FLAG_ALIGNED;
+    _sda_set_flags(s, flags);
+    _sda_set_len(s, len);
+    _sda_set_alloc(s, init_sz);
+    _sda_set_sz(s, type_sz);
+    ext = _sda_ext(s);
+    ext->allocator = a;
+    if (align > 1) {
+        ext->align = align;
+        ext->pad = pad;
+    }
+    if (init_sz && init)
+        memcpy(s, init, init_sz);
+    else if (init_sz)
+        memset(s, 0, init_sz);
+    return s;
+}
+
+/******* mmap backend *******/
+
+void sda_mmap_set_threshold(size_t bytes) {
+#if defined(SDA_HAVE_MMAP)
+    //small blocks belong to the cache
+    if (bytes && bytes <= SDA_CACHE_MAX_SIZE) bytes = SDA_CACHE_MAX_SIZE+1;
+    _sda_mmap_threshold = bytes;
+#else
+    (void)bytes;
+#endif
+}
+
+size_t sda_mmap_get_threshold(void) {
+    return _sda_mmap_threshold;
+}
+
+/******* Statistics *******/
+
+void sda_stats_snapshot(struct sda_stats *out) {
+    unsigned used = __atomic_load_n(&_sda_stats_used, __ATOMIC_RELAXED);
+    uint64_t *sum = (uint64_t *)out;
+    const uint64_t *slot;
+    size_t n = sizeof(*out)/sizeof(uint64_t);
+
+    if (used > _SDA_STATS_SLOTS) used = _SDA_STATS_SLOTS;
+    memset(out, 0, sizeof(*out));
+    for (unsigned i = 0; i < used; i++) {
+        //every field is a uint64_t
+        slot = (const uint64_t *)&_sda_stats_slots[i].s;
+        for (size_t f = 0; f < n; f++) sum[f] += __atomic_load_n(&slot[f], __ATOMIC_RELAXED);
+    }
+}
+
+/******* Arenas *******/
+
+static inline size_t _sda_arena_round(size_t size) {
+    return (size + SDA_ARENA_ALIGN-1) & ~(size_t)(SDA_ARENA_ALIGN-1);
+}
+
+/* Start a new head block with room for at least size bytes */
+static struct sda_arena_block *_sda_arena_grow(struct sda_arena *arena, size_t size) {
+    struct sda_arena_block *b;
+    if (size < arena->block_sz) size = arena->block_sz;
+    b = s_malloc(sizeof(*b)+size);
+    if (b == NULL) return NULL;
+    b->next = arena->head;
+    b->size = size;
+    b->used = 0;
+    b->last = 0;
+    arena->head = b;
+    return b;
+}
+
+static void *_sda_arena_malloc(void *ctx, size_t size) {
+    struct sda_arena *arena = ctx;
+    struct sda_arena_block *b = arena->head;
+    size = _sda_arena_round(size);
+    if (b == NULL || b->size - b->used < size) {
+        b = _sda_arena_grow(arena, size);
+        if (b == NULL) return NULL;
+    }
+    b->last = b->used;
+    b->used += size;
+    return b->data + b->last;
+}
+
+static void *_sda_arena_realloc(void *ctx, void *ptr, size_t old_size, size_t size) {
+    struct sda_arena *arena = ctx;
+    struct sda_arena_block *b = arena->head;
+    void *ret;
+    //the last allocation can just move the end of the block
+    if (b != NULL && ptr == b->data + b->last && b->size - b->last >= size) {
+        b->used = b->last + _sda_arena_round(size);
+        return ptr;
+    }
+    ret = _sda_arena_malloc(ctx, size);
+    if (ret != NULL) memcpy(ret, ptr, (old_size < size) ? old_size : size);
+    return ret;
+}
+
+static void _sda_arena_free(void *ctx, void *ptr, size_t size) {
+    struct sda_arena *arena = ctx;
+    struct sda_arena_block *b = arena->head;
+    (void)size;
+    //only the last allocation can be given back before a reset
+    if (b != NULL && ptr == b->data + b->last) {
+        b->used = b->last;
+    }
+}
+
+struct sda_arena *sda_arena_new(size_t block_sz) {
+    struct sda_arena *arena = s_malloc(sizeof(*arena));
+    if (arena == NULL) return NULL;
+    arena->allocator.malloc = _sda_arena_malloc;
+    arena->allocator.realloc = _sda_arena_realloc;
+    arena->allocator.free = _sda_arena_free;
+    arena->allocator.ctx = arena;
+    arena->head = NULL;
+    arena->block_sz = _sda_arena_round(block_sz);
+    return arena;
+}
+
+void sda_arena_reset(struct sda_arena *arena) {
+    struct sda_arena_block *b = arena->head;
+    if (b == NULL) return;
+    //keep the newest block, it's usually the biggest
+    while (b->next != NULL) {
+        struct sda_arena_block *next = b->next->next;
+        s_free(b->next);
+        b->next = next;
+    }
+    b->used = 0;
+    b->last = 0;
+}
+
+void sda_arena_free(struct sda_arena *arena) {
+    if (arena == NULL) return;
+    while (arena->head != NULL) {
+        struct sda_arena_block *next = arena->head->next;
+        s_free(arena->head);
+        arena->head = next;
+    }
+    s_free(arena);
+}
+
+/******* Allocation cache *******/
+
+//per-thread lists of freed blocks, one for each size class
+struct _sda_cache_lists {
+    void *free[SDA_CACHE_MAX_SIZE/SDA_CACHE_GRAIN];
+    size_t retained;
+};
+static __thread struct _sda_cache_lists _sda_cache;
+static size_t _sda_cache_max = 0;
+
+static inline size_t _sda_cache_class(size_t size) {
+    if (size == 0) size = 1;
+    return (size-1)/SDA_CACHE_GRAIN;
+}
+
+void *_sda_cache_malloc(size_t size) {
+    size_t cls = _sda_cache_class(size);
+    void *ptr = _sda_cache.free[cls];
+    if (ptr != NULL) {
+        _sda_cache.free[cls] = *(void**)ptr;
+        _sda_cache.retained -= (cls+1)*SDA_CACHE_GRAIN;
+        return ptr;
+    }
+    return s_malloc((cls+1)*SDA_CACHE_GRAIN);
+}
+
+void *_sda_cache_realloc(void *ptr, size_t old_size, size_t size) {
+    void *newptr;
+    size_t cls = _sda_cache_class(size);
+    //still fits in the same class
+    if (_sda_cache_class(old_size) == cls) return ptr;
+    //the old block wouldn't be kept (always the case with the cache off), so let realloc try in place
+    if (_sda_cache.retained + (_sda_cache_class(old_size)+1)*SDA_CACHE_GRAIN > _sda_cache_max) {
+        return s_realloc(ptr, (cls+1)*SDA_CACHE_GRAIN);
+    }
+    newptr = _sda_cache_malloc(size);
+    if (newptr == NULL) return NULL;
+    memcpy(newptr, ptr, (old_size < size) ? old_size : size);
+    _sda_cache_free(ptr, old_size);
+    return newptr;
+}
+
+void _sda_cache_free(void *ptr, size_t size) {
+    size_t cls = _sda_cache_class(size);
+    size_t cls_sz = (cls+1)*SDA_CACHE_GRAIN;
+    if (_sda_cache.retained + cls_sz > _sda_cache_max) {
+        s_free(ptr);
+        return;
+    }
+    //the list is threaded through the freed blocks
+    *(void**)ptr = _sda_cache.free[cls];
+    _sda_cache.free[cls] = ptr;
+    _sda_cache.retained += cls_sz;
+}
+
+void sda_cache_set_max(size_t max) {
+    _sda_cache_max = max;
+}
+
+size_t sda_cache_get_max(void) {
+    return _sda_cache_max;
+}
+
+void sda_cache_trim(size_t keep) {
+    //biggest classes first, they free up the most
+    size_t cls = SDA_CACHE_MAX_SIZE/SDA_CACHE_GRAIN;
+    while (cls-- > 0 && _sda_cache.retained > keep) {
+        while (_sda_cache.free[cls] != NULL && _sda_cache.retained > keep) {
+            void *ptr = _sda_cache.free[cls];
+            _sda_cache.free[cls] = *(void**)ptr;
+            _sda_cache.retained -= (cls+1)*SDA_CACHE_GRAIN;
+            s_free(ptr);
+        }
+    }
+}
+
+size_t sda_cache_retained(void) {
+    return _sda_cache.retained;
+}
+
 
 /******* Test stuff *******/
 
 #if defined(SDA_TEST_MAIN)
 void _sda_raii_free(void *s);
 
+//header the array should have been given, every one is the same with SDA_FIXED_HDR
+#define _test_htype(t) _sda_htype(t)
+
+//grow to exactly what's needed plus ctx elements
+static size_t _test_grow(size_t alloc, size_t need, size_t sz, void *ctx) {
+    (void)alloc;
+    return need + sz*(size_t)ctx;
+}
+
+struct _test_point {
+    int16_t x, y, z;
+};
+SDA_DEFINE(int32_t, i32)
+SDA_DEFINE(struct _test_point, pt)
+
+//too big for an SM header's sz
+struct _test_rec {
+    uint32_t id;
+    char name[1020];
+};
+SDA_DEFINE(struct _test_rec, rec)
+
+static void _test_add(int32_t *x, void *ctx) {
+    *(int64_t *)ctx += *x;
+}
+
+//allocator that keeps track of what it's handing out
+struct _test_heap {
+    size_t mallocs, reallocs, frees;
+    size_t live;
+};
+static void *_test_malloc(void *ctx, size_t size) {
+    struct _test_heap *h = ctx;
+    h->mallocs++;
+    h->live += size;
+    return malloc(size);
+}
+static void *_test_realloc(void *ctx, void *ptr, size_t old_size, size_t size) {
+    struct _test_heap *h = ctx;
+    h->reallocs++;
+    h->live += size - old_size;
+    return realloc(ptr, size);
+}
+static void _test_free(void *ctx, void *ptr, size_t size) {
+    struct _test_heap *h = ctx;
+    h->frees++;
+    h->live -= size;
+    free(ptr);
+}
 
 int main(void) {
     int32_t tmp[] = {0, 1, 2, 3, 4, 5};
@@ -490,7 +1391,7 @@ int main(void) {
     assert(sda_len(s) == tmp_len);
     assert(sda_alloc(s) == sda_len(s)*sizeof(*s));
     assert(sda_avail(s) == 0);
-    assert(sda_flags(s) == SDA_HTYPE_SM);
+    assert(sda_flags(s) == _test_htype(SDA_HTYPE_SM));
     
     for(int i=0; i<sda_len(s); i++) {
         printf("  s[%d] %d\n", i, s[i]);
@@ -621,7 +1522,7 @@ int main(void) {
     uint8_t *huge   = malloc(huge_sz);
     sda_raii uint8_t *v = sda_new_sz(v, huge, huge_sz);
     printf("v len=%zu alloc=%zu avail=%zu\n",sda_len(v), sda_alloc(v), sda_avail(v));
-    assert((sda_flags(v)&SDA_HTYPE_MASK) == SDA_HTYPE_MD);
+    assert((sda_flags(v)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_MD));
     assert(sda_len(v) == huge_sz);
     huge[UINT16_MAX-74] = 0xff;
     v[UINT16_MAX-74] = 12;
@@ -640,13 +1541,750 @@ int main(void) {
     v = sda_cpy(v, 0, huge, huge_sz);
     assert(v != NULL);
     printf("v len=%zu alloc=%zu avail=%zu\n",sda_len(v), sda_alloc(v), sda_avail(v));
-    assert((sda_flags(v)&SDA_HTYPE_MASK) == SDA_HTYPE_LG);
+    assert((sda_flags(v)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_LG));
     assert(sda_len(v) == huge_sz);
     assert(sda_get(v, UINT32_MAX) == 12);
     huge[UINT32_MAX] = 0xff;
     assert(sda_get(v, UINT32_MAX) == 12);
 #endif
     
+    //bulk appends
+    sda_raii sdaint r = sda_empty(r);
+    r = sda_append_n(r, tmp, tmp_len);
+    assert(sda_len(r) == tmp_len);
+    r = sda_append_n(r, tmp, tmp_len);
+    assert(sda_len(r) == 2*tmp_len);
+    for(int i=0; i<sda_len(r); i++) {
+        assert(r[i] == tmp[i%tmp_len]);
+    }
+    r = sda_append_n(r, NULL, 0);
+    assert(sda_len(r) == 2*tmp_len);
+    r = sda_reserve(r, 100);
+    assert(sda_avail(r) >= 100);
+    //no more reallocs from here on
+    int *rbuf = r;
+    for(int i=0; i<50; i++) {
+        sda_push_unchecked(r, i);
+    }
+    assert(sda_len(r) == 2*tmp_len+50);
+    assert(sda_get(r, 2*tmp_len+49) == 49);
+    int *end = sda_end_ptr(r);
+    assert(end == &r[sda_len(r)]);
+    for(int i=0; i<50; i++) {
+        end[i] = -i;
+    }
+    sda_commit(r, 50);
+    assert(r == rbuf);
+    assert(sda_len(r) == 2*tmp_len+100);
+    assert(sda_get(r, sda_len(r)-1) == -49);
+    //already enough room
+    r = sda_reserve(r, sda_avail(r));
+    assert(r == rbuf);
+    
+    //views
+    struct sda_view rv = sda_view(r);
+    assert(rv.len == sda_len(r));
+    assert(rv.sz == sizeof(*r));
+    assert(sda_view_ptr_at(&rv, rv.len) == NULL);
+    assert(sda_view_get(&rv, int, rv.len) == 0);
+    for(int i=0; i<rv.len; i++) {
+        assert(sda_view_ptr_at(&rv, i) == &r[i]);
+        assert(sda_view_get(&rv, int, i) == r[i]);
+        assert(_sda_view_get(&rv, int, i) == r[i]);
+    }
+    size_t cnt = 0;
+    sda_view_foreach(&rv, int, p) {
+        assert(*p == r[cnt]);
+        cnt++;
+    }
+    assert(cnt == sda_len(r));
+    //step by sz even when T is smaller
+    cnt = 0;
+    sda_view_foreach(&rv, char, p) {
+        assert(p == (char*)&r[cnt]);
+        cnt++;
+    }
+    assert(cnt == sda_len(r));
+    cnt = 0;
+    sda_foreach(r, p) {
+        assert(*p == r[cnt]);
+        cnt++;
+    }
+    assert(cnt == sda_len(r));
+    rv = sda_view(v);
+    assert(rv.len == huge_sz);
+    assert(sda_view_get(&rv, uint8_t, UINT16_MAX-74) == 12);
+    
+    //aligned arrays
+    sda_raii sdaint al = sda_new_aligned(al, tmp, 64);
+    assert(((uintptr_t)al)%64 == 0);
+    assert(sda_flags(al)&SDA_FLAG_ALIGNED);
+    assert(sda_len(al) == tmp_len);
+    assert(memcmp(al, tmp, sizeof(tmp)) == 0);
+    assert(sda_total_size(al) == 63+sizeof(struct sda_ext)+_sda_hdr_size(sda_flags(al))+sda_alloc(al));
+    for(int i=0; i<2000; i++) {
+        al = sda_append(al, i);
+        assert(((uintptr_t)al)%64 == 0);
+    }
+    assert(sda_len(al) == tmp_len+2000);
+    assert(sda_get(al, 5) == 5);
+    assert(sda_get(al, tmp_len+1999) == 1999);
+    al = sda_set_growth(al, &sda_growth_legacy);
+    assert(((uintptr_t)al)%64 == 0);
+    al = sda_resize(al, sda_len(al)+10);
+    assert(((uintptr_t)al)%64 == 0);
+    //through header promotion and compaction
+    al = sda_resize(al, UINT16_MAX+10);
+    assert(((uintptr_t)al)%64 == 0);
+    assert((sda_flags(al)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_MD));
+    assert(sda_flags(al)&SDA_FLAG_ALIGNED);
+    assert(sda_get(al, tmp_len+1999) == 1999);
+    al = sda_compact(sda_resize(al, 100));
+    assert(((uintptr_t)al)%64 == 0);
+    assert(sda_alloc(al) == 100*sizeof(*al));
+    assert(sda_get(al, 99) == 99-tmp_len);
+    al = sda_clear(al);
+    al = sda_compact(al);
+    assert(((uintptr_t)al)%64 == 0);
+    assert(sda_get_growth(al) == &sda_growth_legacy);
+    sda_raii uint8_t *al2 = sda_empty_aligned(al2, 32);
+    assert(((uintptr_t)al2)%32 == 0);
+    assert(sda_len(al2) == 0);
+    al2 = sda_cat(al2, "0123456789", 10);
+    assert(((uintptr_t)al2)%32 == 0);
+    assert(memcmp(al2, "0123456789", 10) == 0);
+    
+    //custom allocators
+    struct _test_heap heap = {0, 0, 0, 0};
+    struct sda_allocator test_alloc = {_test_malloc, _test_realloc, _test_free, &heap};
+    sdaint ca = sda_new_with(ca, tmp, &test_alloc);
+    assert(heap.mallocs == 1);
+    assert(heap.live == sda_total_size(ca));
+    assert(sda_len(ca) == tmp_len);
+    assert(memcmp(ca, tmp, sizeof(tmp)) == 0);
+    ca = sda_resize(ca, 1000);
+    assert(heap.reallocs > 0);
+    assert(heap.live == sda_total_size(ca));
+    //header promotion and demotion are reallocs too
+    ca[999] = 999;
+    ca = sda_resize(ca, UINT16_MAX+1);
+    assert((sda_flags(ca)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_MD));
+    assert(heap.live == sda_total_size(ca));
+    assert(heap.mallocs == 1);
+    assert(sda_get(ca, 999) == 999);
+    assert(sda_get(ca, 5) == 5);
+    ca = sda_resize(ca, 1000);
+    ca = sda_compact(ca);
+    assert((sda_flags(ca)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_SM));
+    assert(heap.mallocs == 1);
+    assert(sda_get(ca, 999) == 999);
+    ca = sda_compact(sda_resize(ca, 10));
+    assert(heap.live == sda_total_size(ca));
+    assert(sda_get(ca, 5) == 5);
+    ca = sda_set_growth(ca, &sda_growth_legacy);
+    assert(heap.live == sda_total_size(ca));
+    ca = sda_free(ca);
+    assert(heap.live == 0);
+    assert(heap.mallocs == heap.frees);
+    //with alignment too
+    sda_raii sdaint ca2 = sda_new_sz_aligned_with(ca2, NULL, 0, 64, &test_alloc);
+    assert(((uintptr_t)ca2)%64 == 0);
+    for(int i=0; i<1000; i++) {
+        ca2 = sda_append(ca2, i);
+        assert(((uintptr_t)ca2)%64 == 0);
+    }
+    assert(heap.live == sda_total_size(ca2));
+    assert(sda_get(ca2, 999) == 999);
+    
+    //arenas
+    struct sda_arena *arena = sda_arena_new(1024);
+    sdaint ar1 = sda_new_in(ar1, tmp, arena);
+    assert(sda_len(ar1) == tmp_len);
+    assert(memcmp(ar1, tmp, sizeof(tmp)) == 0);
+    assert(_sda_allocator(ar1) == &arena->allocator);
+    //last allocation in the block grows in place
+    sdaint ar1_old = ar1;
+    ar1 = sda_resize(ar1, 50);
+    assert(ar1 == ar1_old);
+    assert(sda_get(ar1, 5) == 5);
+    sdachar ar2 = sda_empty_in(ar2, arena);
+    ar2 = sda_cat(ar2, "hello", 5);
+    //not the last allocation anymore, has to move
+    ar1 = sda_resize(ar1, 200);
+    assert(ar1 != ar1_old);
+    assert(sda_len(ar1) == 200);
+    assert(sda_get(ar1, 5) == 5);
+    assert(memcmp(ar2, "hello", 5) == 0);
+    //bigger than a block
+    ar1 = sda_resize(ar1, 10000);
+    assert(sda_len(ar1) == 10000);
+    assert(sda_get(ar1, 5) == 5);
+    assert(((uintptr_t)sda_total_ptr(ar1))%SDA_ARENA_ALIGN == 0);
+    assert(arena->head->next != NULL);
+    //freeing is optional
+    ar2 = sda_free(ar2);
+    sda_arena_reset(arena);
+    assert(arena->head->next == NULL);
+    assert(arena->head->used == 0);
+    ar1 = sda_new_in(ar1, tmp, arena);
+    assert(sda_total_ptr(ar1) == arena->head->data);
+    assert(sda_get(ar1, 3) == 3);
+    sda_arena_free(arena);
+    
+    //allocation cache
+    assert(sda_cache_get_max() == 0);
+    sdaint cc = sda_new(cc, tmp);
+    //with the cache off resizes go straight to realloc
+    cc = sda_resize(cc, 100);
+    assert(sda_cache_retained() == 0 && cc[5] == 5);
+    cc = sda_free(cc);
+    assert(sda_cache_retained() == 0);
+    sda_cache_set_max(1024);
+    cc = sda_new(cc, tmp);
+    void *cc_total = sda_total_ptr(cc);
+    cc = sda_free(cc);
+    assert(sda_cache_retained() == _sda_cache_round(sizeof(tmp)+_sda_hdr_size(_test_htype(SDA_HTYPE_SM))));
+    //same size class comes straight back out
+    sdachar cc2 = sda_new(cc2, "abcdefghijklmnopqrstuvw");
+    assert(sda_total_ptr(cc2) == cc_total);
+    assert(sda_cache_retained() == 0);
+    assert(strcmp(cc2, "abcdefghijklmnopqrstuvw") == 0);
+    //grow it out of its class and back
+    cc2 = sda_resize(cc2, 100);
+    cc2 = sda_compact(sda_resize(cc2, 3));
+    assert(memcmp(cc2, "abc", 3) == 0);
+    //blocks it grew out of got cached along the way
+    assert(sda_cache_retained() > 0);
+    size_t cc_retained = sda_cache_retained();
+    size_t cc2_total = _sda_cache_round(3+_sda_hdr_size(_test_htype(SDA_HTYPE_SM)));
+    cc2 = sda_free(cc2);
+    assert(sda_cache_retained() == cc_retained+cc2_total);
+    //can't go past the max
+    sdaint ccs[32];
+    for(int i=0; i<32; i++) {
+        ccs[i] = sda_new_sz(ccs[i], NULL, 100*sizeof(int));
+    }
+    for(int i=0; i<32; i++) {
+        ccs[i] = sda_free(ccs[i]);
+    }
+    assert(sda_cache_retained() <= 1024);
+    assert(sda_cache_retained() > cc_retained+cc2_total);
+    sda_cache_trim(16);
+    assert(sda_cache_retained() <= 16);
+    sda_cache_trim(0);
+    assert(sda_cache_retained() == 0);
+    sda_cache_set_max(0);
+    
+    //mmap backend
+    assert(sda_mmap_get_threshold() == 0);
+    sda_mmap_set_threshold(1<<20);
+    sda_raii uint8_t *mm = sda_new_sz(mm, NULL, 1000);
+    assert(!(sda_flags(mm)&SDA_FLAG_MMAP));
+    mm[999] = 7;
+    mm = sda_resize(mm, (1<<20)+1);
+    assert(sda_flags(mm)&SDA_FLAG_MMAP);
+    assert(sda_get(mm, 999) == 7);
+    assert(sda_get(mm, 1<<20) == 0);
+    mm[1<<20] = 9;
+    //mremap from here on
+    mm = sda_resize(mm, 8<<20);
+    assert(sda_flags(mm)&SDA_FLAG_MMAP);
+    assert(sda_get(mm, 999) == 7);
+    assert(sda_get(mm, 1<<20) == 9);
+    mm = sda_set_growth(mm, &sda_growth_legacy);
+    assert(sda_flags(mm)&SDA_FLAG_MMAP);
+    assert(sda_get(mm, 999) == 7);
+    assert(sda_get(mm, 1<<20) == 9);
+    //back to the heap when it shrinks
+    mm = sda_compact(sda_resize(mm, 2000));
+    assert(!(sda_flags(mm)&SDA_FLAG_MMAP));
+    assert(sda_alloc(mm) == 2000);
+    assert(sda_get(mm, 999) == 7);
+    //straight into mmap
+    sda_raii sdaint mm2 = sda_new_sz(mm2, NULL, 2<<20);
+    assert(sda_flags(mm2)&SDA_FLAG_MMAP);
+    assert(sda_get(mm2, 1000) == 0);
+    mm2 = sda_resize(mm2, UINT16_MAX*16);
+    assert(sda_flags(mm2)&SDA_FLAG_MMAP);
+    assert((sda_flags(mm2)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_MD));
+    sda_raii sdaint mm3 = sda_new_sz_aligned(mm3, NULL, 2<<20, 64);
+    assert(sda_flags(mm3)&SDA_FLAG_MMAP);
+    assert(((uintptr_t)mm3)%64 == 0);
+    mm3 = sda_resize(mm3, 4<<20);
+    assert(((uintptr_t)mm3)%64 == 0);
+    sda_mmap_set_threshold(0);
+    
+    //slice, cmp, index and join
+    sda_raii sdachar sl = sda_new(sl, "Hello World");
+    sda_slice(sl, 1, -2);
+    assert(sda_len(sl) == 10);
+    assert(memcmp(sl, "ello World", 10) == 0);
+    sda_raii sdaint sli = sda_new(sli, tmp);
+    sda_slice(sli, 2, 4);
+    assert(sda_len(sli) == 3);
+    assert(sli[0] == 2 && sli[2] == 4);
+    sda_slice(sli, -2, 100);
+    assert(sda_len(sli) == 2);
+    assert(sli[0] == 3 && sli[1] == 4);
+    sda_slice(sli, 5, 8);
+    assert(sda_len(sli) == 0);
+    sda_raii sdaint c1 = sda_new(c1, tmp);
+    sda_raii sdaint c2 = sda_new(c2, tmp);
+    assert(sda_cmp(c1, c2) == 0);
+    c2 = sda_resize(c2, tmp_len-1);
+    assert(sda_cmp(c1, c2) > 0);
+    assert(sda_cmp(c2, c1) < 0);
+    //only the first byte of the 4th element differs
+    ((char *)&c1[3])[0] = 0x7f;
+    c2 = sda_append(c2, 5);
+    assert(sda_cmp(c1, c2) > 0);
+    sda_raii sdaint ix = sda_empty(ix);
+    for(int i=0; i<100; i++) {
+        ix = sda_append(ix, i*3);
+    }
+    assert(sda_index(ix, 0) == 0);
+    assert(sda_index(ix, 3*37) == 37);
+    assert(sda_index(ix, 3*99) == 99);
+    assert(sda_index(ix, 1) == SDA_NPOS);
+    int run[] = {30, 33, 36};
+    assert(_sda_index(ix, run, sizeof(run)) == 10);
+    run[2] = 0;
+    assert(_sda_index(ix, run, sizeof(run)) == SDA_NPOS);
+    assert(sda_index(sl, 'W') == 5);
+    assert(_sda_index(sl, "World", 5) == 5);
+    assert(_sda_index(sl, "Worlds", 6) == SDA_NPOS);
+    sda_raii uint16_t *ix16 = sda_new_sz(ix16, NULL, 50*sizeof(uint16_t));
+    ix16[49] = 7;
+    ix16[17] = 7;
+    assert(sda_index(ix16, 7) == 17);
+    assert(sda_index(ix16, 8) == SDA_NPOS);
+    sda_raii uint64_t *ix64 = sda_new_sz(ix64, NULL, 21*sizeof(uint64_t));
+    ix64[20] = 0x100000000ULL;
+    ix64[3] = 0x1ULL;
+    ix64[9] = 0x100000001ULL;
+    assert(sda_index(ix64, 0x100000000ULL) == 20);
+    assert(sda_index(ix64, 0x100000001ULL) == 9);
+    assert(sda_index(ix64, 0x1ULL) == 3);
+    struct rgb { uint8_t r, g, b; } rgbs[] = {{1,2,3}, {4,5,6}, {7,8,9}};
+    sda_raii struct rgb *ix3 = sda_new(ix3, rgbs);
+    struct rgb want = {7,8,9};
+    assert(_sda_index(ix3, &want, sizeof(want)) == 2);
+    want.b = 0;
+    assert(_sda_index(ix3, &want, sizeof(want)) == SDA_NPOS);
+    sda parts[] = {c1, c2, sli};
+    int sep[] = {-1, -2};
+    sda_raii sdaint joined = sda_join(joined, parts, 3, sep, sizeof(sep));
+    assert(sda_len(joined) == sda_len(c1)+sda_len(c2)+sda_len(sli)+4);
+    assert(joined[tmp_len] == -1 && joined[tmp_len+1] == -2);
+    assert(sda_get(joined, sda_len(joined)-1) == -2);
+    char *strs[] = {"a", "bc", "def"};
+    sda_raii sdachar js = sda_join_str(strs, 3, ", ");
+    assert(strcmp(js, "a, bc, def") == 0);
+    assert(sda_len(js) == strlen("a, bc, def")+1);
+    
+    //growth policies
+    assert(sda_get_growth_default() == &sda_growth_geometric);
+    sda_raii sdaint w = sda_empty(w);
+    assert(sda_get_growth(w) == &sda_growth_geometric);
+    w = sda_resize(w, 100);
+    printf("w len=%zu alloc=%zu avail=%zu\n",sda_len(w), sda_alloc(w), sda_avail(w));
+    assert(sda_alloc(w) == 2*100*sizeof(*w));
+    //per-array policy adds an extension block in front of the header
+    w = sda_set_growth(w, &sda_growth_legacy);
+    assert(sda_flags(w)&SDA_FLAG_EXT);
+    assert(sda_get_growth(w) == &sda_growth_legacy);
+    assert(sda_len(w) == 100);
+    assert(sda_total_size(w) == sizeof(struct sda_ext)+_sda_hdr_size(sda_flags(w))+sda_alloc(w));
+    w = sda_resize(w, 300);
+    assert(sda_alloc(w) == 300*sizeof(*w)+SDA_MAX_PREALLOC);
+    for(int i=0; i<sda_len(w); i++) {
+        assert(w[i] == 0);
+    }
+    //callback
+    struct sda_growth exact = {0, 0, _test_grow, (void*)3};
+    w = sda_set_growth(w, &exact);
+    w = sda_resize(w, 1000);
+    assert(sda_alloc(w) == 1003*sizeof(*w));
+    assert(sda_avail(w) == 3);
+    //ext block has to survive header promotion
+    w = sda_resize(w, UINT16_MAX+1);
+    assert((sda_flags(w)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_MD));
+    assert(sda_flags(w)&SDA_FLAG_EXT);
+    assert(sda_get_growth(w) == &exact);
+    assert(sda_avail(w) == 3);
+    w[UINT16_MAX] = 42;
+    w = sda_compact(w);
+    assert(sda_avail(w) == 0);
+    assert(sda_get_growth(w) == &exact);
+    assert(sda_get(w, UINT16_MAX) == 42);
+    //and back to the default
+    w = sda_set_growth(w, NULL);
+    assert(sda_get_growth(w) == &sda_growth_geometric);
+    //capped global default
+    struct sda_growth capped = {4.0, 64, NULL, NULL};
+    sda_set_growth_default(&capped);
+    sda_raii sdaint x = sda_empty(x);
+    x = sda_resize(x, 4);
+    assert(sda_alloc(x) == 4*4*sizeof(*x));
+    x = sda_resize(x, 1000);
+    assert(sda_alloc(x) == 1000*sizeof(*x)+64);
+    sda_set_growth_default(NULL);
+    assert(sda_get_growth_default() == &sda_growth_geometric);
+    
+    //stack arrays
+    {
+        sda_raii sdaint st = sda_stack(st, 8);
+        sda_raii sdaint st2 = sda_stack(st2, 4);
+        void *inline_buf = st;
+        assert(sda_flags(st) == (_test_htype(SDA_HTYPE_SM)|SDA_FLAG_STACK));
+        assert(sda_len(st) == 0);
+        assert(sda_alloc(st) == 8*sizeof(*st));
+        assert(((uintptr_t)st)%8 == 0);
+        for(int i=0; i<8; i++) st = sda_append(st, i);
+        //still inline
+        assert(st == inline_buf);
+        st = sda_compact(st);
+        assert(st == inline_buf);
+        //spills on the first growth
+        st = sda_append(st, 8);
+        assert(st != inline_buf);
+        assert(!(sda_flags(st)&SDA_FLAG_STACK));
+        assert(sda_len(st) == 9);
+        for(int i=0; i<9; i++) assert(st[i] == i);
+        //and is a normal array after that
+        st = sda_resize(st, UINT16_MAX+1);
+        assert((sda_flags(st)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_MD));
+        assert(st[8] == 8);
+        //adding an ext block moves it off the stack too
+        st2 = sda_append(st2, 7);
+        inline_buf = st2;
+        st2 = sda_set_growth(st2, &sda_growth_legacy);
+        assert(st2 != inline_buf);
+        assert(sda_flags(st2) == (_test_htype(SDA_HTYPE_SM)|SDA_FLAG_EXT));
+        assert(sda_len(st2) == 1 && st2[0] == 7);
+        //freeing one that never left is fine
+        sda_raii sdachar st3 = sda_stack(st3, 16);
+        st3 = sda_cat(st3, "hello", 6);
+        assert(strcmp(st3, "hello") == 0);
+        assert(sda_free(sda_stack(st3, 2)) == NULL);
+    }
+    
+    //deques
+    {
+        sda_raii sdaint dq = sda_deque_empty(dq);
+        int model[64], m_head = 0, m_len = 0;
+        assert(sda_flags(dq)&SDA_FLAG_DEQUE);
+        assert(sda_deque_pop_front(dq) == 0);
+        assert(sda_deque_pop_back(dq) == 0);
+        dq = sda_deque_push_back(dq, 1);
+        dq = sda_deque_push_back(dq, 2);
+        dq = sda_deque_push_front(dq, 0);
+        assert(sda_len(dq) == 3);
+        assert(sda_deque_get(dq, 0) == 0 && sda_deque_get(dq, 2) == 2);
+        assert(sda_deque_ptr_at(dq, 3) == NULL);
+        assert(sda_deque_pop_front(dq) == 0);
+        assert(sda_deque_pop_back(dq) == 2);
+        assert(sda_deque_pop_back(dq) == 1);
+        assert(sda_len(dq) == 0 && _sda_ext(dq)->head == 0);
+        //FIFO that keeps wrapping around and growing while wrapped
+        for(int i=0; i<2000; i++) {
+            if(i%3 != 2) {
+                dq = sda_deque_push_back(dq, i);
+                model[(m_head+m_len++)%64] = i;
+            }
+            else {
+                assert(sda_deque_pop_front(dq) == model[m_head]);
+                m_head = (m_head+1)%64;
+                m_len--;
+            }
+            if(m_len == 60) {
+                //drain some, from the back too
+                for(int j=0; j<30; j++) {
+                    assert(sda_deque_pop_back(dq) == model[(m_head+m_len-1)%64]);
+                    m_len--;
+                }
+            }
+            assert(sda_len(dq) == (size_t)m_len);
+        }
+        for(int i=0; i<m_len; i++) assert(sda_deque_get(dq, i) == model[(m_head+i)%64]);
+        //push_front wraps the head backwards
+        for(int i=0; i<5; i++) {
+            dq = sda_deque_push_front(dq, -i);
+            m_head = (m_head+63)%64;
+            model[m_head] = -i;
+            m_len++;
+        }
+        assert(_sda_ext(dq)->head != 0);
+        //compact has to unwrap it first
+        dq = sda_compact(dq);
+        assert(sda_avail(dq) == 0);
+        assert(_sda_ext(dq)->head == 0);
+        for(int i=0; i<m_len; i++) assert(dq[i] == model[(m_head+i)%64]);
+        //both ways of linearizing a wrapped ring
+        for(int gap=0; gap<2; gap++) {
+            static const struct sda_growth no_slack = {1.0, 0, NULL, NULL};
+            sda_raii sdaint lin = sda_deque_empty(lin);
+            lin = sda_set_growth(lin, &no_slack);
+            lin = sda_reserve(lin, 10);
+            assert(sda_alloc(lin) == 10*sizeof(*lin));
+            for(int i=0; i<8; i++) lin = sda_deque_push_back(lin, i);
+            for(int i=0; i<6; i++) sda_deque_pop_front(lin);
+            //6, 7 are at the end, 8.. wrap to the front
+            for(int i=8; i<(gap ? 11 : 14); i++) lin = sda_deque_push_back(lin, i);
+            assert(_sda_ext(lin)->head == 6);
+            assert(sda_deque_linearize(lin) == lin);
+            assert(_sda_ext(lin)->head == 0);
+            for(int i=0; i<sda_len(lin); i++) assert(lin[i] == i+6);
+            lin = sda_append(lin, 99);
+        }
+        //plain arrays can be turned into deques
+        int init[] = {5, 6, 7};
+        sda_raii sdaint mk = sda_new(mk, init);
+        mk = sda_make_deque(mk);
+        assert(sda_deque_pop_front(mk) == 5);
+        mk = sda_deque_push_back(mk, 8);
+        assert(sda_deque_get(mk, 2) == 8);
+    }
+
+    //copy on write sharing
+    {
+        int init[] = {1, 2, 3, 4};
+        sdaint a = sda_new(a, init);
+        sdaint b, c, d;
+        assert(sda_refcount(a) == 1);
+        //sharing the first time adds the ext block, a is updated
+        b = sda_share(a);
+        assert(a == b);
+        assert(sda_flags(a)&SDA_FLAG_SHARED);
+        c = sda_share(a);
+        assert(c == a && sda_refcount(a) == 3);
+        //readers see the same buffer, writers get their own
+        b = sda_set(b, 0, 10);
+        assert(b != a && b[0] == 10 && a[0] == 1);
+        assert(sda_refcount(a) == 2 && sda_refcount(b) == 1);
+        assert(!(sda_flags(b)&SDA_FLAG_SHARED));
+        c = sda_append(c, 5);
+        assert(c != a && sda_len(c) == 5 && sda_len(a) == 4);
+        //a reserve promoted the header, the private copy only needs SM
+        sdachar big = sda_new(big, "xy");
+        big = sda_reserve(big, 70000);
+        assert((sda_flags(big)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_MD));
+        sdachar big2 = sda_share(big);
+        big2 = sda_set(big2, 1, (char)'Z');
+        assert(big2 != big && big2[0] == 'x' && big2[1] == 'Z' && big[1] == 'y');
+        assert((sda_flags(big2)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_SM));
+        sda_free(big2);
+        sda_free(big);
+        assert(memcmp(a, init, sizeof(init)) == 0);
+        //a is the last holder now, it writes in place
+        assert(sda_refcount(a) == 1);
+        d = a;
+        a = sda_set(a, 1, 20);
+        assert(a == d && a[1] == 20);
+        //shrinking and growing too
+        d = sda_share(a);
+        d = sda_resize(d, 2);
+        assert(d != a && sda_len(d) == 2 && sda_len(a) == 4);
+        d = sda_free(d);
+        d = sda_share(a);
+        d = sda_cat(d, init, sizeof(init));
+        assert(sda_len(d) == 8 && sda_len(a) == 4);
+        d = sda_free(d);
+        d = sda_share(a);
+        d = sda_replace(d, b);
+        assert(d != a && d[0] == 10 && a[0] == 1);
+        assert(sda_refcount(a) == 1);
+        sda_free(d);
+        //the array goes away with the last sda_free
+        d = sda_share(a);
+        a = sda_free(a);
+        assert(sda_refcount(d) == 1 && d[1] == 20);
+        sda_free(d);
+        sda_free(b);
+        sda_free(c);
+
+        //shared deques come out in order
+        sdaint dq = sda_deque_empty(dq);
+        for(int i=0; i<6; i++) dq = sda_deque_push_back(dq, i);
+        for(int i=0; i<3; i++) sda_deque_pop_front(dq);
+        for(int i=1; i<3; i++) dq = sda_deque_push_front(dq, -i);
+        assert(_sda_ext(dq)->head != 0);
+        d = sda_share(dq);
+        d = sda_deque_push_back(d, 6);
+        assert(d != dq && sda_len(d) == 6 && sda_len(dq) == 5);
+        for(int i=0; i<5; i++) assert(sda_deque_get(d, i) == sda_deque_get(dq, i));
+        assert(sda_deque_get(d, 5) == 6);
+        sda_free(d);
+        //linearizing a shared one can't move it under the others
+        d = sda_share(dq);
+        int *head = sda_deque_ptr_at(dq, 0);
+        d = sda_deque_linearize(d);
+        assert(d != dq && sda_deque_ptr_at(dq, 0) == head);
+        for(int i=0; i<5; i++) assert(d[i] == sda_deque_get(dq, i));
+        sda_free(d);
+        sda_free(dq);
+
+        //the copy keeps the allocator and growth policy
+        struct _test_heap heap = {0};
+        struct sda_allocator alloc = {_test_malloc, _test_realloc, _test_free, &heap};
+        a = sda_new_with(a, init, &alloc);
+        a = sda_set_growth(a, &sda_growth_legacy);
+        b = sda_share(a);
+        b = sda_prealloc(b, 64*sizeof(*b));
+        assert(b != a && _sda_allocator(b) == &alloc);
+        assert(sda_get_growth(b) == &sda_growth_legacy);
+        assert(heap.live > 0);
+        sda_free(a);
+        sda_free(b);
+        assert(heap.live == 0);
+    }
+
+    //typed arrays
+    {
+        int32_t *ti = sda_i32_new(0);
+        int64_t sum = 0;
+        for(int32_t i=0; i<70000; i++) ti = sda_i32_push(ti, i);
+        //went through the SM->MD promotion on the way
+        assert((sda_flags(ti)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_MD));
+        assert(sda_i32_len(ti) == 70000 && sda_len(ti) == 70000);
+        assert(sda_i32_end(ti) == ti+70000);
+        assert(sda_i32_get(ti, 69999) == 69999 && sda_i32_get(ti, 70000) == 0);
+        //mixes with the untyped calls
+        ti = sda_append(ti, (int32_t)-1);
+        assert(sda_i32_pop(ti) == -1);
+        assert(sda_get(ti, 123) == 123);
+        ti = sda_i32_set(ti, 5, 500);
+        assert(ti[5] == 500);
+        ti = sda_i32_set(ti, 70000, 1);
+        assert(sda_len(ti) == 70000);
+        sda_i32_foreach(ti, _test_add, &sum);
+        assert(sum == (int64_t)69999*70000/2 - 5 + 500);
+        //reserve leaves room for pushes that don't move it
+        ti = sda_i32_reserve(ti, 100);
+        int32_t *before = ti;
+        for(int i=0; i<100; i++) ti = sda_i32_push(ti, i);
+        assert(ti == before);
+        //shared arrays get copied on write
+        int32_t *other = sda_share(ti);
+        other = sda_i32_set(other, 0, 42);
+        assert(other != ti && ti[0] == 0 && other[0] == 42);
+        int32_t *third = sda_share(ti);
+        third = sda_i32_push(third, 7);
+        assert(third != ti && sda_i32_len(third) == sda_i32_len(ti)+1);
+        sda_free(third);
+        sda_free(other);
+        while(sda_i32_len(ti)) sda_i32_pop(ti);
+        assert(sda_i32_pop(ti) == 0);
+        sda_free(ti);
+
+        //struct elements
+        struct _test_point *pts = sda_pt_new(2);
+        assert(sda_sz(pts) == sizeof(struct _test_point));
+        pts = sda_pt_push(pts, (struct _test_point){1, 2, 3});
+        assert(sda_pt_len(pts) == 3 && sda_pt_get(pts, 2).z == 3 && sda_pt_get(pts, 0).x == 0);
+        assert(sda_pt_get(pts, 3).y == 0);
+        assert(sda_pt_pop(pts).y == 2);
+        sda_free(pts);
+    }
+
+    //wide elements
+    {
+        struct _test_rec rec = {0};
+        struct _test_rec *recs = sda_rec_new(0);
+        assert(sda_sz(recs) == sizeof(rec));
+        assert((sda_flags(recs)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_MD));
+        for(uint32_t i=0; i<100; i++) {
+            rec.id = i;
+            snprintf(rec.name, sizeof(rec.name), "rec%u", i);
+            recs = sda_rec_push(recs, rec);
+        }
+        assert(sda_len(recs) == 100 && sda_size(recs) == 100*sizeof(rec));
+        assert(recs[57].id == 57 && strcmp(recs[57].name, "rec57") == 0);
+        //past the end zeroes the gap
+        rec.id = 150;
+        recs = sda_cpy(recs, 150, &rec, sizeof(rec));
+        assert(sda_len(recs) == 151 && recs[150].id == 150);
+        assert(recs[120].id == 0 && recs[120].name[0] == 0);
+        recs = sda_prealloc(recs, 10*sizeof(rec));
+        assert(sda_avail(recs) >= 10);
+        recs = sda_compact(recs);
+        assert(sda_avail(recs) == 0 && sda_alloc(recs) == 151*sizeof(rec));
+        assert((sda_flags(recs)&SDA_HTYPE_MASK) == _test_htype(SDA_HTYPE_MD));
+        assert(recs[99].id == 99 && strcmp(recs[99].name, "rec99") == 0);
+        recs = sda_resize(recs, 2);
+        recs = sda_compact(recs);
+        assert(sda_len(recs) == 2 && sda_sz(recs) == sizeof(rec) && recs[1].id == 1);
+        assert(sda_rec_pop(recs).id == 1);
+        sda_free(recs);
+        //and in a deque
+        struct _test_rec *rq = sda_deque_empty(rq);
+        for(uint32_t i=0; i<20; i++) {
+            rec.id = i;
+            rq = sda_deque_push_front(rq, rec);
+        }
+        assert(sda_len(rq) == 20 && ((struct _test_rec *)sda_deque_pop_back_ptr(rq))->id == 0);
+        assert(((struct _test_rec *)sda_deque_pop_front_ptr(rq))->id == 19);
+        sda_free(rq);
+
+        //only fits in a LG header
+        struct _test_huge { char b[70000]; } *hg = sda_new_sz(hg, NULL, 2*sizeof(*hg));
+        assert(sda_sz(hg) == sizeof(*hg) && sda_len(hg) == 2);
+        assert((sda_flags(hg)&SDA_HTYPE_MASK) == SDA_HTYPE_LG);
+        static struct _test_huge one;
+        one.b[69999] = 7;
+        hg = sda_cpy(hg, 1, &one, sizeof(one));
+        hg = sda_cpy(hg, 3, &one, sizeof(one));
+        assert(sda_len(hg) == 4 && hg[3].b[69999] == 7 && hg[2].b[69999] == 0);
+        hg = sda_compact(hg);
+        assert(sda_avail(hg) == 0 && (sda_flags(hg)&SDA_HTYPE_MASK) == SDA_HTYPE_LG);
+        assert(hg[1].b[69999] == 7 && hg[3].b[69999] == 7);
+        sda_free(hg);
+    }
+
+    //stats
+    {
+        static const struct sda_growth exact = {1.0, 0, NULL, NULL};
+        struct sda_stats before, after;
+        sda_stats_snapshot(&before);
+        uint8_t *st = sda_new_sz(st, NULL, 10);
+        st = sda_set_growth(st, &exact);
+        st = sda_prealloc(st, 100);
+        assert(sda_avail(st) == 100);
+        sda_stats_snapshot(&after);
+        assert(after.mallocs == before.mallocs+1);
+        //adding the ext block and growing
+        assert(after.reallocs == before.reallocs+2);
+        assert(after.reallocs_in_place+after.reallocs_moved == after.reallocs);
+        assert(after.slack_grown == before.slack_grown);
+        assert(after.bytes_copied > before.bytes_copied);
+        before = after;
+        st = sda_resize(st, UINT16_MAX+1);
+        sda_stats_snapshot(&after);
+        int promoted = _test_htype(SDA_HTYPE_MD) == SDA_HTYPE_MD;
+        assert(after.promote_md == before.promote_md+promoted);
+        assert(after.promote_lg == before.promote_lg);
+        //the bigger header slides the elements up, without one realloc might not move them
+        if (promoted) assert(after.bytes_copied >= before.bytes_copied+10);
+        st = sda_set_growth(st, &sda_growth_geometric);
+        before = after;
+        st = sda_append(st, (uint8_t)1);
+        sda_stats_snapshot(&after);
+        assert(after.slack_grown == before.slack_grown+sda_avail(st));
+        before = after;
+        size_t slack = sda_avail(st);
+        sda_free(st);
+        sda_stats_snapshot(&after);
+        assert(after.frees == before.frees+1);
+        assert(after.slack_freed == before.slack_freed+slack);
+        //arrays on the stack don't count until they spill
+        before = after;
+        uint8_t *small = sda_stack(small, 4);
+        small = sda_append(small, (uint8_t)1);
+        sda_free(small);
+        sda_stats_snapshot(&after);
+        assert(after.mallocs == before.mallocs && after.frees == before.frees && after.slack_freed == before.slack_freed);
+    }
+    
     puts("done");
     free(huge);
     huge = NULL;
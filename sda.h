@@ -34,13 +34,14 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <string.h>
+#include <assert.h>
 #include "sdsalloc.h"
 
 #if defined(SDA_TEST_MAIN)
 #include <stdio.h>
 #endif
 
-//Determines the maximum number of bytes to pre-allocate, must be multiples of 64
+//Determines the maximum number of bytes to pre-allocate with sda_growth_legacy, must be multiples of 64
 #define SDA_MAX_PREALLOC (64*4)
 
 //Types designed for type-checking arguments to functions that may use sda arrays
@@ -72,8 +73,8 @@ struct __attribute__ ((__packed__)) sda_hdr_SM {
 struct __attribute__ ((__packed__)) sda_hdr_MD {
     uint64_t alloc;
     uint32_t len;
-    uint8_t sz;
-    uint8_t _pad[2]; // padding to make sure 64b accesses to buf[] are aligned
+    uint16_t sz;
+    uint8_t _pad[1]; // padding to make sure 64b accesses to buf[] are aligned
     unsigned char flags;
     char buf[];
 };
@@ -81,16 +82,43 @@ struct __attribute__ ((__packed__)) sda_hdr_MD {
 struct __attribute__ ((__packed__)) sda_hdr_LG {
     uint64_t alloc; //use uint64 over size_t to make sure 64b accesses are aligned on all arch's
     uint64_t len;
-    uint8_t sz;
-    uint8_t _pad[6]; // padding to make sure 64b accesses to buf[] are aligned
+    uint32_t sz;
+    uint8_t _pad[3]; // padding to make sure 64b accesses to buf[] are aligned
     unsigned char flags;
     char buf[];
 };
+/**
+ * Allocator that can be attached to an sda array when it's created.
+ * Sizes are passed back in to realloc and free so that simple arenas work.
+ */
+struct sda_allocator {
+    void *(*malloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    /// Passed to every call
+    void *ctx;
+};
+
+//optional extension block, sits directly in front of the header when SDA_FLAG_EXT is set
+struct sda_ext {
+    /// Growth policy for this array, NULL to use the global default
+    const struct sda_growth *growth;
+    /// Allocator for this array, NULL for s_malloc and friends
+    const struct sda_allocator *allocator;
+    /// Index of the first element if SDA_FLAG_DEQUE is set
+    uint64_t head;
+    /// Alignment of buf if SDA_FLAG_ALIGNED is set
+    uint16_t align;
+    /// Bytes from the start of the allocation to this block if SDA_FLAG_ALIGNED is set
+    uint16_t pad;
+    /// Number of holders if SDA_FLAG_SHARED is set
+    uint32_t refs;
+};
 //agnostic/universal struct used in common methods that need *just* the header methods
 struct sda_hdr_uni {
     size_t len;
     size_t alloc;
-    uint8_t sz;
+    size_t sz;
     unsigned char flags;
 };
 
@@ -101,6 +129,35 @@ struct sda_hdr_uni {
 #define SDA_HTYPE_BITS 2
 #define SDA_HTYPE_MASK 3
 
+//sda flags, stored above the HTYPE bits
+#define SDA_FLAG_EXT (1<<SDA_HTYPE_BITS)
+#define SDA_FLAG_ALIGNED (1<<(SDA_HTYPE_BITS+1))
+#define SDA_FLAG_MMAP (1<<(SDA_HTYPE_BITS+2))
+#define SDA_FLAG_STACK (1<<(SDA_HTYPE_BITS+3))
+#define SDA_FLAG_DEQUE (1<<(SDA_HTYPE_BITS+4))
+#define SDA_FLAG_SHARED (1<<(SDA_HTYPE_BITS+5))
+
+//largest alignment sda_new_aligned can keep
+#define SDA_MAX_ALIGN 4096
+//largest element size, SM headers fit up to 255 bytes, MD up to 64K and LG the rest
+#define SDA_MAX_SZ UINT32_MAX
+//size of a cache line, for keeping data that different threads write apart
+#define SDA_CACHE_LINE 64
+
+/*
+ * Build everything with -DSDA_FIXED_HDR to give every array the LG header.
+ * That costs up to 12 more bytes per array, but the accessors no longer have
+ * to look at the flags to find len/alloc/sz, so each of them is a single load.
+ * Arrays can't be passed between code built with and without it.
+ */
+#if defined(SDA_FIXED_HDR)
+//header every array gets
+#define SDA_HTYPE_FIXED SDA_HTYPE_LG
+#define _SDA_HDR_STACK SDA_HDR_TYPE(LG)
+#else
+#define _SDA_HDR_STACK SDA_HDR_TYPE(SM)
+#endif
+
 #define SDA_HDR_TYPE(T)  struct sda_hdr_##T
 #define SDA_HDR_VAR(T,s) SDA_HDR_TYPE(T) *sh = (void*)(((char *)s)-(sizeof(SDA_HDR_TYPE(T))))
 #define SDA_HDR(T,s) ((SDA_HDR_TYPE(T) *)(((char *)s)-(sizeof(SDA_HDR_TYPE(T)))))
@@ -112,10 +169,20 @@ static inline unsigned char sda_flags(const sda s) {
     return ((const unsigned char *)s)[-1];
 }
 
+/** HTYPE from flags, a constant with SDA_FIXED_HDR so the switches fold away */
+static inline unsigned char _sda_htype(unsigned char flags) {
+#if defined(SDA_FIXED_HDR)
+    (void)flags;
+    return SDA_HTYPE_FIXED;
+#else
+    return flags&SDA_HTYPE_MASK;
+#endif
+}
+
 /** Returns len */
 static inline size_t sda_len(const sda s) {
     unsigned char flags = sda_flags(s);
-    switch(flags&SDA_HTYPE_MASK) {
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM:
             return SDA_HDR(SM,s)->len;
         case SDA_HTYPE_MD:
@@ -129,7 +196,7 @@ static inline size_t sda_len(const sda s) {
 /** Returns alloc */
 static inline size_t sda_alloc(const sda s) {
     unsigned char flags = sda_flags(s);
-    switch(flags&SDA_HTYPE_MASK) {
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM:
             return SDA_HDR(SM,s)->alloc;
         case SDA_HTYPE_MD:
@@ -143,7 +210,7 @@ static inline size_t sda_alloc(const sda s) {
 /** Returns sz */
 static inline size_t sda_sz(const sda s) {
     unsigned char flags = sda_flags(s);
-    switch(flags&SDA_HTYPE_MASK) {
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM:
             return SDA_HDR(SM,s)->sz;
         case SDA_HTYPE_MD:
@@ -158,7 +225,7 @@ static inline size_t sda_sz(const sda s) {
 static inline void sda_hdr(const sda s, struct sda_hdr_uni *ret) {
     unsigned char flags = sda_flags(s);
     ret->flags = flags;
-    switch(flags&SDA_HTYPE_MASK) {
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM: {
             SDA_HDR_VAR(SM,s);
             ret->len = sh->len;
@@ -188,6 +255,27 @@ static inline void sda_hdr(const sda s, struct sda_hdr_uni *ret) {
     }
 }
 
+/** Returns the extension block, or NULL if s doesn't have one */
+static inline struct sda_ext *_sda_ext(const sda s) {
+    unsigned char flags = sda_flags(s);
+    if(!(flags&SDA_FLAG_EXT)) return NULL;
+    switch(_sda_htype(flags)) {
+        case SDA_HTYPE_SM:
+            return ((struct sda_ext *)SDA_HDR(SM,s))-1;
+        case SDA_HTYPE_MD:
+            return ((struct sda_ext *)SDA_HDR(MD,s))-1;
+        case SDA_HTYPE_LG:
+            return ((struct sda_ext *)SDA_HDR(LG,s))-1;
+    }
+    return NULL;
+}
+
+/** Returns the allocator used by s, NULL for the default one */
+static inline const struct sda_allocator *_sda_allocator(const sda s) {
+    struct sda_ext *ext = _sda_ext(s);
+    return (ext != NULL) ? ext->allocator : NULL;
+}
+
 /******* Helper methods for members *******/
 
 /**
@@ -195,7 +283,7 @@ static inline void sda_hdr(const sda s, struct sda_hdr_uni *ret) {
  */
 static inline size_t sda_size(const sda s) {
     unsigned char flags = sda_flags(s);
-    switch(flags&SDA_HTYPE_MASK) {
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM: {
             SDA_HDR_VAR(SM,s);
             return sh->sz * sh->len;
@@ -217,7 +305,7 @@ static inline size_t sda_size(const sda s) {
  */
 static inline size_t sda_avail(const sda s) {
     unsigned char flags = sda_flags(s);
-    switch(flags&SDA_HTYPE_MASK) {
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM: {
             SDA_HDR_VAR(SM,s);
             return sh->alloc/sh->sz - sh->len;
@@ -263,6 +351,50 @@ static inline size_t sda_avail(const sda s) {
 /** Create an empty (zero length) sda array */
 #define sda_empty(s) sda_new_sz((s), NULL, 0)
 
+/**
+ * Same as sda_new, but the buffer starts at a multiple of align bytes.
+ * The alignment is kept through every reallocation of the array.
+ *
+ * @param align: Power of 2 up to SDA_MAX_ALIGN (eg. 32 for AVX2, 64 for a cache line).
+ */
+#define sda_new_aligned(s, init, align) (__typeof__(s))_sda_new_ext((init), sizeof(init), sizeof(*(s)), (align), NULL)
+/** Same as sda_new_sz, but the buffer starts at a multiple of align bytes */
+#define sda_new_sz_aligned(s, init, init_sz, align) (__typeof__(s))_sda_new_ext((init), (init_sz), sizeof(*(s)), (align), NULL)
+/** Create an empty sda array that will keep its buffer aligned to align bytes */
+#define sda_empty_aligned(s, align) sda_new_sz_aligned((s), NULL, 0, (align))
+
+/**
+ * Same as sda_new, but all of the memory for s comes from allocator a.
+ *
+ * @param a: Must stay valid until s is freed.
+ */
+#define sda_new_with(s, init, a) (__typeof__(s))_sda_new_ext((init), sizeof(init), sizeof(*(s)), 1, (a))
+/** Same as sda_new_sz, but all of the memory for s comes from allocator a */
+#define sda_new_sz_with(s, init, init_sz, a) (__typeof__(s))_sda_new_ext((init), (init_sz), sizeof(*(s)), 1, (a))
+/** Create an empty sda array that allocates from a */
+#define sda_empty_with(s, a) sda_new_sz_with((s), NULL, 0, (a))
+/** Same as sda_new_sz_aligned, but all of the memory for s comes from allocator a */
+#define sda_new_sz_aligned_with(s, init, init_sz, align, a) (__typeof__(s))_sda_new_ext((init), (init_sz), sizeof(*(s)), (align), (a))
+
+/**
+ * Create an empty sda array with room for N elements that lives on the stack
+ * (or wherever the enclosing block's locals are), so making it doesn't
+ * allocate. The first time it needs more room it's moved to the heap and
+ * from then on works like any other array. sda_free and sda_raii leave the
+ * inline storage alone, so both are fine to use either way.
+ *
+ * The array is only valid until the end of the enclosing block, don't return
+ * it unless it might have moved to the heap (sda_dup it instead).
+ *
+ * @param N: Less than UINT16_MAX and a compile time constant. Elements can
+ * be at most 255 bytes.
+ */
+#define sda_stack(s, N) (__typeof__(s))_sda_stack_init( \
+    (&(struct __attribute__((aligned(8))) { \
+        _SDA_HDR_STACK hdr; \
+        char buf[(N)*sizeof(*(s))]; \
+    }){.hdr = {0}})->buf, (N)*sizeof(*(s)), sizeof(*(s)))
+
 /** Duplicate an sda array, returning a pointer to the new sda array.
  * The sizeof(*t) must be the same as whatever you're assigning this to.
  */
@@ -271,6 +403,33 @@ static inline size_t sda_avail(const sda s) {
     sda_new_sz(tmp, tmp, sda_size(tmp)); \
     })
 
+/**
+ * Add another holder to s instead of copying it, returns s for the new holder.
+ * s has to be an lvalue, it's updated in place since the first share may
+ * have to move the array to make room for the count.
+ *
+ * Every holder calls sda_free when it's done, the last one frees the array.
+ * The sda_* calls that return a new pointer give the caller its own copy
+ * first if anyone else still holds s. Anything that writes in place
+ * without returning a pointer (element stores, sda_slice, sda_pop,
+ * sda_commit, the deque pops, sorting) needs an sda_unshare before it.
+ */
+#define sda_share(s) ({ \
+    (s) = (__typeof__(s))_sda_share(s); \
+    (s); \
+    })
+sda _sda_share(sda s);
+/**
+ * Returns s if the caller is its only holder, otherwise a private copy of s
+ * and the caller's hold on s is dropped. NULL if the copy couldn't be made.
+ */
+sda sda_unshare(sda s);
+/** Returns the number of holders of s */
+static inline uint32_t sda_refcount(const sda s) {
+    if(!(sda_flags(s)&SDA_FLAG_SHARED)) return 1;
+    return __atomic_load_n(&_sda_ext(s)->refs, __ATOMIC_ACQUIRE);
+}
+
 /** Free an sda array
  * @param s: Can be NULL
  * @return: NULL always
@@ -293,8 +452,26 @@ sda sda_replace(sda s, const sda t);
 #define sda_append(s, x) ({ \
     __typeof__(x) tmp = (x); \
     assert(sizeof(x) == sda_sz(s)); \
-    (__typeof__(s))(sda_cpy((s), sda_len(s), &tmp, sizeof(tmp))); \
+    (__typeof__(s))(sda_append_n((s), &tmp, 1)); \
     })
+/** Add the n elements pointed to by t to the end of s, t can't point into s */
+sda sda_append_n(sda s, const void *t, size_t n);
+/** Make sure there's room for n more elements past len without growing */
+sda sda_reserve(sda s, size_t n);
+/**
+ * Appends item x to sda array s without growing it, there must be room
+ * (see sda_reserve). Does not return anything since s can't move.
+ * Convenience for one element at a time, it reads and writes the header on
+ * every call. Batches are cheaper written through sda_end_ptr and added with
+ * one sda_commit.
+ */
+#define sda_push_unchecked(s, x) do { \
+    size_t _alloc; \
+    size_t _len = _sda_len_alloc((s), &_alloc); \
+    assert(_len < _alloc/sizeof(*(s))); \
+    (s)[_len] = (x); \
+    _sda_set_len((s), _len+1); \
+    } while(0)
 /** Pop item off of the end of s, returning the item */
 #define sda_pop(s) ({ \
     typeof(s) ret = (__typeof__(s))_sda_pop(s); \
@@ -325,7 +502,7 @@ void *sda_pop_ptr(sda s);
  */
 static inline void *sda_ptr_at(sda s, size_t i) {
     unsigned char flags = sda_flags(s);
-    switch(flags&SDA_HTYPE_MASK) {
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM: {
             SDA_HDR_VAR(SM,s);
             if(i < sh->len) return ((char *)s) + (sh->sz * i);
@@ -348,18 +525,421 @@ static inline void *sda_ptr_at(sda s, size_t i) {
 /**
  * Sets element i in sds array s to x.
  * x must be a rvalue and not a pointer.
+ * Returns s, or its private copy if s was shared (see sda_share).
  */
 #define sda_set(s, i, x) ({ \
     __typeof__(x) tmp = (x); \
     assert(sizeof(x) == sda_sz(s)); \
-    _sda_set((s), (i), &tmp, sizeof(tmp)); \
+    (__typeof__(s))_sda_set((s), (i), &tmp, sizeof(tmp)); \
     })
 
-#if 0
-size_t _sda_index(sda s, const void *x, size_t len);
-void sda_slice(sda s, int start, int end);
+/** Returned by the index functions when nothing was found */
+#define SDA_NPOS ((size_t)-1)
+
+/**
+ * Returns the index of the first element of s equal to x, or SDA_NPOS.
+ * x must be a rvalue and not a pointer.
+ */
+#define sda_index(s, x) ({ \
+    __typeof__(*(s)) tmp = (x); \
+    _sda_index((s), &tmp, sizeof(tmp)); \
+    })
+/**
+ * Returns the index of the first run of elements in s matching the size bytes
+ * at x, or SDA_NPOS. size must be a multiple of sda_sz(s).
+ */
+size_t _sda_index(const sda s, const void *x, size_t size);
+/** Keep only the elements from start to end (inclusive), negative counts from the end */
+void sda_slice(sda s, ssize_t start, ssize_t end);
+/** Compare s1 and s2 like memcmp, the longer one is bigger if one is a prefix of the other */
 int sda_cmp(const sda s1, const sda s2);
-#endif //0
+/**
+ * Join argc sda arrays into a new one like s, with the sep_size bytes at sep in between.
+ * Every array in argv must have the same element size as s.
+ */
+#define sda_join(s, argv, argc, sep, sep_size) (__typeof__(s))_sda_join((argv), (argc), (sep), (sep_size), sizeof(*(s)))
+sda _sda_join(const sda *argv, size_t argc, const void *sep, size_t sep_size, size_t type_sz);
+/** Join argc C strings with sep in between, the result is NUL terminated like sda_new(s, "str") */
+sdachar sda_join_str(char **argv, size_t argc, const char *sep);
+
+/******* Views for hot loops *******/
+
+/**
+ * Snapshot of an sda array with the header already decoded, so loops over it
+ * don't have to switch on the header type for every element.
+ * Only valid until s is reallocated or its len changes.
+ */
+struct sda_view {
+    /// The sda array
+    char *buf;
+    /// Number of elements
+    size_t len;
+    /// Size of each element
+    size_t sz;
+};
+
+/** Returns a view of sda array s */
+static inline struct sda_view sda_view(const sda s) {
+    struct sda_hdr_uni shadow;
+    struct sda_view v;
+    sda_hdr(s, &shadow);
+    v.buf = (char *)s;
+    v.len = shadow.len;
+    v.sz = shadow.sz;
+    return v;
+}
+
+/**
+ * Returns void pointer to element i of view v.
+ * Return NULL if i >= len of v.
+ */
+static inline void *sda_view_ptr_at(const struct sda_view *v, size_t i) {
+    if(i < v->len) return v->buf + v->sz*i;
+    return NULL;
+}
+// Unsafe
+#define _sda_view_ptr_at(v, i) ((void *)((v)->buf + (v)->sz*(i)))
+
+/**
+ * Get element i of type T from view v, returns 0 if i >= len of v.
+ */
+#define sda_view_get(v, T, i) ({ \
+    T *ret = (T *)sda_view_ptr_at((v), (i)); \
+    ret != NULL ? *ret : (T)0; \
+    })
+// Unsafe
+#define _sda_view_get(v, T, i) (*(T *)_sda_view_ptr_at((v), (i)))
+
+/**
+ * Loop over every element of view v, with p declared as a T pointer to each one.
+ * Steps by the sz of the array, so T doesn't need to be the element type.
+ */
+#define sda_view_foreach(v, T, p) \
+    for(T *p = (T *)(v)->buf, *p##_end = (T *)((v)->buf + (v)->sz*(v)->len); \
+        p < p##_end; p = (T *)((char *)p + (v)->sz))
+
+/**
+ * Loop over every element of typed sda array s, with p pointing to each one.
+ * len is only read once, so don't grow s inside the loop.
+ */
+#define sda_foreach(s, p) \
+    for(__typeof__(s) p = (s), p##_end = p + sda_len(s); p < p##_end; p++)
+
+/******* Typed arrays *******/
+
+/**
+ * Define inline functions for sda arrays of T. The element size is
+ * sizeof(T) at compile time instead of the sz byte in the header, so
+ * indexing and the room checks are shifts and compares, and the header is
+ * only looked at for len/alloc. The arrays are normal sda arrays, the other
+ * sda_* calls work on them and these work on any array with sz == sizeof(T)
+ * (asserted).
+ *
+ * Defines:
+ *   T *sda_##name##_new(size_t n)              n zeroed elements
+ *   size_t sda_##name##_len(const T *s)
+ *   T *sda_##name##_end(const T *s)            just past the last element
+ *   T *sda_##name##_push(T *s, T x)            add x to the end, growing if needed
+ *   T sda_##name##_get(const T *s, size_t i)   element i, zeroes if i >= len
+ *   T *sda_##name##_set(T *s, size_t i, T x)   see sda_set
+ *   T *sda_##name##_reserve(T *s, size_t n)    see sda_reserve
+ *   T sda_##name##_pop(T *s)                   remove the last element, zeroes if empty
+ *   void sda_##name##_foreach(T *s, void (*fn)(T *x, void *ctx), void *ctx)
+ *
+ * e.g.
+ *   SDA_DEFINE(int32_t, i32)
+ *   ...
+ *   int32_t *s = sda_i32_new(0);
+ *   s = sda_i32_push(s, 5);
+ */
+#define SDA_DEFINE(T, name) \
+_Static_assert(sizeof(T) <= SDA_MAX_SZ, "sda elements are at most SDA_MAX_SZ bytes"); \
+static inline T *sda_##name##_new(size_t n) { \
+    return (T *)_sda_new_sz(NULL, n*sizeof(T), sizeof(T)); \
+} \
+static inline size_t sda_##name##_len(const T *s) { \
+    size_t alloc; \
+    return _sda_len_alloc((sda)s, &alloc); \
+} \
+static inline T *sda_##name##_end(const T *s) { \
+    return (T *)s + sda_##name##_len(s); \
+} \
+static inline T *sda_##name##_push(T *s, T x) { \
+    size_t len = SDA_NPOS; \
+    assert(sda_sz(s) == sizeof(T)); \
+    /* shared arrays, deques and full ones take the long way */ \
+    if(__builtin_expect(!(sda_flags(s)&(SDA_FLAG_SHARED|SDA_FLAG_DEQUE)), 1)) len = _sda_len_bump(s, sizeof(T)); \
+    if(__builtin_expect(len == SDA_NPOS, 0)) return (T *)sda_append_n(s, &x, 1); \
+    s[len] = x; \
+    return s; \
+} \
+static inline T sda_##name##_get(const T *s, size_t i) { \
+    assert(sda_sz((sda)s) == sizeof(T)); \
+    if(i < sda_##name##_len(s)) return s[i]; \
+    return (T){0}; \
+} \
+static inline T *sda_##name##_set(T *s, size_t i, T x) { \
+    assert(sda_sz(s) == sizeof(T)); \
+    if(sda_flags(s)&SDA_FLAG_SHARED) { \
+        s = (T *)sda_unshare(s); \
+        if(s == NULL) return NULL; \
+    } \
+    if(i < sda_##name##_len(s)) s[i] = x; \
+    return s; \
+} \
+static inline T *sda_##name##_reserve(T *s, size_t n) { \
+    size_t alloc, len = _sda_len_alloc(s, &alloc); \
+    if((len+n)*sizeof(T) <= alloc && !(sda_flags(s)&SDA_FLAG_SHARED)) return s; \
+    return (T *)sda_reserve(s, n); \
+} \
+static inline T sda_##name##_pop(T *s) { \
+    size_t len = sda_##name##_len(s); \
+    assert(sda_sz(s) == sizeof(T)); \
+    if(len == 0) return (T){0}; \
+    _sda_set_len(s, len-1); \
+    return s[len-1]; \
+} \
+static inline void sda_##name##_foreach(T *s, void (*fn)(T *x, void *ctx), void *ctx) { \
+    for(T *p = s, *end = sda_##name##_end(s); p < end; p++) fn(p, ctx); \
+}
+
+/******* Growth policy *******/
+
+/**
+ * Callback deciding how many bytes to allocate when an sda array needs to grow.
+ * @param alloc: Bytes currently allocated.
+ * @param need: Bytes that must fit after the grow (always > alloc).
+ * @param sz: Size of each element.
+ * @param ctx: The ctx member of the policy.
+ * @return: New number of bytes to allocate, values less than need are bumped up to need.
+ */
+typedef size_t (*sda_growth_fn)(size_t alloc, size_t need, size_t sz, void *ctx);
+
+/**
+ * Growth policy used by sda_prealloc.
+ *
+ * Unless fn is set, the new allocation is need*factor bytes, with the extra room
+ * limited to cap bytes (0 for no limit).
+ */
+struct sda_growth {
+    /// Geometric growth factor, should be >= 1.0
+    double factor;
+    /// Max bytes to pre-allocate past what was asked for, 0 for unlimited
+    size_t cap;
+    /// If not NULL, called to compute the new allocation instead of factor/cap
+    sda_growth_fn fn;
+    /// Passed on to fn
+    void *ctx;
+};
+
+/** Doubles the allocation every time, amortized O(1) appends. This is the default. */
+extern const struct sda_growth sda_growth_geometric;
+/** Doubles up to SDA_MAX_PREALLOC, then grows by SDA_MAX_PREALLOC bytes (old behaviour) */
+extern const struct sda_growth sda_growth_legacy;
+
+/**
+ * Set the policy used by every array that doesn't have its own.
+ * Not thread safe, set it before creating arrays in other threads.
+ * @param g: Must stay valid while in use, NULL restores sda_growth_geometric.
+ */
+void sda_set_growth_default(const struct sda_growth *g);
+/** Returns the policy set by sda_set_growth_default */
+const struct sda_growth *sda_get_growth_default(void);
+/**
+ * Set the growth policy of just the array s.
+ *
+ * After the call, the passed sda array is no longer valid and all the
+ * references must be substituted with the new pointer returned by the call.
+ * @param g: Must stay valid while s uses it, NULL goes back to the default.
+ */
+sda sda_set_growth(sda s, const struct sda_growth *g);
+/** Returns the growth policy used by s */
+const struct sda_growth *sda_get_growth(const sda s);
+
+/******* Deques *******/
+
+/* A deque is an sda array used as a ring buffer: elements start at a head
+ * index in the ext block and wrap around the end of the allocation, so
+ * adding or removing at either end is O(1). Growing goes through
+ * sda_prealloc and the array's growth policy.
+ *
+ * Until sda_deque_linearize is called, s[i] and the other sda functions see
+ * the raw ring, use sda_deque_get/sda_deque_ptr_at to read elements instead.
+ */
+
+/** Create an empty deque */
+#define sda_deque_empty(s) (__typeof__(s))sda_make_deque(_sda_new_ext(NULL, 0, sizeof(*(s)), 1, NULL))
+/**
+ * Turn the array s into a deque holding the same elements.
+ *
+ * After the call, the passed sda array is no longer valid and all the
+ * references must be substituted with the new pointer returned by the call.
+ */
+sda sda_make_deque(sda s);
+
+/** Add x to the end of deque s, growing if needed */
+#define sda_deque_push_back(s, x) ({ \
+    __typeof__(x) tmp = (x); \
+    assert(sizeof(x) == sda_sz(s)); \
+    (__typeof__(s))(_sda_deque_push((s), &tmp, 0)); \
+    })
+/** Add x to the start of deque s, growing if needed */
+#define sda_deque_push_front(s, x) ({ \
+    __typeof__(x) tmp = (x); \
+    assert(sizeof(x) == sda_sz(s)); \
+    (__typeof__(s))(_sda_deque_push((s), &tmp, 1)); \
+    })
+/** Remove the first element of deque s and return it, 0 if s is empty */
+#define sda_deque_pop_front(s) ({ \
+    __typeof__(s) ret = (__typeof__(s))sda_deque_pop_front_ptr(s); \
+    ret != NULL ? (__typeof__(*s))*ret : 0; \
+    })
+/** Remove the last element of deque s and return it, 0 if s is empty */
+#define sda_deque_pop_back(s) ({ \
+    __typeof__(s) ret = (__typeof__(s))sda_deque_pop_back_ptr(s); \
+    ret != NULL ? (__typeof__(*s))*ret : 0; \
+    })
+/**
+ * Remove the first/last element of deque s, returning a pointer to it or NULL
+ * if s is empty. The pointer is valid until the next push.
+ */
+void *sda_deque_pop_front_ptr(sda s);
+void *sda_deque_pop_back_ptr(sda s);
+
+/** Get element i (counting from the front) of deque s, 0 if i >= len */
+#define sda_deque_get(s, i) ({ \
+    __typeof__(s) ret = (__typeof__(s))sda_deque_ptr_at((s), (i)); \
+    ret != NULL ? (__typeof__(*s))*ret : 0; \
+    })
+/** Pointer to element i (counting from the front) of deque s, NULL if i >= len */
+static inline void *sda_deque_ptr_at(const sda s, size_t i) {
+    struct sda_hdr_uni shadow;
+    size_t cap, idx;
+    sda_hdr(s, &shadow);
+    if (i >= shadow.len) return NULL;
+    cap = shadow.alloc/shadow.sz;
+    idx = _sda_ext(s)->head + i;
+    if (idx >= cap) idx -= cap;
+    return ((char *)s) + idx*shadow.sz;
+}
+
+/**
+ * Move the elements of deque s so they start at s[0] and are contiguous,
+ * after which the rest of the sda functions can be used on it. Done in
+ * place, s doesn't move. It stays a deque.
+ */
+sda sda_deque_linearize(sda s);
+
+/******* Arenas *******/
+
+//alignment of every allocation handed out by an arena
+#define SDA_ARENA_ALIGN 16
+
+struct sda_arena_block {
+    /// Next (older) block
+    struct sda_arena_block *next;
+    /// Bytes in data
+    size_t size;
+    /// Bytes of data handed out
+    size_t used;
+    /// Offset of the last allocation, so it can be grown in place
+    size_t last;
+    char data[];
+};
+
+/**
+ * Bump allocator that sda arrays can be created in (see sda_new_in).
+ * Everything in it is released at once by sda_arena_reset, calling sda_free
+ * on each array isn't needed. Not thread safe.
+ */
+struct sda_arena {
+    /// Allocator handed to the arrays, ctx points back to the arena
+    struct sda_allocator allocator;
+    /// Block that's currently being allocated from
+    struct sda_arena_block *head;
+    /// Minimum size of each block
+    size_t block_sz;
+};
+
+/** Create an arena that allocates blocks of at least block_sz bytes */
+struct sda_arena *sda_arena_new(size_t block_sz);
+/** Release every array in the arena, keeping the current block around for reuse */
+void sda_arena_reset(struct sda_arena *arena);
+/** Free the arena and every array in it, arena can be NULL */
+void sda_arena_free(struct sda_arena *arena);
+
+/** Same as sda_new, but s is allocated in arena */
+#define sda_new_in(s, init, arena) sda_new_with((s), (init), &(arena)->allocator)
+/** Same as sda_new_sz, but s is allocated in arena */
+#define sda_new_sz_in(s, init, init_sz, arena) sda_new_sz_with((s), (init), (init_sz), &(arena)->allocator)
+/** Create an empty sda array in arena */
+#define sda_empty_in(s, arena) sda_empty_with((s), &(arena)->allocator)
+
+/******* Allocation cache *******/
+
+//allocations up to this many bytes are rounded up to a size class and can be cached
+#define SDA_CACHE_MAX_SIZE 2048
+//size class granularity, malloc rounds to this anyway
+#define SDA_CACHE_GRAIN 16
+
+/**
+ * Set how many bytes of freed small allocations each thread can hold on to
+ * for reuse instead of handing them back to s_free. 0 (the default) turns the
+ * cache off. Threads using the cache should call sda_cache_trim(0) before exiting.
+ */
+void sda_cache_set_max(size_t max);
+/** Returns the limit set by sda_cache_set_max */
+size_t sda_cache_get_max(void);
+/** Free cached allocations of the calling thread until it's holding at most keep bytes */
+void sda_cache_trim(size_t keep);
+/** Bytes currently held by the calling thread's cache */
+size_t sda_cache_retained(void);
+
+/******* mmap backend *******/
+
+/**
+ * Arrays using the default allocator that need at least bytes are moved into
+ * their own anonymous mmap, and grown with mremap after that so the pages are
+ * moved instead of copied. Transparent huge pages are requested for them.
+ * 0 (the default) turns this off. Does nothing where mmap isn't available.
+ */
+void sda_mmap_set_threshold(size_t bytes);
+/** Returns the threshold set by sda_mmap_set_threshold */
+size_t sda_mmap_get_threshold(void);
+
+/******* Statistics *******/
+
+/**
+ * Counts of what the arrays have done with their memory since the program
+ * started, summed over every thread. They only go up, take two snapshots and
+ * subtract to look at one piece of work. Scratch space used by the other
+ * modules isn't counted.
+ */
+struct sda_stats {
+    /// Blocks allocated for arrays
+    uint64_t mallocs;
+    /// Blocks resized
+    uint64_t reallocs;
+    /// Resizes that kept the block where it was
+    uint64_t reallocs_in_place;
+    /// Resizes that moved the block
+    uint64_t reallocs_moved;
+    /// Blocks freed
+    uint64_t frees;
+    /// Headers promoted from SM to MD
+    uint64_t promote_md;
+    /// Headers promoted to LG
+    uint64_t promote_lg;
+    /// Bytes of elements copied or moved around by resizes
+    uint64_t bytes_copied;
+    /// Free space the growth policy added on top of what was asked for
+    uint64_t slack_grown;
+    /// Free space (sda_avail) arrays still had when they were freed
+    uint64_t slack_freed;
+};
+
+/** Fill out with the counters of every thread added up */
+void sda_stats_snapshot(struct sda_stats *out);
 
 /******* Lower level methods for operating on sda's *******/
 
@@ -371,10 +951,20 @@ void *sda_total_ptr(sda s);
 /* Don't call these directly */
 
 sda _sda_new_sz(const void *init, size_t init_sz, size_t type_sz);
+sda _sda_new_ext(const void *init, size_t init_sz, size_t type_sz, size_t align, const struct sda_allocator *a);
 void _sda_raii_free(void *s);
-static inline void _sda_set(sda s, size_t i, const void *t, size_t size) {
+void *_sda_cache_malloc(size_t size);
+void *_sda_cache_realloc(void *ptr, size_t old_size, size_t size);
+void _sda_cache_free(void *ptr, size_t size);
+static inline sda _sda_set(sda s, size_t i, const void *t, size_t size) {
     unsigned char flags = sda_flags(s);
-    switch(flags&SDA_HTYPE_MASK) {
+    if(flags&SDA_FLAG_SHARED) {
+        s = sda_unshare(s);
+        if(s == NULL) return NULL;
+        //the copy gets a header sized for its len, which can be smaller
+        flags = sda_flags(s);
+    }
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM: {
             SDA_HDR_VAR(SM,s);
             size_t start = i*sh->sz;
@@ -403,6 +993,7 @@ static inline void _sda_set(sda s, size_t i, const void *t, size_t size) {
             break;
         }
     }
+    return s;
 }
 // Unsafe
 #define _sda_ptr_at(s, i) (((char *)s) + (sda_sz(s)*(i)))
@@ -412,7 +1003,7 @@ static inline void _sda_set(sda s, size_t i, const void *t, size_t size) {
  */
 static inline void _sda_set_len(sda s, size_t newlen) {
     unsigned char flags = sda_flags(s);
-    switch(flags&SDA_HTYPE_MASK) {
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM:
             SDA_HDR(SM,s)->len = newlen;
             break;
@@ -430,7 +1021,7 @@ static inline void _sda_set_len(sda s, size_t newlen) {
  */
 static inline void _sda_set_alloc(sda s, size_t newsz) {
     unsigned char flags = sda_flags(s);
-    switch(flags&SDA_HTYPE_MASK) {
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM:
             SDA_HDR(SM,s)->alloc = newsz;
             break;
@@ -451,9 +1042,9 @@ static inline void _sda_set_flags(sda s, unsigned char flags) {
 /**
  * Sets item size
  */
-static inline void _sda_set_sz(sda s, uint8_t newsz) {
+static inline void _sda_set_sz(sda s, size_t newsz) {
     unsigned char flags = sda_flags(s);
-    switch(flags&SDA_HTYPE_MASK) {
+    switch(_sda_htype(flags)) {
         case SDA_HTYPE_SM:
             SDA_HDR(SM,s)->sz = newsz;
             break;
@@ -466,35 +1057,155 @@ static inline void _sda_set_sz(sda s, uint8_t newsz) {
     }
 }
 
+/** Size of the header for HTYPE type */
+static inline size_t _sda_hdr_size(char type) {
+    switch(type&SDA_HTYPE_MASK) {
+        case SDA_HTYPE_SM:
+            return sizeof(SDA_HDR_TYPE(SM));
+        case SDA_HTYPE_MD:
+            return sizeof(SDA_HDR_TYPE(MD));
+        case SDA_HTYPE_LG:
+            return sizeof(SDA_HDR_TYPE(LG));
+    }
+    return 0;
+}
+
+/**
+ * HTYPE required to make sure alloc, len and sz are big enough
+ */
+static inline char _sda_req_htype(size_t req_size, size_t req_len, size_t req_sz) {
+#if defined(SDA_FIXED_HDR)
+    (void)req_size; (void)req_len; (void)req_sz;
+    return SDA_HTYPE_FIXED;
+#else
+    if((req_size < UINT32_MAX) && (req_len < UINT16_MAX) && (req_sz <= UINT8_MAX))
+        return SDA_HTYPE_SM;
+    if((req_size < UINT64_MAX) && (req_len < UINT32_MAX) && (req_sz <= UINT16_MAX))
+        return SDA_HTYPE_MD;
+    return SDA_HTYPE_LG;
+#endif
+}
+
+/** Returns len, and the bytes allocated in alloc, with one header decode */
+static inline size_t _sda_len_alloc(const sda s, size_t *alloc) {
+    switch(_sda_htype(sda_flags(s))) {
+        case SDA_HTYPE_SM: {
+            SDA_HDR_VAR(SM,s);
+            *alloc = sh->alloc;
+            return sh->len;
+        }
+        case SDA_HTYPE_MD: {
+            SDA_HDR_VAR(MD,s);
+            *alloc = sh->alloc;
+            return sh->len;
+        }
+        case SDA_HTYPE_LG: {
+            SDA_HDR_VAR(LG,s);
+            *alloc = sh->alloc;
+            return sh->len;
+        }
+    }
+    *alloc = 0;
+    return 0;
+}
+
+/**
+ * Add one to len if there's room for another sz byte element, with one
+ * header decode. Returns the old len, or SDA_NPOS if s is full.
+ */
+static inline size_t _sda_len_bump(sda s, size_t sz) {
+    switch(_sda_htype(sda_flags(s))) {
+        case SDA_HTYPE_SM: {
+            SDA_HDR_VAR(SM,s);
+            if((sh->len+1)*sz > sh->alloc) return SDA_NPOS;
+            return sh->len++;
+        }
+        case SDA_HTYPE_MD: {
+            SDA_HDR_VAR(MD,s);
+            if((sh->len+1)*sz > sh->alloc) return SDA_NPOS;
+            return sh->len++;
+        }
+        case SDA_HTYPE_LG: {
+            SDA_HDR_VAR(LG,s);
+            if((sh->len+1)*sz > sh->alloc) return SDA_NPOS;
+            return sh->len++;
+        }
+    }
+    return SDA_NPOS;
+}
+
+/** Used by the sda_deque_push_* macros, front is 1 to push at the start */
+sda _sda_deque_push(sda s, const void *x, int front);
+
+/* Set up the header in front of the inline storage buf for sda_stack */
+static inline sda _sda_stack_init(char *buf, size_t alloc, size_t type_sz) {
+    _SDA_HDR_STACK *sh = (void *)(buf-sizeof(_SDA_HDR_STACK));
+    //can't use crazy large types
+    assert(type_sz <= UINT8_MAX);
+    assert(alloc/type_sz < UINT16_MAX);
+    sh->alloc = alloc;
+    sh->len = 0;
+    sh->sz = type_sz;
+    sh->flags = _sda_req_htype(alloc, 0, type_sz)|SDA_FLAG_STACK;
+    return buf;
+}
+
+/******* Writing into reserved space *******/
+
+/**
+ * Returns a pointer just past the last element, where sda_avail(s) elements
+ * can be written before calling sda_commit().
+ */
+static inline void *sda_end_ptr(const sda s) {
+    return ((char *)s) + sda_size(s);
+}
+
+/**
+ * Grow len by n elements that were written directly past the end of s
+ * (see sda_end_ptr), n must be <= sda_avail(s).
+ */
+static inline void sda_commit(sda s, size_t n) {
+    struct sda_hdr_uni shadow;
+    sda_hdr(s, &shadow);
+    //can't go past what's been allocated
+    assert((shadow.len+n)*shadow.sz <= shadow.alloc);
+    _sda_set_len(s, shadow.len+n);
+}
+
 /******* Allocator exposure *******/
 
 /* Export the allocator used by SDA to the program using SDA.
  * Sometimes the program SDA is linked to, may use a different set of
  * allocators, but may want to allocate or free things that SDA will
- * respectively free or allocate. */
-static inline void *_sda_malloc(size_t size) {
-#if defined(SDA_TEST_MAIN)
-    void *tmp = s_malloc(size);
-    printf("s_malloc %p %zu\n", tmp, size);
+ * respectively free or allocate.
+ * 
+ * a is the allocator of the array being worked on (see _sda_allocator),
+ * NULL goes straight to s_malloc and friends. */
+/** Size that's really allocated for size bytes from the default allocator */
+static inline size_t _sda_cache_round(size_t size) {
+    if (size == 0 || size > SDA_CACHE_MAX_SIZE) return size;
+    return (size + SDA_CACHE_GRAIN-1) & ~(size_t)(SDA_CACHE_GRAIN-1);
+}
+
+static inline void *_sda_malloc(const struct sda_allocator *a, size_t size) {
+    void *tmp;
+    if (a != NULL) tmp = a->malloc(a->ctx, size);
+    else if (size <= SDA_CACHE_MAX_SIZE) tmp = _sda_cache_malloc(size);
+    else tmp = s_malloc(size);
     return tmp;
-#else
-    return s_malloc(size);
-#endif
 }
-static inline void *_sda_realloc(void *ptr, size_t size) {
-#if defined(SDA_TEST_MAIN)
-    void *tmp = s_realloc(ptr,size);
-    printf("s_realloc %p %zu -> %p\n", ptr, size, tmp);
+static inline void *_sda_realloc(const struct sda_allocator *a, void *ptr, size_t old_size, size_t size) {
+    void *tmp;
+    if (a != NULL) tmp = a->realloc(a->ctx, ptr, old_size, size);
+    else if (old_size <= SDA_CACHE_MAX_SIZE && size <= SDA_CACHE_MAX_SIZE) tmp = _sda_cache_realloc(ptr, old_size, size);
+    //keep small blocks at their size class so they can be cached when freed
+    else tmp = s_realloc(ptr,_sda_cache_round(size));
     return tmp;
-#else
-    return s_realloc(ptr,size);
-#endif
 }
-static inline void _sda_free(void *ptr) {
-#if defined(SDA_TEST_MAIN)
-    printf("s_free %p\n", ptr);
-#endif
-    s_free(ptr);
+static inline void _sda_free(const struct sda_allocator *a, void *ptr, size_t size) {
+    if (a != NULL) a->free(a->ctx, ptr, size);
+    else if (size <= SDA_CACHE_MAX_SIZE) _sda_cache_free(ptr, size);
+    else s_free(ptr);
 }
 
 #endif //__SDA_H
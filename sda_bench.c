@@ -0,0 +1,1261 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Benchmarks, build and run with `make bench`. `make bench BENCH_ARGS=--json`
+ * prints one JSON object per result instead of the table, for tracking
+ * regressions. The utarray comparisons are built when utarray.h can be found,
+ * point UTHASH_INC at it if it's not on the include path. Bytes copied comes
+ * from sda_stats, so it only counts what the sda arrays moved around. The
+ * baseline rows leave it out (and grows, which only some rows measure).
+ * `make bench` runs it twice, the second time built with SDA_FIXED_HDR.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "sda.h"
+#include "sda_reduce.h"
+#include "sda_sort.h"
+#include "sda_spsc.h"
+#include "sda_conc.h"
+#include "sda_parallel.h"
+#include "sda_io.h"
+
+#if defined(__has_include)
+#if __has_include(<utarray.h>)
+#include <utarray.h>
+#define _HAVE_UTARRAY 1
+#endif
+#endif
+
+/******* Helpers *******/
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+//keeps the compiler from throwing away results
+static volatile size_t _sink;
+
+//set by --json
+static int _json = 0;
+#if defined(SDA_FIXED_HDR)
+static const char *_hdr_mode = "fixed";
+#else
+static const char *_hdr_mode = "sized";
+#endif
+static const char *_section_name = "";
+//stats when the running benchmark started
+static struct sda_stats _mark;
+
+static void _section(const char *name) {
+    _section_name = name;
+    if(!_json) printf("== %s ==\n", name);
+}
+
+/* Start a benchmark, resets the marks the report is measured from and
+ * returns the time */
+static double _start(void) {
+#if defined(__linux__)
+    //resets VmHWM so the peak is for this benchmark alone
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if(f != NULL) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+    sda_stats_snapshot(&_mark);
+    return _now();
+}
+
+/* Peak resident set in KB, since the last _start where the kernel can reset it */
+static long _peak_rss_kb(void) {
+    struct rusage ru;
+    char line[128];
+    long kb = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if(f != NULL) {
+        while(fgets(line, sizeof(line), f) != NULL) {
+            if(sscanf(line, "VmHWM: %ld", &kb) == 1) break;
+        }
+        fclose(f);
+    }
+    if(kb < 0 && getrusage(RUSAGE_SELF, &ru) == 0) kb = ru.ru_maxrss;
+    return kb;
+}
+
+/* Print one result. counted is 0 for the baselines, whose copies sda_stats
+ * can't see, so bytes copied is left out instead of reading 0. grows is 0
+ * when it wasn't measured and left out too. */
+static void _report_row(const char *name, size_t n, double secs, size_t grows, int counted) {
+    struct sda_stats now;
+    unsigned long long copied;
+    long rss = _peak_rss_kb();
+    sda_stats_snapshot(&now);
+    copied = now.bytes_copied - _mark.bytes_copied;
+    if(_json) {
+        printf("{\"hdr\":\"%s\",\"section\":\"%s\",\"name\":\"%s\",\"n\":%zu,\"ns_per_op\":%.3f",
+            _hdr_mode, _section_name, name, n, secs*1e9/n);
+        if(grows) printf(",\"grows\":%zu", grows);
+        if(counted) printf(",\"bytes_copied\":%llu", copied);
+        printf(",\"peak_rss_kb\":%ld}\n", rss);
+        return;
+    }
+    printf("%-40s n=%-9zu %10.2f ns/op ", name, n, secs*1e9/n);
+    if(counted) printf("%12llu B copied", copied);
+    else printf("%12s B copied", "-");
+    printf(" %8ld KB rss", rss);
+    if(grows) printf(" %9zu grows", grows);
+    putchar('\n');
+}
+
+static void _report(const char *name, size_t n, double secs, size_t grows) {
+    _report_row(name, n, secs, grows, 1);
+}
+
+/* Result for a baseline that isn't an sda array */
+static void _report_baseline(const char *name, size_t n, double secs) {
+    _report_row(name, n, secs, 0, 0);
+}
+
+/******* Baselines *******/
+
+/* The growable array everyone writes by hand */
+struct _vec {
+    int *p;
+    size_t len, cap;
+};
+
+static inline void _vec_push(struct _vec *v, int x) {
+    if(v->len == v->cap) {
+        v->cap = v->cap ? v->cap*2 : 16;
+        v->p = realloc(v->p, v->cap*sizeof(int));
+        assert(v->p != NULL);
+    }
+    v->p[v->len++] = x;
+}
+
+/* Grow v to len elements, zeroing the new ones */
+static inline void _vec_resize(struct _vec *v, size_t len) {
+    if(len > v->cap) {
+        v->cap = (len > v->cap*2) ? len : v->cap*2;
+        v->p = realloc(v->p, v->cap*sizeof(int));
+        assert(v->p != NULL);
+    }
+    if(len > v->len) memset(v->p+v->len, 0, (len-v->len)*sizeof(int));
+    v->len = len;
+}
+
+/******* Benchmarks *******/
+
+/* sda_append n ints into an empty array using growth policy g */
+static void bench_append(const char *name, const struct sda_growth *g, size_t n) {
+    double start, secs;
+    struct sda_stats before, after;
+    sdaint s = sda_empty(s);
+    s = sda_set_growth(s, g);
+    sda_stats_snapshot(&before);
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        s = sda_append(s, (int)i);
+    }
+    secs = _now()-start;
+    sda_stats_snapshot(&after);
+    assert(sda_len(s) == n);
+    _sink = sda_len(s);
+    _report(name, n, secs, after.reallocs-before.reallocs);
+    sda_free(s);
+}
+
+/* Push n ints using the different bulk apis */
+static void bench_push(size_t n) {
+    double start;
+    int batch[64];
+    sdaint s = sda_empty(s);
+
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        s = sda_append(s, (int)i);
+    }
+    _report("push/sda_append", n, _now()-start, 0);
+    s = sda_compact(sda_clear(s));
+
+    start = _start();
+    for(size_t i=0; i<n; i+=64) {
+        for(int j=0; j<64; j++) batch[j] = (int)(i+j);
+        s = sda_append_n(s, batch, 64);
+    }
+    _report("push/sda_append_n(64)", n, _now()-start, 0);
+    s = sda_compact(sda_clear(s));
+
+    start = _start();
+    s = sda_reserve(s, n);
+    for(size_t i=0; i<n; i++) {
+        sda_push_unchecked(s, (int)i);
+    }
+    _report("push/sda_push_unchecked", n, _now()-start, 0);
+    s = sda_compact(sda_clear(s));
+
+    start = _start();
+    s = sda_reserve(s, n);
+    int *end = sda_end_ptr(s);
+    for(size_t i=0; i<n; i++) {
+        end[i] = (int)i;
+    }
+    sda_commit(s, n);
+    _report("push/sda_end_ptr+sda_commit", n, _now()-start, 0);
+    _sink = sda_len(s);
+    sda_free(s);
+}
+
+/* Append n ints to the hand written array and utarray */
+static void bench_append_baseline(size_t n) {
+    double start;
+    struct _vec v = {NULL, 0, 0};
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        _vec_push(&v, (int)i);
+    }
+    _report_baseline("append/malloc array", n, _now()-start);
+    _sink = v.len;
+    free(v.p);
+#if defined(_HAVE_UTARRAY)
+    UT_array *ut;
+    utarray_new(ut, &ut_int_icd);
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        int x = (int)i;
+        utarray_push_back(ut, &x);
+    }
+    _report_baseline("append/utarray", n, _now()-start);
+    _sink = utarray_len(ut);
+    utarray_free(ut);
+#endif
+}
+
+/* sda_cat n chunks of chunk bytes onto a char array vs memcpy onto a
+ * hand written one */
+static void bench_cat(size_t n, size_t chunk) {
+    static const char src[256];
+    char name[64];
+    double start;
+    char *p = NULL;
+    size_t len = 0, cap = 0;
+    assert(chunk <= sizeof(src));
+    sdachar s = sda_empty(s);
+
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        s = sda_cat(s, src, chunk);
+    }
+    snprintf(name, sizeof(name), "cat/sda_cat/%zu bytes", chunk);
+    _report(name, n, _now()-start, 0);
+    _sink = sda_len(s);
+    sda_free(s);
+
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        if(len+chunk > cap) {
+            cap = (cap ? cap*2 : 64);
+            if(cap < len+chunk) cap = len+chunk;
+            p = realloc(p, cap);
+            assert(p != NULL);
+        }
+        memcpy(p+len, src, chunk);
+        len += chunk;
+    }
+    snprintf(name, sizeof(name), "cat/malloc array/%zu bytes", chunk);
+    _report_baseline(name, n, _now()-start);
+    _sink = len;
+    free(p);
+}
+
+//xorshift, the random access benches need the same indexes every time
+static inline uint32_t _rand_next(uint32_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+/* Read every element of an n int array in order and in a random order,
+ * through sda_get, sda_ptr_at and plain indexing, against the baselines */
+static void bench_access(size_t n, size_t reps) {
+    char name[64];
+    double start;
+    long sum;
+    uint32_t x = 2463534242u;
+    struct _vec v = {NULL, 0, 0};
+    uint32_t *idx = malloc(n*sizeof(*idx));
+    sdaint s = sda_new_sz(s, NULL, n*sizeof(int));
+    assert(idx != NULL);
+    for(size_t i=0; i<n; i++) {
+        s[i] = (int)i;
+        _vec_push(&v, (int)i);
+        idx[i] = _rand_next(&x) % n;
+    }
+#if defined(_HAVE_UTARRAY)
+    UT_array *ut;
+    utarray_new(ut, &ut_int_icd);
+    utarray_reserve(ut, n);
+    for(size_t i=0; i<n; i++) {
+        int y = (int)i;
+        utarray_push_back(ut, &y);
+    }
+#endif
+
+    for(int rnd=0; rnd<2; rnd++) {
+        const char *order = rnd ? "random" : "seq";
+#define _ACCESS(label, expr, baseline) do { \
+            sum = 0; \
+            start = _start(); \
+            for(size_t r=0; r<reps; r++) { \
+                for(size_t k=0; k<n; k++) { \
+                    size_t i = rnd ? idx[k] : k; \
+                    sum += (expr); \
+                } \
+            } \
+            snprintf(name, sizeof(name), "access/%s/%s", order, label); \
+            if(baseline) _report_baseline(name, n*reps, _now()-start); \
+            else _report(name, n*reps, _now()-start, 0); \
+            _sink = sum; \
+        } while(0)
+        _ACCESS("sda_get", sda_get(s, i), 0);
+        _ACCESS("sda_ptr_at", *(int *)sda_ptr_at(s, i), 0);
+        _ACCESS("s[i]", s[i], 0);
+        _ACCESS("malloc array", v.p[i], 1);
+#if defined(_HAVE_UTARRAY)
+        _ACCESS("utarray_eltptr", *(int *)utarray_eltptr(ut, i), 1);
+#endif
+#undef _ACCESS
+    }
+#if defined(_HAVE_UTARRAY)
+    utarray_free(ut);
+#endif
+    free(idx);
+    free(v.p);
+    sda_free(s);
+}
+
+/* Grow an int array to n elements step at a time with sda_resize, which
+ * zeroes the new elements, vs realloc+memset */
+static void bench_resize(size_t n, size_t step) {
+    char name[64];
+    double start;
+    struct _vec v = {NULL, 0, 0};
+    sdaint s = sda_empty(s);
+
+    start = _start();
+    for(size_t len=step; len<=n; len+=step) {
+        s = sda_resize(s, len);
+    }
+    snprintf(name, sizeof(name), "resize/sda_resize/step=%zu", step);
+    _report(name, n/step, _now()-start, 0);
+    _sink = sda_len(s);
+    sda_free(s);
+
+    start = _start();
+    for(size_t len=step; len<=n; len+=step) {
+        _vec_resize(&v, len);
+    }
+    snprintf(name, sizeof(name), "resize/malloc array/step=%zu", step);
+    _report_baseline(name, n/step, _now()-start);
+    _sink = v.len;
+    free(v.p);
+}
+
+/* sda_compact count arrays of len ints that have as much free space again */
+static void bench_compact(size_t count, size_t len) {
+    char name[64];
+    double start;
+    sdaint *arrs = malloc(count*sizeof(*arrs));
+    assert(arrs != NULL);
+    for(size_t c=0; c<count; c++) {
+        arrs[c] = sda_new_sz(arrs[c], NULL, len*sizeof(int));
+        arrs[c] = sda_reserve(arrs[c], len);
+    }
+    start = _start();
+    for(size_t c=0; c<count; c++) {
+        arrs[c] = sda_compact(arrs[c]);
+    }
+    snprintf(name, sizeof(name), "compact/len=%zu", len);
+    _report(name, count, _now()-start, 0);
+    for(size_t c=0; c<count; c++) {
+        assert(sda_avail(arrs[c]) == 0);
+        sda_free(arrs[c]);
+    }
+    free(arrs);
+}
+
+/* Append from 65000 to 66000 ints, across the SM->MD boundary at 65535,
+ * against the same appends on the hand written array */
+static void bench_promote_curve(size_t reps) {
+    double secs = 0, start;
+    size_t promotes = 0;
+    struct sda_stats before, after;
+    _start();
+    for(size_t r=0; r<reps; r++) {
+        sdaint s = sda_new_sz(s, NULL, 65000*sizeof(int));
+        sda_stats_snapshot(&before);
+        start = _now();
+        for(int i=0; i<1000; i++) {
+            s = sda_append(s, i);
+        }
+        secs += _now()-start;
+        sda_stats_snapshot(&after);
+        promotes += after.promote_md - before.promote_md;
+        sda_free(s);
+    }
+    //nothing to promote with SDA_FIXED_HDR
+    assert(promotes == ((_sda_req_htype(0, UINT16_MAX, sizeof(int)) == SDA_HTYPE_MD) ? reps : 0));
+    _report("promote/append 65000->66000/sda", reps*1000, secs, 0);
+
+    secs = 0;
+    _start();
+    for(size_t r=0; r<reps; r++) {
+        struct _vec v = {malloc(65000*sizeof(int)), 65000, 65000};
+        assert(v.p != NULL);
+        start = _now();
+        for(int i=0; i<1000; i++) {
+            _vec_push(&v, i);
+        }
+        secs += _now()-start;
+        free(v.p);
+    }
+    _report_baseline("promote/append 65000->66000/malloc array", reps*1000, secs);
+}
+
+SDA_DEFINE(int, int)
+
+/* Push n ints and read them back in random order, generic vs SDA_DEFINE */
+static void bench_typed(size_t n, size_t reps) {
+    double start;
+    long sum;
+    uint32_t x = 2463534242u;
+    uint32_t *idx = malloc(n*sizeof(*idx));
+    sdaint s = sda_empty(s);
+    assert(idx != NULL);
+    for(size_t i=0; i<n; i++) idx[i] = _rand_next(&x) % n;
+
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        s = sda_append(s, (int)i);
+    }
+    _report("typed/push/sda_append", n, _now()-start, 0);
+    sda_free(s);
+    s = sda_int_new(0);
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        s = sda_int_push(s, (int)i);
+    }
+    _report("typed/push/sda_int_push", n, _now()-start, 0);
+
+    sum = 0;
+    start = _start();
+    for(size_t r=0; r<reps; r++) {
+        for(size_t k=0; k<n; k++) sum += sda_get(s, idx[k]);
+    }
+    _report("typed/get/sda_get", n*reps, _now()-start, 0);
+    start = _start();
+    for(size_t r=0; r<reps; r++) {
+        for(size_t k=0; k<n; k++) sum += sda_int_get(s, idx[k]);
+    }
+    _report("typed/get/sda_int_get", n*reps, _now()-start, 0);
+    _sink = sum;
+
+    start = _start();
+    for(size_t r=0; r<reps; r++) {
+        for(size_t k=0; k<n; k++) s = sda_set(s, idx[k], (int)k);
+    }
+    _report("typed/set/sda_set", n*reps, _now()-start, 0);
+    start = _start();
+    for(size_t r=0; r<reps; r++) {
+        for(size_t k=0; k<n; k++) s = sda_int_set(s, idx[k], (int)k);
+    }
+    _report("typed/set/sda_int_set", n*reps, _now()-start, 0);
+    free(idx);
+    sda_free(s);
+}
+
+/* Build an n element int array with a forced header type, sda only picks
+ * MD/LG once the len needs it. Always LG with SDA_FIXED_HDR. */
+static sdaint _new_htype(char type, size_t n) {
+    size_t hdr_sz;
+    char *sh;
+    sdaint s;
+    type = _sda_htype(type);
+    switch(type) {
+        case SDA_HTYPE_SM: hdr_sz = sizeof(SDA_HDR_TYPE(SM)); break;
+        case SDA_HTYPE_MD: hdr_sz = sizeof(SDA_HDR_TYPE(MD)); break;
+        default: hdr_sz = sizeof(SDA_HDR_TYPE(LG)); break;
+    }
+    sh = _sda_malloc(NULL, hdr_sz+n*sizeof(int));
+    memset(sh, 0, hdr_sz);
+    s = (sdaint)(sh+hdr_sz);
+    _sda_set_flags(s, type);
+    _sda_set_sz(s, sizeof(int));
+    _sda_set_alloc(s, n*sizeof(int));
+    _sda_set_len(s, n);
+    for(size_t i=0; i<n; i++) s[i] = (int)i;
+    return s;
+}
+
+/* Sum an array with sda_get vs sda_view */
+static void bench_view(const char *type_name, char type, size_t n, size_t reps) {
+    char name[64];
+    double start;
+    long sum;
+    sdaint s = _new_htype(type, n);
+
+    sum = 0;
+    start = _start();
+    for(size_t r=0; r<reps; r++) {
+        for(size_t i=0; i<sda_len(s); i++) {
+            sum += sda_get(s, i);
+        }
+    }
+    snprintf(name, sizeof(name), "scan/%s/sda_get", type_name);
+    _report(name, n*reps, _now()-start, 0);
+    _sink = sum;
+
+    sum = 0;
+    start = _start();
+    for(size_t r=0; r<reps; r++) {
+        struct sda_view v = sda_view(s);
+        for(size_t i=0; i<v.len; i++) {
+            sum += sda_view_get(&v, int, i);
+        }
+    }
+    snprintf(name, sizeof(name), "scan/%s/sda_view_get", type_name);
+    _report(name, n*reps, _now()-start, 0);
+    _sink = sum;
+
+    sum = 0;
+    start = _start();
+    for(size_t r=0; r<reps; r++) {
+        struct sda_view v = sda_view(s);
+        sda_view_foreach(&v, int, p) {
+            sum += *p;
+        }
+    }
+    snprintf(name, sizeof(name), "scan/%s/sda_view_foreach", type_name);
+    _report(name, n*reps, _now()-start, 0);
+    _sink = sum;
+
+    sum = 0;
+    start = _start();
+    for(size_t r=0; r<reps; r++) {
+        sda_foreach(s, p) {
+            sum += *p;
+        }
+    }
+    snprintf(name, sizeof(name), "scan/%s/sda_foreach", type_name);
+    _report(name, n*reps, _now()-start, 0);
+    _sink = sum;
+    sda_free(s);
+}
+
+/* A "request" that builds 32 small arrays of 10 ints and throws them away.
+ * arena can be NULL to use the heap */
+static void bench_request(const char *name, struct sda_arena *arena, size_t n) {
+    sdaint arrs[32];
+    double start = _start();
+    for(size_t r=0; r<n; r++) {
+        for(int i=0; i<32; i++) {
+            arrs[i] = (arena != NULL) ? sda_empty_in(arrs[i], arena) : sda_empty(arrs[i]);
+            for(int j=0; j<10; j++) {
+                arrs[i] = sda_append(arrs[i], j);
+            }
+        }
+        _sink = sda_len(arrs[r%32]);
+        if(arena != NULL) {
+            sda_arena_reset(arena);
+        }
+        else {
+            for(int i=0; i<32; i++) sda_free(arrs[i]);
+        }
+    }
+    _report(name, n, _now()-start, 0);
+}
+
+/* Build and throw away n arrays of 10 ints, on the heap or with sda_stack */
+static void bench_small(size_t n) {
+    double start = _start();
+    for(size_t r=0; r<n; r++) {
+        sda_raii sdaint s = sda_empty(s);
+        for(int j=0; j<10; j++) s = sda_append(s, j);
+        _sink = sda_len(s);
+    }
+    _report("small/heap", n, _now()-start, 0);
+
+    start = _start();
+    for(size_t r=0; r<n; r++) {
+        sda_raii sdaint s = sda_stack(s, 16);
+        for(int j=0; j<10; j++) s = sda_append(s, j);
+        _sink = sda_len(s);
+    }
+    _report("small/sda_stack", n, _now()-start, 0);
+}
+
+/* FIFO of depth ints: push one to the back and take one off the front, n
+ * times. Plain arrays have to shift everything down on every pop. */
+static void bench_fifo(size_t depth, size_t n) {
+    char name[64];
+    double start;
+    long sum = 0;
+    sdaint s = sda_empty(s);
+    for(size_t i=0; i<depth; i++) s = sda_append(s, (int)i);
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        s = sda_append(s, (int)i);
+        sum += s[0];
+        memmove(s, s+1, (sda_len(s)-1)*sizeof(*s));
+        sda_pop_ptr(s);
+    }
+    snprintf(name, sizeof(name), "fifo/%zu/memmove", depth);
+    //the memmoves are ours, sda_stats doesn't see them
+    _report_baseline(name, n, _now()-start);
+    _sink = sum;
+    sda_free(s);
+
+    s = sda_deque_empty(s);
+    for(size_t i=0; i<depth; i++) s = sda_deque_push_back(s, (int)i);
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        s = sda_deque_push_back(s, (int)i);
+        sum += sda_deque_pop_front(s);
+    }
+    snprintf(name, sizeof(name), "fifo/%zu/sda_deque", depth);
+    _report(name, n, _now()-start, 0);
+    _sink = sum;
+    sda_free(s);
+}
+
+//waiting on the other thread, lets it run if there's only one core
+#define _WAIT_FOR(cond) do { while(!(cond)) sched_yield(); } while(0)
+
+//16 byte record passed between threads
+struct _rec {
+    uint64_t seq;
+    uint64_t payload;
+};
+
+struct _spsc_arg {
+    struct sda_spsc *q;
+    size_t n;
+    size_t batch;
+};
+
+static void *_spsc_producer(void *p) {
+    struct _spsc_arg *arg = p;
+    struct _rec recs[64];
+    for(size_t i=0; i<arg->n; i+=arg->batch) {
+        size_t done = 0;
+        for(size_t j=0; j<arg->batch; j++) recs[j].seq = i+j;
+        for(;;) {
+            done += sda_spsc_push_n(arg->q, recs+done, arg->batch-done);
+            if(done == arg->batch) break;
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/* Move n records from one thread to another, batch at a time */
+static void bench_spsc(size_t n, size_t batch) {
+    char name[64];
+    struct _rec recs[64];
+    struct _spsc_arg arg = {sda_spsc_new(4096, sizeof(struct _rec)), n, batch};
+    pthread_t producer;
+    size_t got = 0;
+    double start = _start();
+    pthread_create(&producer, NULL, _spsc_producer, &arg);
+    while(got < n) {
+        size_t k = sda_spsc_pop_n(arg.q, recs, batch);
+        if(k == 0) sched_yield();
+        got += k;
+    }
+    pthread_join(producer, NULL);
+    snprintf(name, sizeof(name), "spsc/throughput/batch=%zu", batch);
+    _report(name, n, _now()-start, 0);
+    _sink = recs[0].seq;
+    sda_spsc_free(arg.q);
+}
+
+struct _locked_arg {
+    pthread_mutex_t lock;
+    struct _rec *q;
+    size_t n;
+};
+
+static void *_locked_producer(void *p) {
+    struct _locked_arg *arg = p;
+    struct _rec r = {0, 0};
+    for(size_t i=0; i<arg->n; i++) {
+        r.seq = i;
+        pthread_mutex_lock(&arg->lock);
+        arg->q = sda_deque_push_back(arg->q, r);
+        pthread_mutex_unlock(&arg->lock);
+    }
+    return NULL;
+}
+
+/* The same thing with a mutex around an sda deque */
+static void bench_locked(size_t n) {
+    struct _locked_arg arg;
+    pthread_t producer;
+    size_t got = 0;
+    double start = _start();
+    pthread_mutex_init(&arg.lock, NULL);
+    arg.q = sda_deque_empty(arg.q);
+    arg.n = n;
+    pthread_create(&producer, NULL, _locked_producer, &arg);
+    while(got < n) {
+        pthread_mutex_lock(&arg.lock);
+        void *r = sda_deque_pop_front_ptr(arg.q);
+        pthread_mutex_unlock(&arg.lock);
+        if(r != NULL) got++;
+        else sched_yield();
+    }
+    pthread_join(producer, NULL);
+    _report("spsc/throughput/mutex+deque", n, _now()-start, 0);
+    sda_free(arg.q);
+    pthread_mutex_destroy(&arg.lock);
+}
+
+static void *_pong(void *p) {
+    struct sda_spsc **qs = p;
+    struct _rec r;
+    for(;;) {
+        _WAIT_FOR(sda_spsc_pop(qs[0], &r));
+        _WAIT_FOR(sda_spsc_push(qs[1], &r));
+        if(r.seq == SIZE_MAX) return NULL;
+    }
+}
+
+/* Round trip of one record to another thread and back over two queues */
+static void bench_spsc_latency(size_t n) {
+    struct sda_spsc *qs[2] = {sda_spsc_new(64, sizeof(struct _rec)), sda_spsc_new(64, sizeof(struct _rec))};
+    struct _rec r = {0, 0};
+    pthread_t t;
+    double start;
+    pthread_create(&t, NULL, _pong, qs);
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        r.seq = i;
+        _WAIT_FOR(sda_spsc_push(qs[0], &r));
+        _WAIT_FOR(sda_spsc_pop(qs[1], &r));
+    }
+    _report("spsc/round trip", n, _now()-start, 0);
+    r.seq = SIZE_MAX;
+    sda_spsc_push(qs[0], &r);
+    pthread_join(t, NULL);
+    sda_spsc_pop(qs[1], &r);
+    sda_spsc_free(qs[0]);
+    sda_spsc_free(qs[1]);
+}
+
+struct _append_arg {
+    struct sda_conc *c;
+    pthread_mutex_t *lock;
+    sdaint *s;
+    size_t n;
+    size_t batch;
+};
+
+static void *_conc_writer(void *p) {
+    struct _append_arg *arg = p;
+    int batch[64];
+    for(size_t i=0; i<arg->n; i+=arg->batch) {
+        for(size_t j=0; j<arg->batch; j++) batch[j] = (int)(i+j);
+        sda_conc_append_n(arg->c, batch, arg->batch);
+    }
+    return NULL;
+}
+
+static void *_locked_writer(void *p) {
+    struct _append_arg *arg = p;
+    int batch[64];
+    for(size_t i=0; i<arg->n; i+=arg->batch) {
+        for(size_t j=0; j<arg->batch; j++) batch[j] = (int)(i+j);
+        pthread_mutex_lock(arg->lock);
+        *arg->s = sda_append_n(*arg->s, batch, arg->batch);
+        pthread_mutex_unlock(arg->lock);
+    }
+    return NULL;
+}
+
+/* n ints appended to one array by nthreads threads, batch at a time, with
+ * sda_conc or a mutex around sda_append_n */
+static void bench_conc(size_t nthreads, size_t n, size_t batch, int locked) {
+    char name[64];
+    pthread_t threads[16];
+    struct _append_arg args[16];
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    struct sda_conc *c = sda_conc_new(sizeof(int), 1024);
+    sdaint s = sda_empty(s);
+    double start = _start();
+    for(size_t t=0; t<nthreads; t++) {
+        struct _append_arg a = {c, &lock, &s, n/nthreads, batch};
+        args[t] = a;
+        pthread_create(&threads[t], NULL, locked ? _locked_writer : _conc_writer, &args[t]);
+    }
+    for(size_t t=0; t<nthreads; t++) pthread_join(threads[t], NULL);
+    if(!locked) {
+        s = sda_free(s);
+        s = sda_conc_finish(c);
+    }
+    else {
+        sda_conc_free(c);
+    }
+    snprintf(name, sizeof(name), "append/%zu threads/%s/batch=%zu", nthreads, locked ? "mutex" : "sda_conc", batch);
+    _report(name, n, _now()-start, 0);
+    assert(sda_len(s) == n);
+    sda_free(s);
+}
+
+static void _map_affine(const void *in, void *out, size_t n, void *ctx) {
+    const int *src = in;
+    int *dst = out;
+    (void)ctx;
+    for(size_t i=0; i<n; i++) dst[i] = src[i]*2+1;
+}
+
+static void _fold_sum(const void *elems, size_t n, void *acc, void *ctx) {
+    const int *p = elems;
+    long sum = 0;
+    (void)ctx;
+    for(size_t i=0; i<n; i++) sum += p[i];
+    *(long *)acc += sum;
+}
+
+static void _combine_sum(void *acc, const void *other, void *ctx) {
+    (void)ctx;
+    *(long *)acc += *(const long *)other;
+}
+
+/* Memory bound map and reduce over n ints, on one thread and on the pool */
+static void bench_parallel(size_t n, size_t reps) {
+    char name[64];
+    double start;
+    long sum = 0;
+    sdaint s = sda_new_sz(s, NULL, n*sizeof(int));
+    sdaint out = sda_new_sz(out, NULL, n*sizeof(int));
+    for(size_t i=0; i<n; i++) s[i] = (int)i;
+
+    start = _start();
+    for(size_t r=0; r<reps; r++) _map_affine(s, out, n, NULL);
+    _report("parallel/map/serial", n*reps, _now()-start, 0);
+    start = _start();
+    for(size_t r=0; r<reps; r++) _fold_sum(s, n, &sum, NULL);
+    _report("parallel/reduce/serial", n*reps, _now()-start, 0);
+
+    for(size_t t=1; t<=8; t*=2) {
+        sda_parallel_set_threads(t);
+        start = _start();
+        for(size_t r=0; r<reps; r++) sda_parallel_map(s, out, _map_affine, NULL);
+        snprintf(name, sizeof(name), "parallel/map/%zu threads", t);
+        _report(name, n*reps, _now()-start, 0);
+        start = _start();
+        for(size_t r=0; r<reps; r++) sda_parallel_reduce(s, _fold_sum, _combine_sum, &sum, sizeof(sum), NULL);
+        snprintf(name, sizeof(name), "parallel/reduce/%zu threads", t);
+        _report(name, n*reps, _now()-start, 0);
+    }
+    sda_parallel_set_threads(0);
+    _sink = sum + out[n-1];
+    sda_free(s);
+    sda_free(out);
+}
+
+/* Grow a byte array 1MB at a time up to mb MB, without any slack so every
+ * step reallocates */
+static void bench_big_grow(const char *name, size_t mmap_threshold, size_t mb) {
+    static const struct sda_growth exact = {1.0, 0, NULL, NULL};
+    double start;
+    sda_mmap_set_threshold(mmap_threshold);
+    uint8_t *s = sda_empty(s);
+    s = sda_set_growth(s, &exact);
+    start = _start();
+    for(size_t i=1; i<=mb; i++) {
+        s = sda_resize(s, i<<20);
+        //touch the new part so it's really there
+        s[(i<<20)-1] = 1;
+    }
+    _report(name, mb, _now()-start, 0);
+    _sink = sda_len(s);
+    sda_free(s);
+    sda_mmap_set_threshold(0);
+}
+
+/* Read len and the last element of n small arrays with a mix of header
+ * types, so without SDA_FIXED_HDR the header switch can't be predicted */
+static void bench_hdr_mix(size_t n, size_t reps) {
+    static const char types[] = {SDA_HTYPE_SM, SDA_HTYPE_MD, SDA_HTYPE_LG};
+    sdaint *pool = malloc(n*sizeof(*pool));
+    size_t total = 0;
+    uint32_t x = 2463534242u;
+    double start;
+    long sum = 0;
+    assert(pool != NULL);
+    for(size_t i=0; i<n; i++) {
+        pool[i] = _new_htype(types[_rand_next(&x)%3], 16);
+        total += sda_total_size(pool[i]);
+    }
+    start = _start();
+    for(size_t r=0; r<reps; r++) {
+        for(size_t i=0; i<n; i++) {
+            sdaint s = pool[i];
+            sum += sda_len(s) + s[sda_len(s)-1];
+        }
+    }
+    _report("hdr/mixed len+last", n*reps, _now()-start, 0);
+    _sink = sum;
+    if(_json) printf("{\"hdr\":\"%s\",\"section\":\"%s\",\"name\":\"hdr/footprint\",\"bytes_per_array\":%.1f}\n", _hdr_mode, _section_name, (double)total/n);
+    else printf("%-40s %.1f bytes per 16 int array\n", "hdr/footprint", (double)total/n);
+    for(size_t i=0; i<n; i++) sda_free(pool[i]);
+    free(pool);
+}
+
+/* Time the append that promotes a compacted SM array to MD */
+static void bench_promote(size_t n) {
+    double secs = 0, start;
+    _start();
+    for(size_t r=0; r<n; r++) {
+        sdaint s = sda_new_sz(s, NULL, (UINT16_MAX-1)*sizeof(int));
+        start = _now();
+        s = sda_append(s, 1);
+        secs += _now()-start;
+        assert((sda_flags(s)&SDA_HTYPE_MASK) == _sda_req_htype(0, UINT16_MAX, sizeof(int)));
+        sda_free(s);
+    }
+    _report("promote/SM->MD", n, secs, 0);
+}
+
+/* Sum and min of an int array with a plain loop vs the reduction kernels */
+static void bench_reduce(size_t n, size_t reps) {
+    static const char *isa_names[] = {"scalar", "sse2", "avx2"};
+    char name[64];
+    double start;
+    long sum;
+    int best;
+    sdaint s = sda_new_sz(s, NULL, n*sizeof(int));
+    for(size_t i=0; i<n; i++) s[i] = (int)(i*7919);
+
+    sum = 0;
+    start = _start();
+    for(size_t r=0; r<reps; r++) {
+        for(size_t i=0; i<sda_len(s); i++) {
+            sum += sda_get(s, i);
+        }
+    }
+    _report("reduce/sum/sda_get", n*reps, _now()-start, 0);
+    _sink = sum;
+
+    best = sda_reduce_isa();
+    for(int isa=SDA_ISA_SCALAR; isa<=best; isa++) {
+        sda_reduce_set_isa(isa);
+        sum = 0;
+        start = _start();
+        for(size_t r=0; r<reps; r++) {
+            sum += sda_sum_i(s);
+        }
+        snprintf(name, sizeof(name), "reduce/sum/sda_sum_i/%s", isa_names[isa]);
+        _report(name, n*reps, _now()-start, 0);
+        _sink = sum;
+
+        sum = 0;
+        start = _start();
+        for(size_t r=0; r<reps; r++) {
+            sum += sda_min_i(s);
+        }
+        snprintf(name, sizeof(name), "reduce/min/sda_min_i/%s", isa_names[isa]);
+        _report(name, n*reps, _now()-start, 0);
+        _sink = sum;
+    }
+    sda_reduce_set_isa(best);
+    sda_free(s);
+}
+
+static int _cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+#define _int_less(a, b) ((a) < (b))
+SDA_SORT_DEFINE(_bench_introsort, int, _int_less)
+
+/* Sort n random ints with qsort, the typed introsort and the radix sort,
+ * then look every value up with sda_lower_bound */
+static void bench_sort(size_t n) {
+    double start;
+    sdaint src = sda_new_sz(src, NULL, n*sizeof(int));
+    sdaint s = sda_new_sz(s, NULL, n*sizeof(int));
+    for(size_t i=0; i<n; i++) src[i] = rand() - RAND_MAX/2;
+
+    memcpy(s, src, n*sizeof(int));
+    start = _start();
+    qsort(s, sda_len(s), sda_sz(s), _cmp_int);
+    _report("sort/qsort", n, _now()-start, 0);
+
+    memcpy(s, src, n*sizeof(int));
+    start = _start();
+    _bench_introsort(s);
+    _report("sort/SDA_SORT_DEFINE", n, _now()-start, 0);
+
+    memcpy(s, src, n*sizeof(int));
+    start = _start();
+    sda_sort_i(s);
+    _report("sort/sda_sort_i", n, _now()-start, 0);
+
+    size_t found = 0;
+    start = _start();
+    for(size_t i=0; i<n; i++) {
+        found += sda_lower_bound(s, src[i]);
+    }
+    _report("sort/sda_lower_bound", n, _now()-start, 0);
+    _sink = found;
+    sda_free(src);
+    sda_free(s);
+}
+
+/* Hand an n int array to consumers that read one element each and let go,
+ * copying it for each of them vs sharing it */
+static void bench_share(size_t n, size_t consumers) {
+    double start;
+    long sum = 0;
+    sdaint s = sda_new_sz(s, NULL, n*sizeof(int));
+    for(size_t i=0; i<n; i++) s[i] = (int)i;
+
+    start = _start();
+    for(size_t c=0; c<consumers; c++) {
+        sdaint t = sda_dup(s);
+        sum += t[c%n];
+        sda_free(t);
+    }
+    _report("share/sda_dup", consumers, _now()-start, 0);
+
+    start = _start();
+    for(size_t c=0; c<consumers; c++) {
+        sdaint t = sda_share(s);
+        sum += t[c%n];
+        sda_free(t);
+    }
+    _report("share/sda_share", consumers, _now()-start, 0);
+    _sink = sum;
+    sda_free(s);
+}
+
+/* Load an mb MB file of ints by reading it in and by mapping it, once without
+ * touching the elements and once summing all of them */
+static void bench_load(size_t mb) {
+    static const char *mode_names[] = {"rdonly", "cow", "copy"};
+    static const int modes[] = {SDA_LOAD_RDONLY, SDA_LOAD_COPY};
+    char path[] = "/tmp/sda_benchXXXXXX";
+    char name[64];
+    double start;
+    size_t n = (mb<<20)/sizeof(int);
+    sdaint s = sda_new_sz(s, NULL, n*sizeof(int));
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    for(size_t i=0; i<n; i++) s[i] = (int)i;
+    assert(sda_save(s, path) == 0);
+    sda_free(s);
+
+    for(size_t m=0; m<sizeof(modes)/sizeof(*modes); m++) {
+        start = _start();
+        s = sda_load(path, modes[m]);
+        snprintf(name, sizeof(name), "load/%s", mode_names[modes[m]]);
+        _report(name, mb, _now()-start, 0);
+        assert(s != NULL);
+        sda_free(s);
+
+        start = _start();
+        s = sda_load(path, modes[m]);
+        _sink = sda_sum_i(s);
+        snprintf(name, sizeof(name), "load/%s+sda_sum_i", mode_names[modes[m]]);
+        _report(name, mb, _now()-start, 0);
+        sda_free(s);
+    }
+    unlink(path);
+}
+
+/* Read an mb MB file into a char array 64K at a time, through a temporary
+ * buffer and sda_cat vs sda_read_fd */
+static void bench_read_fd(size_t mb) {
+    static char tmp[64*1024];
+    char path[] = "/tmp/sda_benchXXXXXX";
+    double start;
+    ssize_t r;
+    int fd = mkstemp(path);
+    char *s = sda_new_sz(s, NULL, mb<<20);
+    assert(fd >= 0);
+    memset(s, 'x', mb<<20);
+    assert(sda_writev_fd(fd, (sda *)&s, 1, 0) == (ssize_t)(mb<<20));
+    sda_free(s);
+
+    s = sda_new_sz(s, NULL, 0);
+    lseek(fd, 0, SEEK_SET);
+    start = _start();
+    while ((r = read(fd, tmp, sizeof(tmp))) > 0) s = sda_cat(s, tmp, r);
+    _report("read/read+sda_cat", mb, _now()-start, 0);
+    assert(sda_len(s) == mb<<20);
+    sda_free(s);
+
+    s = sda_new_sz(s, NULL, 0);
+    lseek(fd, 0, SEEK_SET);
+    start = _start();
+    do {
+        s = sda_read_fd(s, fd, sizeof(tmp), &r);
+    } while (r > 0);
+    _report("read/sda_read_fd", mb, _now()-start, 0);
+    assert(sda_len(s) == mb<<20);
+    sda_free(s);
+    close(fd);
+    unlink(path);
+}
+
+int main(int argc, char **argv) {
+    static const size_t ns[] = {1000, 10000, 100000, 1000000, 4000000};
+
+    for(int i=1; i<argc; i++) {
+        if(strcmp(argv[i], "--json") == 0) {
+            _json = 1;
+        }
+        else {
+            fprintf(stderr, "usage: %s [--json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(!_json) printf("header: %s\n", _hdr_mode);
+
+    _section("sda_append growth");
+    for(size_t i=0; i<sizeof(ns)/sizeof(*ns); i++) {
+        bench_append("append/legacy", &sda_growth_legacy, ns[i]);
+        bench_append("append/geometric", &sda_growth_geometric, ns[i]);
+        bench_append_baseline(ns[i]);
+    }
+
+    _section("typed arrays");
+    bench_typed(1000000, 10);
+
+    _section("sda_cat growth");
+    bench_cat(1000000, 1);
+    bench_cat(1000000, 16);
+    bench_cat(100000, 256);
+
+    _section("element access");
+    bench_access(1000, 10000);
+    bench_access(4000000, 5);
+
+    _section("sda_resize zeroing");
+    bench_resize(4000000, 1);
+    bench_resize(4000000, 1000);
+
+    _section("sda_compact");
+    bench_compact(100000, 10);
+    bench_compact(1000, 100000);
+
+    _section("bulk push");
+    bench_push(1<<20);
+
+    _section("sequential scan");
+#if !defined(SDA_FIXED_HDR)
+    bench_view("SM", SDA_HTYPE_SM, 60000, 200);
+    bench_view("MD", SDA_HTYPE_MD, 60000, 200);
+#endif
+    bench_view("LG", SDA_HTYPE_LG, 60000, 200);
+
+    _section("header types");
+    bench_hdr_mix(4096, 2000);
+
+    _section("reductions");
+    bench_reduce(60000, 200);
+
+    _section("sorting");
+    bench_sort(1000);
+    bench_sort(1000000);
+
+    _section("request scoped arrays");
+    struct sda_arena *arena = sda_arena_new(64*1024);
+    bench_request("request/heap", NULL, 100000);
+    bench_request("request/arena", arena, 100000);
+    sda_cache_set_max(64*1024);
+    bench_request("request/heap+cache", NULL, 100000);
+    sda_cache_trim(0);
+    sda_cache_set_max(0);
+    sda_arena_free(arena);
+
+    _section("small arrays");
+    bench_small(1000000);
+
+    _section("FIFO queues");
+    bench_fifo(16, 1000000);
+    bench_fifo(10000, 100000);
+
+    _section("SPSC queue");
+    bench_locked(4000000);
+    bench_spsc(4000000, 1);
+    bench_spsc(4000000, 16);
+    bench_spsc(4000000, 64);
+    bench_spsc_latency(200000);
+
+    _section("concurrent append");
+    for(size_t t=1; t<=4; t*=2) {
+        bench_conc(t, 4000000, 1, 1);
+        bench_conc(t, 4000000, 1, 0);
+        bench_conc(t, 4000000, 64, 1);
+        bench_conc(t, 4000000, 64, 0);
+    }
+
+    char title[64];
+    snprintf(title, sizeof(title), "parallel (%zu cpus)", sda_parallel_threads());
+    _section(title);
+    bench_parallel(16<<20, 10);
+
+    _section("sharing 1M ints");
+    bench_share(1<<20, 1000);
+
+    _section("load/read 256MB (n in MB)");
+    bench_load(256);
+    bench_read_fd(256);
+
+    _section("header promotion");
+    bench_promote(1000);
+    bench_promote_curve(1000);
+
+    _section("1MB resize steps");
+    bench_big_grow("grow/heap", 0, 512);
+    bench_big_grow("grow/mmap", 1<<20, 512);
+    return 0;
+}
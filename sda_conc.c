@@ -0,0 +1,239 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Array that many threads can append to at once.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdlib.h>
+#include <assert.h>
+#include "sda_conc.h"
+
+#if defined(SDA_CONC_TEST_MAIN)
+#include <stdio.h>
+#include <pthread.h>
+#endif
+
+/* Segment k > 0 starts at element init_cap << (k-1) and holds as many */
+static inline size_t _sda_conc_seg_start(const struct sda_conc *c, unsigned k) {
+    return k ? ((size_t)1 << (c->seg0_bits+k-1)) : 0;
+}
+
+static inline size_t _sda_conc_seg_cap(const struct sda_conc *c, unsigned k) {
+    return (size_t)1 << (c->seg0_bits + (k ? k-1 : 0));
+}
+
+/* Segment that element i lives in */
+static inline unsigned _sda_conc_seg(const struct sda_conc *c, size_t i) {
+    size_t q = i >> c->seg0_bits;
+    if (q == 0) return 0;
+    return sizeof(unsigned long long)*8 - __builtin_clzll(q);
+}
+
+/* Segment k, allocating it if nobody has yet. NULL if out of memory. */
+static char *_sda_conc_get_seg(struct sda_conc *c, unsigned k) {
+    char *seg = __atomic_load_n(&c->segs[k], __ATOMIC_ACQUIRE);
+    char *expect = NULL;
+    if (seg != NULL) return seg;
+    //the later segments of wide elements can't be addressed
+    if (_sda_conc_seg_cap(c, k) > SIZE_MAX/c->sz) return NULL;
+    seg = _sda_new_sz(NULL, _sda_conc_seg_cap(c, k)*c->sz, c->sz);
+    if (seg == NULL) return NULL;
+    if (!__atomic_compare_exchange_n(&c->segs[k], &expect, seg, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        //another writer got there first
+        sda_free(seg);
+        seg = expect;
+    }
+    return seg;
+}
+
+struct sda_conc *sda_conc_new(size_t sz, size_t init_cap) {
+    struct sda_conc *c;
+    unsigned bits = 0;
+    assert(sz > 0 && sz <= SDA_MAX_SZ);
+    while (((size_t)1 << bits) < init_cap) bits++;
+    //cache line aligned like sda_spsc, len gets a line to itself
+    c = _sda_new_ext(NULL, sizeof(*c), 1, SDA_CACHE_LINE, NULL);
+    if (c == NULL) return NULL;
+    c->sz = sz;
+    c->seg0_bits = bits;
+    return c;
+}
+
+void sda_conc_free(struct sda_conc *c) {
+    if (c == NULL) return;
+    for (unsigned k = 0; k < SDA_CONC_SEGS; k++) sda_free(c->segs[k]);
+    sda_free(c);
+}
+
+size_t sda_conc_append_n(struct sda_conc *c, const void *x, size_t n) {
+    const char *src = x;
+    size_t first, i;
+    if (n == 0) return sda_conc_len(c);
+    //this is the only point where writers meet
+    first = __atomic_fetch_add(&c->len, n, __ATOMIC_RELAXED);
+    for (i = first; n > 0; ) {
+        unsigned k = _sda_conc_seg(c, i);
+        size_t off = i - _sda_conc_seg_start(c, k);
+        size_t run = _sda_conc_seg_cap(c, k) - off;
+        char *seg = _sda_conc_get_seg(c, k);
+        if (seg == NULL) {
+            __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+            return SDA_NPOS;
+        }
+        if (run > n) run = n;
+        memcpy(seg + off*c->sz, src, run*c->sz);
+        src += run*c->sz;
+        i += run;
+        n -= run;
+    }
+    return first;
+}
+
+void *sda_conc_ptr_at(const struct sda_conc *c, size_t i) {
+    unsigned k;
+    char *seg;
+    if (i >= sda_conc_len(c)) return NULL;
+    k = _sda_conc_seg(c, i);
+    seg = __atomic_load_n(&c->segs[k], __ATOMIC_ACQUIRE);
+    if (seg == NULL) return NULL;
+    return seg + (i - _sda_conc_seg_start(c, k))*c->sz;
+}
+
+sda sda_conc_finish(struct sda_conc *c) {
+    size_t len = sda_conc_len(c), done = 0;
+    char *s;
+    if (c->failed) {
+        sda_conc_free(c);
+        return NULL;
+    }
+    s = _sda_new_sz(NULL, len*c->sz, c->sz);
+    if (s == NULL) {
+        sda_conc_free(c);
+        return NULL;
+    }
+    for (unsigned k = 0; done < len; k++) {
+        size_t run = _sda_conc_seg_cap(c, k);
+        if (run > len-done) run = len-done;
+        memcpy(s + done*c->sz, c->segs[k], run*c->sz);
+        done += run;
+    }
+    sda_conc_free(c);
+    return s;
+}
+
+
+/******* Test stuff *******/
+
+#if defined(SDA_CONC_TEST_MAIN)
+
+#define _TEST_THREADS 4
+#define _TEST_PER_THREAD 200000
+
+struct _test_arg {
+    struct sda_conc *c;
+    uint32_t id;
+};
+
+static void *_test_writer(void *p) {
+    struct _test_arg *arg = p;
+    uint32_t batch[13];
+    uint32_t i = 0;
+    while (i < _TEST_PER_THREAD) {
+        //mix single appends with batches that cross segments
+        if (i%3 == 0) {
+            size_t idx = sda_conc_append(arg->c, (arg->id << 24) | i);
+            assert(idx != SDA_NPOS);
+            i++;
+            continue;
+        }
+        size_t n = 0;
+        for (; n < 13 && i < _TEST_PER_THREAD; n++, i++) batch[n] = (arg->id << 24) | i;
+        assert(sda_conc_append_n(arg->c, batch, n) != SDA_NPOS);
+    }
+    return NULL;
+}
+
+int main(void) {
+    struct sda_conc *c;
+    pthread_t threads[_TEST_THREADS];
+    struct _test_arg args[_TEST_THREADS];
+    uint32_t next[_TEST_THREADS] = {0};
+    uint64_t vals[20];
+
+    c = sda_conc_new(sizeof(uint64_t), 3);
+    assert(c != NULL);
+    assert(((uintptr_t)&c->len)%SDA_CACHE_LINE == 0);
+    assert(c->seg0_bits == 2);
+    //segments of 4, 4, 8, 16...
+    assert(_sda_conc_seg(c, 3) == 0);
+    assert(_sda_conc_seg(c, 4) == 1 && _sda_conc_seg(c, 7) == 1);
+    assert(_sda_conc_seg(c, 8) == 2 && _sda_conc_seg(c, 15) == 2);
+    assert(_sda_conc_seg(c, 16) == 3);
+    assert(sda_conc_ptr_at(c, 0) == NULL);
+    for (uint64_t i = 0; i < 20; i++) vals[i] = i*10;
+    assert(sda_conc_append(c, (uint64_t)1) == 0);
+    //spans segments 0 to 3
+    assert(sda_conc_append_n(c, vals, 20) == 1);
+    assert(sda_conc_len(c) == 21);
+    assert(*(uint64_t *)sda_conc_ptr_at(c, 0) == 1);
+    assert(*(uint64_t *)sda_conc_ptr_at(c, 20) == 190);
+    assert(sda_conc_ptr_at(c, 21) == NULL);
+    assert(sda_conc_append_n(c, vals, 0) == 21);
+    uint64_t *fin = sda_conc_finish(c);
+    assert(fin != NULL);
+    assert(sda_len(fin) == 21 && sda_sz(fin) == sizeof(uint64_t));
+    assert(fin[0] == 1);
+    for (size_t i = 0; i < 20; i++) assert(fin[i+1] == i*10);
+    sda_free(fin);
+
+    //empty
+    c = sda_conc_new(sizeof(int), 0);
+    sda_raii sdaint e = sda_conc_finish(c);
+    assert(e != NULL && sda_len(e) == 0);
+
+    //threads, every element shows up once and each thread's stay in order
+    c = sda_conc_new(sizeof(uint32_t), 16);
+    for (uint32_t t = 0; t < _TEST_THREADS; t++) {
+        args[t].c = c;
+        args[t].id = t;
+        assert(pthread_create(&threads[t], NULL, _test_writer, &args[t]) == 0);
+    }
+    for (int t = 0; t < _TEST_THREADS; t++) pthread_join(threads[t], NULL);
+    uint32_t *all = sda_conc_finish(c);
+    assert(sda_len(all) == _TEST_THREADS*_TEST_PER_THREAD);
+    for (size_t i = 0; i < sda_len(all); i++) {
+        uint32_t t = all[i] >> 24;
+        assert(t < _TEST_THREADS);
+        assert((all[i] & 0xffffff) == next[t]++);
+    }
+    for (int t = 0; t < _TEST_THREADS; t++) assert(next[t] == _TEST_PER_THREAD);
+    sda_free(all);
+
+    puts("done");
+    return 0;
+}
+#endif
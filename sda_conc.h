@@ -0,0 +1,104 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Array that many threads can append to at once.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifndef __SDA_CONC_H
+#define __SDA_CONC_H
+
+#include "sda.h"
+
+/* Appends reserve their slots with one atomic add on the length and then
+ * copy into them without any locks, so any number of threads can append at
+ * the same time.
+ *
+ * The elements live in segments that are never moved or freed until the
+ * array is: segment 0 holds init_cap elements and every segment after that
+ * doubles the total, so there's no reallocation for a reader or writer to
+ * trip over. Each segment is an sda array of len = its capacity.
+ *
+ * Once the writers are done (joined, or otherwise synchronized with),
+ * sda_conc_finish turns it into a normal sda array.
+ */
+
+//enough segments to address all of size_t
+#define SDA_CONC_SEGS (sizeof(size_t)*8)
+
+struct sda_conc {
+    /// Number of slots handed out, the only thing writers fight over
+    size_t len __attribute__((aligned(SDA_CACHE_LINE)));
+    /// Set if a segment couldn't be allocated
+    int failed;
+    /// Element size
+    size_t sz __attribute__((aligned(SDA_CACHE_LINE)));
+    /// log2 of the capacity of segment 0
+    unsigned seg0_bits;
+    /// Segments, allocated by whichever writer needs them first
+    char *segs[SDA_CONC_SEGS];
+};
+
+/**
+ * Create an empty concurrent array of sz byte elements.
+ * init_cap is rounded up to a power of 2. Returns NULL if out of memory.
+ */
+struct sda_conc *sda_conc_new(size_t sz, size_t init_cap);
+/** Free c and every segment */
+void sda_conc_free(struct sda_conc *c);
+
+/**
+ * Thread safe: add the n elements at x to the end of c. The n elements end up
+ * next to each other, but the appends of other threads can go before or after.
+ * Returns the index of the first one, or SDA_NPOS if out of memory.
+ */
+size_t sda_conc_append_n(struct sda_conc *c, const void *x, size_t n);
+/** Thread safe: add x to the end of c, returns its index */
+#define sda_conc_append(c, x) ({ \
+    __typeof__(x) tmp = (x); \
+    assert(sizeof(x) == (c)->sz); \
+    sda_conc_append_n((c), &tmp, 1); \
+    })
+
+/** Number of slots handed out so far, some might still be being written */
+static inline size_t sda_conc_len(const struct sda_conc *c) {
+    return __atomic_load_n(&c->len, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Pointer to element i of c, or NULL if i >= len. Only safe to read once the
+ * append that wrote it has returned (and been synchronized with).
+ */
+void *sda_conc_ptr_at(const struct sda_conc *c, size_t i);
+
+/**
+ * Copy everything into a new sda array with all of the elements in index
+ * order, then free c. Every append has to be finished.
+ * Returns NULL (c is still freed) if out of memory or an append failed.
+ */
+sda sda_conc_finish(struct sda_conc *c);
+
+#endif //__SDA_CONC_H
@@ -0,0 +1,760 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Saving and loading sda arrays.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include "sda_io.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SDA_HAVE_MMAP 1
+#include <sys/mman.h>
+#endif
+
+#if defined(SDA_IO_TEST_MAIN)
+#include <stdio.h>
+#endif
+
+/******* Helpers *******/
+
+/* Write all n bytes of buf to fd, retrying partial and interrupted writes */
+static int _sda_write_all(int fd, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* Read exactly n bytes from fd at off, hitting the end of the file is EINVAL */
+static int _sda_pread_all(int fd, void *buf, size_t n, off_t off) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = pread(fd, p, n, off);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        p += r;
+        off += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static inline uint32_t _sda_bswap32(uint32_t x) {
+    return __builtin_bswap32(x);
+}
+
+static inline uint64_t _sda_bswap64(uint64_t x) {
+    return __builtin_bswap64(x);
+}
+
+/* Byte swap len elements of sz bytes at p */
+static void _sda_bswap_elems(char *p, size_t len, size_t sz) {
+    for (size_t i = 0; i < len; i++, p += sz) {
+        switch (sz) {
+            case 2: {
+                uint16_t x;
+                memcpy(&x, p, 2);
+                x = __builtin_bswap16(x);
+                memcpy(p, &x, 2);
+                break;
+            }
+            case 4: {
+                uint32_t x;
+                memcpy(&x, p, 4);
+                x = _sda_bswap32(x);
+                memcpy(p, &x, 4);
+                break;
+            }
+            case 8: {
+                uint64_t x;
+                memcpy(&x, p, 8);
+                x = _sda_bswap64(x);
+                memcpy(p, &x, 8);
+                break;
+            }
+        }
+    }
+}
+
+/******* Mapped arrays *******/
+
+#if defined(SDA_HAVE_MMAP)
+/* Allocator of a loaded array. The block starts out inside the mapping and
+ * the first realloc moves it to the heap, after which it passes everything
+ * on to the default allocator. Copies of a shared array (sda_unshare) get
+ * their blocks from it too, it lives until the last of them is freed. */
+struct _sda_map {
+    struct sda_allocator a;
+    /// Start of the mapping, NULL once the array has left it
+    char *base;
+    size_t size;
+    /// Blocks handed out, the mapping counts as one
+    size_t blocks;
+};
+
+static inline int _sda_map_has(const struct _sda_map *m, const void *ptr) {
+    //copies on other threads look too, they're never in it
+    const char *base = __atomic_load_n(&m->base, __ATOMIC_RELAXED);
+    return base != NULL && (const char *)ptr >= base && (const char *)ptr < base + m->size;
+}
+
+static void *_sda_map_malloc(void *ctx, size_t size) {
+    struct _sda_map *m = ctx;
+    void *ptr = _sda_malloc(NULL, size);
+    if (ptr != NULL) __atomic_add_fetch(&m->blocks, 1, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+static void *_sda_map_realloc(void *ctx, void *ptr, size_t old_size, size_t size) {
+    struct _sda_map *m = ctx;
+    void *newptr;
+    if (!_sda_map_has(m, ptr)) return _sda_realloc(NULL, ptr, old_size, size);
+    //copy it out, the mapping can't grow
+    newptr = _sda_malloc(NULL, size);
+    if (newptr == NULL) return NULL;
+    memcpy(newptr, ptr, (old_size < size) ? old_size : size);
+    munmap(m->base, m->size);
+    __atomic_store_n(&m->base, NULL, __ATOMIC_RELAXED);
+    return newptr;
+}
+
+static void _sda_map_free(void *ctx, void *ptr, size_t size) {
+    struct _sda_map *m = ctx;
+    if (_sda_map_has(m, ptr)) munmap(m->base, m->size);
+    else _sda_free(NULL, ptr, size);
+    //the last array is gone, so is its allocator
+    if (__atomic_sub_fetch(&m->blocks, 1, __ATOMIC_ACQ_REL) == 0) _sda_free(NULL, m, sizeof(*m));
+}
+
+/* Element size from a file header */
+static inline size_t _sda_file_sz(const struct sda_file_hdr *fh) {
+    return fh->sz ? fh->sz : fh->wide_sz;
+}
+
+/* Map the file behind fd described by fh and build an array header in front
+ * of its elements */
+static sda _sda_load_map(int fd, const struct sda_file_hdr *fh, int mode) {
+    size_t map_sz = fh->data_off + fh->data_sz;
+    char htype = _sda_req_htype(fh->data_sz, fh->len, _sda_file_sz(fh));
+    size_t hdr_sz, page, ro_start;
+    struct _sda_map *m;
+    char *base, *s;
+    struct sda_ext *ext;
+
+    /* The smallest header that fits, not the one it was saved with. A
+     * bigger one would have to be slid down over the mapped elements by the
+     * first compact, before the block leaves the mapping. */
+    hdr_sz = _sda_hdr_size(htype);
+    m = _sda_malloc(NULL, sizeof(*m));
+    if (m == NULL) return NULL;
+    //private so that neither the header nor any writes end up in the file
+    base = mmap(NULL, map_sz, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        _sda_free(NULL, m, sizeof(*m));
+        return NULL;
+    }
+    m->a.malloc = _sda_map_malloc;
+    m->a.realloc = _sda_map_realloc;
+    m->a.free = _sda_map_free;
+    m->a.ctx = m;
+    m->base = base;
+    m->size = map_sz;
+    m->blocks = 1;
+
+    //the ext block and header go in the gap in front of the elements
+    s = base + fh->data_off;
+    ext = (struct sda_ext *)(s - hdr_sz - sizeof(struct sda_ext));
+    memset(ext, 0, sizeof(*ext) + hdr_sz);
+    _sda_set_flags(s, htype|SDA_FLAG_EXT);
+    _sda_set_len(s, fh->len);
+    _sda_set_alloc(s, fh->data_sz);
+    _sda_set_sz(s, _sda_file_sz(fh));
+    ext->allocator = &m->a;
+
+    if (mode == SDA_LOAD_RDONLY) {
+        //the page with the header has to stay writable
+        page = (size_t)sysconf(_SC_PAGESIZE);
+        ro_start = (fh->data_off + page-1) & ~(page-1);
+        if (ro_start < map_sz) mprotect(base + ro_start, map_sz - ro_start, PROT_READ);
+    }
+    return s;
+}
+#endif //SDA_HAVE_MMAP
+
+/******* Save/load *******/
+
+int sda_save(const sda s, const char *path) {
+    struct sda_hdr_uni shadow;
+    struct sda_file_hdr fh;
+    int fd, err;
+
+    sda_hdr(s, &shadow);
+    memset(&fh, 0, sizeof(fh));
+    memcpy(fh.magic, SDA_FILE_MAGIC, sizeof(SDA_FILE_MAGIC));
+    fh.version = SDA_FILE_VERSION;
+    fh.endian = SDA_FILE_ENDIAN;
+    fh.htype = shadow.flags&SDA_HTYPE_MASK;
+    //files without wide_sz still read the same
+    if (shadow.sz <= UINT8_MAX) fh.sz = shadow.sz;
+    else fh.wide_sz = shadow.sz;
+    fh.len = shadow.len;
+    fh.data_off = SDA_FILE_ALIGN;
+    fh.data_sz = shadow.len*shadow.sz;
+
+    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (_sda_write_all(fd, &fh, sizeof(fh)) < 0) goto fail;
+    //leaves a hole up to data_off
+    if (lseek(fd, fh.data_off, SEEK_SET) < 0) goto fail;
+    //blocking, so it only comes back short on an error
+    if (sda_writev_fd(fd, &s, 1, 0) < (ssize_t)fh.data_sz) goto fail;
+    //in case there was nothing to write after the hole
+    if (ftruncate(fd, fh.data_off + fh.data_sz) < 0) goto fail;
+    if (close(fd) < 0) return -1;
+    return 0;
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+sda sda_load(const char *path, int mode) {
+    struct sda_file_hdr fh;
+    struct stat st;
+    int fd, err, swapped = 0;
+    char *s = NULL;
+    size_t sz;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0) goto fail;
+    if (_sda_pread_all(fd, &fh, sizeof(fh), 0) < 0) goto fail;
+    errno = EINVAL;
+    if (memcmp(fh.magic, SDA_FILE_MAGIC, sizeof(SDA_FILE_MAGIC)) != 0) goto fail;
+    if (fh.endian != SDA_FILE_ENDIAN) {
+        if (fh.endian != _sda_bswap32(SDA_FILE_ENDIAN)) goto fail;
+        swapped = 1;
+        fh.version = _sda_bswap32(fh.version);
+        fh.len = _sda_bswap64(fh.len);
+        fh.data_off = _sda_bswap64(fh.data_off);
+        fh.data_sz = _sda_bswap64(fh.data_sz);
+        fh.wide_sz = _sda_bswap32(fh.wide_sz);
+    }
+    if (fh.version != SDA_FILE_VERSION) goto fail;
+    sz = _sda_file_sz(&fh);
+    //the gap in front of the elements has to fit the file header and an array header
+    if (sz == 0 || (fh.sz && fh.wide_sz) || fh.data_off%8 != 0) goto fail;
+    if (fh.data_off < sizeof(fh) + sizeof(struct sda_ext) + sizeof(SDA_HDR_TYPE(LG))) goto fail;
+    if (fh.len > SIZE_MAX/sz || fh.data_sz != fh.len*sz) goto fail;
+    if (fh.data_off + fh.data_sz < fh.data_off || fh.data_off + fh.data_sz > (uint64_t)st.st_size) goto fail;
+    if (swapped && sz != 2 && sz != 4 && sz != 8 && fh.len) {
+        errno = EILSEQ;
+        goto fail;
+    }
+
+#if defined(SDA_HAVE_MMAP)
+    if (mode != SDA_LOAD_COPY && !swapped) {
+        s = _sda_load_map(fd, &fh, mode);
+        if (s == NULL) goto fail;
+        //the mapping holds its own reference to the file
+        close(fd);
+        return s;
+    }
+#endif
+    s = _sda_new_sz(NULL, fh.data_sz, sz);
+    if (s == NULL) goto fail;
+    if (_sda_pread_all(fd, s, fh.data_sz, fh.data_off) < 0) goto fail;
+    if (swapped) _sda_bswap_elems(s, fh.len, sz);
+    close(fd);
+    return s;
+fail:
+    err = errno;
+    if (s != NULL) sda_free(s);
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+int sda_is_mapped(const sda s) {
+#if defined(SDA_HAVE_MMAP)
+    const struct sda_allocator *a = _sda_allocator(s);
+    return a != NULL && a->realloc == _sda_map_realloc && _sda_map_has(a->ctx, sda_total_ptr(s));
+#else
+    (void)s;
+    return 0;
+#endif
+}
+
+/******* Streaming *******/
+
+//stack space sda_read_fd reads into past the free space of the array
+#define _SDA_READ_SPILL (16*1024)
+//iovecs per writev call
+#define _SDA_IOV_BATCH 64
+
+/* Fills run with the pieces of memory holding the elements of s in order,
+ * returns how many there are (a wrapped deque has 2) */
+static int _sda_runs(const sda s, struct iovec run[2]) {
+    struct sda_hdr_uni shadow;
+    size_t first;
+    sda_hdr(s, &shadow);
+    run[0].iov_base = s;
+    run[0].iov_len = shadow.len*shadow.sz;
+    if (!(shadow.flags&SDA_FLAG_DEQUE) || shadow.len == 0) return 1;
+    run[0].iov_base = sda_deque_ptr_at(s, 0);
+    first = shadow.alloc/shadow.sz - _sda_ext(s)->head;
+    if (first >= shadow.len) return 1;
+    run[0].iov_len = first*shadow.sz;
+    run[1].iov_base = s;
+    run[1].iov_len = (shadow.len-first)*shadow.sz;
+    return 2;
+}
+
+/* Move the position (*i, *off) in the elements of v forward by bytes,
+ * stepping over anything empty */
+static void _sda_advance(const sda *v, size_t n, size_t *i, size_t *off, size_t bytes) {
+    size_t left;
+    while (*i < n) {
+        left = sda_size(v[*i]) - *off;
+        if (bytes < left) {
+            *off += bytes;
+            return;
+        }
+        bytes -= left;
+        (*i)++;
+        *off = 0;
+    }
+}
+
+sda sda_read_fd(sda s, int fd, size_t max, ssize_t *nread) {
+    char spill[_SDA_READ_SPILL];
+    struct iovec iov[2];
+    size_t avail;
+    ssize_t r;
+
+    assert(sda_sz(s) == 1);
+    //nothing to ask the fd for
+    if (max == 0) {
+        *nread = 0;
+        return s;
+    }
+    //writing straight into the buffer, nobody else can be looking at it
+    s = sda_unshare(s);
+    if (s == NULL) goto nomem;
+    //free space has to be in one piece after the last element
+    if (sda_flags(s)&SDA_FLAG_DEQUE) sda_deque_linearize(s);
+    if (sda_avail(s) == 0) {
+        s = sda_prealloc(s, (max < _SDA_READ_SPILL) ? max : _SDA_READ_SPILL);
+        if (s == NULL) goto nomem;
+    }
+    avail = sda_avail(s);
+    if (avail > max) avail = max;
+    //whatever doesn't fit lands in spill, one call finds out how much is there
+    iov[0].iov_base = sda_end_ptr(s);
+    iov[0].iov_len = avail;
+    iov[1].iov_base = spill;
+    iov[1].iov_len = (max-avail < sizeof(spill)) ? max-avail : sizeof(spill);
+    do {
+        r = readv(fd, iov, 2);
+    } while (r < 0 && errno == EINTR);
+    *nread = r;
+    if (r <= 0) return s;
+    if ((size_t)r <= avail) {
+        sda_commit(s, r);
+        return s;
+    }
+    sda_commit(s, avail);
+    s = sda_cat(s, spill, r-avail);
+    if (s == NULL) goto nomem;
+    return s;
+nomem:
+    *nread = -1;
+    errno = ENOMEM;
+    return NULL;
+}
+
+ssize_t sda_writev_fd(int fd, const sda *v, size_t n, size_t skip) {
+    struct iovec iov[_SDA_IOV_BATCH], run[2];
+    size_t i = 0, off = 0, o, done = 0;
+    int cnt, runs;
+    ssize_t w;
+
+    _sda_advance(v, n, &i, &off, skip);
+    while (i < n) {
+        //gather from the current position, leaving room for a split deque
+        cnt = 0;
+        o = off;
+        for (size_t j = i; j < n && cnt < _SDA_IOV_BATCH-1 && cnt < IOV_MAX-1; j++, o = 0) {
+            runs = _sda_runs(v[j], run);
+            for (int k = 0; k < runs; k++) {
+                if (o >= run[k].iov_len) {
+                    o -= run[k].iov_len;
+                    continue;
+                }
+                iov[cnt].iov_base = (char *)run[k].iov_base + o;
+                iov[cnt].iov_len = run[k].iov_len - o;
+                o = 0;
+                cnt++;
+            }
+        }
+        w = writev(fd, iov, cnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            //non-blocking fd that's full, report what got out so far
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && done > 0) break;
+            return -1;
+        }
+        done += w;
+        _sda_advance(v, n, &i, &off, w);
+    }
+    return done;
+}
+
+#if defined(SDA_IO_TEST_MAIN)
+
+//an allocator that can't grow anything
+static void *_test_nogrow_malloc(void *ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+static void *_test_nogrow_realloc(void *ctx, void *ptr, size_t old_size, size_t size) {
+    (void)ctx; (void)ptr; (void)old_size; (void)size;
+    return NULL;
+}
+static void _test_nogrow_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx; (void)size;
+    free(ptr);
+}
+
+/* Save s to a new temporary file, path gets its name */
+static void _test_save(sda s, char *path) {
+    int fd;
+    strcpy(path, "/tmp/sda_io_testXXXXXX");
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    assert(sda_save(s, path) == 0);
+}
+
+int main(void) {
+    char path[32];
+    uint32_t *a, *b;
+    uint16_t *d;
+    uint64_t *big;
+    struct sda_file_hdr fh;
+    struct stat st;
+    int fd;
+
+    a = sda_new_sz(a, NULL, 1000*sizeof(*a));
+    for (uint32_t i = 0; i < 1000; i++) a[i] = i*7;
+    _test_save(a, path);
+    assert(stat(path, &st) == 0);
+    assert((size_t)st.st_size == SDA_FILE_ALIGN + 1000*sizeof(*a));
+
+    //all three modes give back the same elements
+    for (int mode = SDA_LOAD_RDONLY; mode <= SDA_LOAD_COPY; mode++) {
+        b = sda_load(path, mode);
+        assert(b != NULL);
+        assert(sda_len(b) == 1000 && sda_sz(b) == sizeof(*b));
+        assert(memcmp(a, b, 1000*sizeof(*a)) == 0);
+        assert(sda_is_mapped(b) == (mode != SDA_LOAD_COPY));
+        assert(((uintptr_t)b)%8 == 0);
+        sda_free(b);
+    }
+
+    //writes to a cow mapping stay out of the file
+    b = sda_load(path, SDA_LOAD_COW);
+    b[0] = 12345;
+    b[999] = 54321;
+    sda_free(b);
+    b = sda_load(path, SDA_LOAD_COPY);
+    assert(b[0] == 0 && b[999] == 999*7);
+    sda_free(b);
+
+    //growing moves it to the heap and unmaps the file
+    b = sda_load(path, SDA_LOAD_RDONLY);
+    b = sda_append(b, (uint32_t)42);
+    assert(b != NULL);
+    assert(!sda_is_mapped(b));
+    assert(sda_len(b) == 1001 && b[1000] == 42);
+    assert(memcmp(a, b, 1000*sizeof(*a)) == 0);
+    b[0] = 1;
+    b = sda_compact(b);
+    assert(b != NULL && b[0] == 1 && b[999] == 999*7);
+    sda_free(b);
+
+    //copies of a shared mapped array outlive the mapping
+    b = sda_load(path, SDA_LOAD_RDONLY);
+    uint32_t *c = sda_share(b);
+    c = sda_set(c, 0, (uint32_t)5);
+    assert(c != b && sda_is_mapped(b) && !sda_is_mapped(c));
+    b = sda_free(b);
+    assert(c[0] == 5 && c[999] == 999*7);
+    c = sda_append(c, (uint32_t)6);
+    assert(c != NULL && sda_len(c) == 1001);
+    sda_free(c);
+    sda_free(a);
+    unlink(path);
+
+    //empty arrays
+    a = sda_new_sz(a, NULL, 0);
+    _test_save(a, path);
+    for (int mode = SDA_LOAD_RDONLY; mode <= SDA_LOAD_COPY; mode++) {
+        b = sda_load(path, mode);
+        assert(b != NULL && sda_len(b) == 0 && sda_sz(b) == sizeof(*b));
+        b = sda_append(b, (uint32_t)7);
+        assert(b != NULL && sda_len(b) == 1 && b[0] == 7);
+        sda_free(b);
+    }
+    sda_free(a);
+    unlink(path);
+
+    //a wrapped deque is saved in order
+    d = sda_deque_empty(d);
+    for (uint16_t i = 0; i < 10; i++) d = sda_deque_push_back(d, i);
+    for (uint16_t i = 0; i < 5; i++) assert(sda_deque_pop_front(d) == i);
+    for (uint16_t i = 10; i < 20; i++) d = sda_deque_push_back(d, i);
+    d = sda_deque_push_front(d, (uint16_t)4);
+    _test_save(d, path);
+    sda_free(d);
+    d = sda_load(path, SDA_LOAD_COW);
+    assert(sda_len(d) == 16);
+    for (uint16_t i = 0; i < 16; i++) assert(d[i] == i+4);
+    sda_free(d);
+    unlink(path);
+
+    //big enough that the loaded array needs a MD header
+    big = sda_new_sz(big, NULL, 70000*sizeof(*big));
+    for (uint64_t i = 0; i < 70000; i++) big[i] = i*i;
+    _test_save(big, path);
+    sda_free(big);
+    big = sda_load(path, SDA_LOAD_RDONLY);
+    assert(sda_len(big) == 70000 && big[69999] == 69999ull*69999ull);
+    big = sda_append(big, (uint64_t)1);
+    assert(big != NULL && sda_len(big) == 70001 && big[69999] == 69999ull*69999ull);
+    sda_free(big);
+
+    //the other byte order gets swapped on the way in
+    fd = open(path, O_RDWR);
+    assert(_sda_pread_all(fd, &fh, sizeof(fh), 0) == 0);
+    fh.endian = _sda_bswap32(fh.endian);
+    fh.version = _sda_bswap32(fh.version);
+    fh.len = _sda_bswap64(fh.len);
+    fh.data_off = _sda_bswap64(fh.data_off);
+    fh.data_sz = _sda_bswap64(fh.data_sz);
+    assert(pwrite(fd, &fh, sizeof(fh), 0) == sizeof(fh));
+    close(fd);
+    big = sda_load(path, SDA_LOAD_RDONLY);
+    assert(big != NULL && !sda_is_mapped(big));
+    assert(sda_len(big) == 70000 && big[3] == _sda_bswap64(9));
+    sda_free(big);
+
+    //broken files
+    fd = open(path, O_RDWR);
+    fh.magic[0] = 'X';
+    assert(pwrite(fd, &fh, sizeof(fh), 0) == sizeof(fh));
+    errno = 0;
+    assert(sda_load(path, SDA_LOAD_COPY) == NULL && errno == EINVAL);
+    //cut short
+    assert(ftruncate(fd, 100) == 0);
+    errno = 0;
+    assert(sda_load(path, SDA_LOAD_RDONLY) == NULL && errno == EINVAL);
+    close(fd);
+    unlink(path);
+    assert(sda_load(path, SDA_LOAD_COPY) == NULL && errno == ENOENT);
+
+    //elements too big for the old uint8_t sz
+    struct _test_rec { uint32_t id; char name[296]; } *recs, *recs2;
+    recs = sda_new_sz(recs, NULL, 10*sizeof(*recs));
+    for (uint32_t i = 0; i < 10; i++) {
+        recs[i].id = i;
+        snprintf(recs[i].name, sizeof(recs[i].name), "rec%u", i);
+    }
+    _test_save(recs, path);
+    fd = open(path, O_RDONLY);
+    assert(_sda_pread_all(fd, &fh, sizeof(fh), 0) == 0);
+    assert(fh.sz == 0 && fh.wide_sz == sizeof(*recs));
+    close(fd);
+    for (int mode = SDA_LOAD_RDONLY; mode <= SDA_LOAD_COPY; mode++) {
+        recs2 = sda_load(path, mode);
+        assert(recs2 != NULL && sda_sz(recs2) == sizeof(*recs) && sda_len(recs2) == 10);
+        assert(memcmp(recs, recs2, 10*sizeof(*recs)) == 0);
+        sda_free(recs2);
+    }
+    sda_free(recs);
+    unlink(path);
+
+    //saved with room to spare in a MD header, loads with the SM one its len needs
+    d = sda_new_sz(d, NULL, 0);
+    d = sda_reserve(d, 70000);
+    for (uint16_t i = 0; i < 100; i++) d = sda_append(d, i);
+    assert((sda_flags(d)&SDA_HTYPE_MASK) == _sda_req_htype(0, 70000, sizeof(*d)));
+    _test_save(d, path);
+    sda_free(d);
+    for (int mode = SDA_LOAD_RDONLY; mode <= SDA_LOAD_COPY; mode++) {
+        d = sda_load(path, mode);
+        assert(d != NULL && (sda_flags(d)&SDA_HTYPE_MASK) == _sda_req_htype(0, 100, sizeof(*d)));
+        //compact moves it off the read only pages before touching the buffer
+        d = sda_compact(d);
+        assert(d != NULL && sda_len(d) == 100 && d[99] == 99 && !sda_is_mapped(d));
+        sda_free(d);
+    }
+    unlink(path);
+
+    //elements only a LG header can describe
+    struct _test_huge { char b[70000]; } *hg, *hg2;
+    hg = sda_new_sz(hg, NULL, 3*sizeof(*hg));
+    for (int i = 0; i < 3; i++) hg[i].b[69999] = i+1;
+    _test_save(hg, path);
+    for (int mode = SDA_LOAD_RDONLY; mode <= SDA_LOAD_COPY; mode++) {
+        hg2 = sda_load(path, mode);
+        assert(hg2 != NULL && (sda_flags(hg2)&SDA_HTYPE_MASK) == SDA_HTYPE_LG);
+        assert(sda_len(hg2) == 3 && sda_is_mapped(hg2) == (mode != SDA_LOAD_COPY));
+        assert(memcmp(hg, hg2, 3*sizeof(*hg)) == 0);
+        hg2 = sda_cpy(hg2, 3, &hg[0], sizeof(*hg));
+        assert(hg2 != NULL && sda_len(hg2) == 4 && hg2[3].b[69999] == 1 && hg2[2].b[69999] == 3);
+        sda_free(hg2);
+    }
+    sda_free(hg);
+    unlink(path);
+
+    //reading from a pipe, first into free space then past it
+    char *buf;
+    uint8_t *parts[3];
+    char msg[40000];
+    int p[2];
+    ssize_t n;
+    for (size_t i = 0; i < sizeof(msg); i++) msg[i] = 'a' + i%26;
+    assert(pipe(p) == 0);
+    buf = sda_new_sz(buf, NULL, 0);
+    buf = sda_reserve(buf, 100);
+    assert(write(p[1], msg, 10) == 10);
+    buf = sda_read_fd(buf, p[0], 1000, &n);
+    assert(n == 10 && sda_len(buf) == 10 && memcmp(buf, msg, 10) == 0);
+    //max is respected
+    assert(write(p[1], msg+10, 3000) == 3000);
+    buf = sda_read_fd(buf, p[0], 5, &n);
+    assert(n == 5 && sda_len(buf) == 15);
+    //more than the free space, the rest spills over
+    assert(sda_avail(buf) < 2995);
+    buf = sda_read_fd(buf, p[0], SIZE_MAX, &n);
+    assert(n == 2995 && sda_len(buf) == 3010 && memcmp(buf, msg, 3010) == 0);
+    //nothing there on a non-blocking pipe
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    buf = sda_read_fd(buf, p[0], 100, &n);
+    assert(n == -1 && errno == EAGAIN && sda_len(buf) == 3010);
+    close(p[1]);
+    buf = sda_read_fd(buf, p[0], 100, &n);
+    assert(n == 0 && sda_len(buf) == 3010);
+    close(p[0]);
+    sda_free(buf);
+
+    //asking for nothing doesn't read, growing that fails reports ENOMEM
+    const struct sda_allocator nogrow = {_test_nogrow_malloc, _test_nogrow_realloc, _test_nogrow_free, NULL};
+    assert(pipe(p) == 0);
+    assert(write(p[1], msg, 10) == 10);
+    buf = sda_new_sz_with(buf, NULL, 0, &nogrow);
+    n = 123;
+    buf = sda_read_fd(buf, p[0], 0, &n);
+    assert(buf != NULL && n == 0 && sda_len(buf) == 0);
+    n = 123;
+    errno = 0;
+    assert(sda_read_fd(buf, p[0], 100, &n) == NULL);
+    assert(n == -1 && errno == ENOMEM);
+    //the 10 bytes are still in the pipe
+    buf = sda_new_sz(buf, NULL, 0);
+    buf = sda_read_fd(buf, p[0], 100, &n);
+    assert(n == 10 && memcmp(buf, msg, 10) == 0);
+    sda_free(buf);
+    close(p[0]);
+    close(p[1]);
+
+    //several arrays in one go, with a wrapped deque and an empty one
+    assert(pipe(p) == 0);
+    parts[0] = sda_new_sz(parts[0], msg, 100);
+    parts[1] = sda_new_sz(parts[1], NULL, 0);
+    parts[2] = sda_deque_empty(parts[2]);
+    for (int i = 0; i < 50; i++) parts[2] = sda_deque_push_back(parts[2], (uint8_t)msg[100+i]);
+    for (int i = 0; i < 20; i++) sda_deque_pop_front(parts[2]);
+    for (int i = 0; i < 20; i++) parts[2] = sda_deque_push_front(parts[2], (uint8_t)msg[119-i]);
+    assert(sda_writev_fd(p[1], (sda *)parts, 3, 0) == 150);
+    //picking up part way through
+    assert(sda_writev_fd(p[1], (sda *)parts, 3, 140) == 10);
+    buf = sda_new_sz(buf, NULL, 0);
+    buf = sda_read_fd(buf, p[0], 1000, &n);
+    assert(n == 160 && memcmp(buf, msg, 150) == 0 && memcmp(buf+150, msg+140, 10) == 0);
+    sda_free(buf);
+
+    //a full non-blocking pipe cuts it short, then it carries on from there
+    for (int i = 0; i < 3; i++) sda_free(parts[i]);
+    for (int i = 0; i < 3; i++) parts[i] = sda_new_sz(parts[i], msg, sizeof(msg));
+    fcntl(p[1], F_SETFL, O_NONBLOCK);
+    buf = sda_new_sz(buf, NULL, 0);
+    size_t sent = 0;
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    while (sent < 3*sizeof(msg)) {
+        n = sda_writev_fd(p[1], (sda *)parts, 3, sent);
+        if (n < 0) assert(errno == EAGAIN);
+        else sent += n;
+        buf = sda_read_fd(buf, p[0], SIZE_MAX, &n);
+    }
+    close(p[1]);
+    do {
+        buf = sda_read_fd(buf, p[0], SIZE_MAX, &n);
+    } while (n != 0);
+    assert(sda_len(buf) == 3*sizeof(msg));
+    for (int i = 0; i < 3; i++) assert(memcmp(buf+i*sizeof(msg), msg, sizeof(msg)) == 0);
+    close(p[0]);
+    sda_free(buf);
+    for (int i = 0; i < 3; i++) sda_free(parts[i]);
+
+    puts("done");
+    return 0;
+}
+#endif
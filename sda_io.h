@@ -0,0 +1,141 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Saving and loading sda arrays.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifndef __SDA_IO_H
+#define __SDA_IO_H
+
+#include <sys/types.h>
+#include "sda.h"
+
+/* File format (version 1), all fields in the byte order of the machine that
+ * wrote it:
+ *
+ *   struct sda_file_hdr   64 bytes at offset 0
+ *   zeros                 up to data_off
+ *   elements              len*sz bytes at data_off
+ *
+ * data_off is a multiple of SDA_FILE_ALIGN so the elements can be mapped
+ * straight into memory, the gap in front of them is where sda_load puts the
+ * array's header.
+ */
+
+#define SDA_FILE_MAGIC "SDAFILE"
+#define SDA_FILE_VERSION 1
+//written as a native uint32, reads back as 0x04030201 on the other endianness
+#define SDA_FILE_ENDIAN 0x01020304
+//data_off alignment, covers 4K and 16K pages
+#define SDA_FILE_ALIGN (16*1024)
+
+struct sda_file_hdr {
+    /// SDA_FILE_MAGIC with the trailing 0
+    char magic[8];
+    /// SDA_FILE_VERSION
+    uint32_t version;
+    /// SDA_FILE_ENDIAN
+    uint32_t endian;
+    /// SDA_HTYPE_* the array had when it was saved
+    uint8_t htype;
+    /// Element size, 0 if it's over UINT8_MAX
+    uint8_t sz;
+    uint8_t _pad[2];
+    /// Element size if it's over UINT8_MAX, 0 otherwise
+    uint32_t wide_sz;
+    /// Number of elements
+    uint64_t len;
+    /// Offset of the elements in the file
+    uint64_t data_off;
+    /// Bytes of elements, len*sz
+    uint64_t data_sz;
+    uint8_t _reserved[16];
+};
+
+//sda_load modes
+/// Map the file, writing to the elements faults (growing is still fine)
+#define SDA_LOAD_RDONLY 0
+/// Map the file, written pages get private copies and the file isn't changed
+#define SDA_LOAD_COW 1
+/// Read the file into a normal heap array
+#define SDA_LOAD_COPY 2
+
+/**
+ * Write the elements of s to the file at path, replacing it.
+ * Returns 0, or -1 with errno set.
+ */
+int sda_save(const sda s, const char *path);
+
+/**
+ * Load an array saved with sda_save.
+ *
+ * The mapped modes don't read anything up front, the array points straight
+ * into a private mapping of the file and pages come in as they're touched.
+ * Anything that reallocates the array (growing, sda_compact) moves it into
+ * a normal heap array first, and sda_free unmaps it. The file can't be
+ * truncated while mapped.
+ *
+ * Files written on a machine with the other byte order are copied and have
+ * 2, 4 and 8 byte elements swapped, other element sizes fail with EILSEQ.
+ * Files that aren't valid fail with EINVAL.
+ *
+ * @param mode: SDA_LOAD_RDONLY, SDA_LOAD_COW or SDA_LOAD_COPY.
+ * @return: The array, or NULL with errno set.
+ */
+sda sda_load(const char *path, int mode);
+
+/** Returns 1 if s points into a file mapping from sda_load */
+int sda_is_mapped(const sda s);
+
+/**
+ * Read up to max bytes from fd straight onto the end of s, one read like
+ * read(2) but retried on EINTR. Whatever fits in the free space (sda_avail)
+ * goes there without a copy, anything past that is appended afterwards and
+ * the array grows. s must have 1 byte elements.
+ *
+ * @param max: 0 doesn't touch fd and sets nread to 0, so a 0 is only end
+ *             of file when max was more.
+ * @param nread: Set to the bytes read, 0 at end of file or -1 with errno
+ *               set (EAGAIN when a non-blocking fd has nothing to read,
+ *               ENOMEM when s couldn't grow).
+ * @return: The new pointer to s, NULL if growing it failed.
+ */
+sda sda_read_fd(sda s, int fd, size_t max, ssize_t *nread);
+
+/**
+ * Write the elements of the n arrays in v to fd in order, as few writev
+ * calls as possible. Blocking fds get everything written. A non-blocking
+ * fd that fills up makes it return early, call it again with skip set to
+ * the bytes written so far to carry on. Retries on EINTR.
+ *
+ * @param skip: Bytes at the start of v that have already been written.
+ * @return: Bytes written by this call, or -1 with errno set (EAGAIN if
+ *          nothing could be written).
+ */
+ssize_t sda_writev_fd(int fd, const sda *v, size_t n, size_t skip);
+
+#endif //__SDA_IO_H
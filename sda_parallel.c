@@ -0,0 +1,527 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Parallel for/map/reduce over sda arrays.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "sda_parallel.h"
+
+#if defined(SDA_PARALLEL_TEST_MAIN)
+#include <stdio.h>
+#endif
+
+//aim for this many chunks per thread so there's something left to steal
+#define _SDA_CHUNKS_PER_THREAD 8
+//smallest chunk worth handing out, in bytes
+#define _SDA_CHUNK_MIN (16*1024)
+
+/******* Jobs *******/
+
+/* Chunk indexes [lo, hi) a thread has left, packed as hi<<32 | lo so the
+ * owner and thieves can both update it with one compare and swap */
+struct _sda_range {
+    uint64_t v;
+} __attribute__((aligned(SDA_CACHE_LINE)));
+
+struct _sda_job {
+    /// Runs elements [i, i+n) of chunk c
+    void (*run)(struct _sda_job *job, size_t c, size_t i, size_t n);
+    char *in;
+    char *out;
+    size_t in_sz;
+    size_t out_sz;
+    sda_for_fn for_fn;
+    sda_map_fn map_fn;
+    sda_fold_fn fold;
+    void *ctx;
+    /// One accumulator per chunk for reduce, acc_stride bytes apart
+    char *accs;
+    size_t acc_stride;
+    /// Elements in the array
+    size_t len;
+    /// Elements in a chunk, chunk 0 is shift elements shorter
+    size_t chunk;
+    size_t shift;
+    size_t nchunks;
+};
+
+static void _sda_run_for(struct _sda_job *job, size_t c, size_t i, size_t n) {
+    (void)c;
+    job->for_fn(job->out + i*job->out_sz, i, n, job->ctx);
+}
+
+static void _sda_run_map(struct _sda_job *job, size_t c, size_t i, size_t n) {
+    (void)c;
+    job->map_fn(job->in + i*job->in_sz, job->out + i*job->out_sz, n, job->ctx);
+}
+
+static void _sda_run_fold(struct _sda_job *job, size_t c, size_t i, size_t n) {
+    job->fold(job->in + i*job->in_sz, n, job->accs + c*job->acc_stride, job->ctx);
+}
+
+static inline size_t _sda_gcd(size_t a, size_t b) {
+    while (b) {
+        size_t t = a%b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Cut the job into chunks for nthreads threads. Chunks are a whole number
+ * of cache lines of the output, and shifted so that their boundaries land on
+ * cache lines of it when the element size lets them. */
+static void _sda_job_chunks(struct _sda_job *job, size_t nthreads) {
+    size_t sz = job->out_sz;
+    size_t line_elems = SDA_CACHE_LINE/_sda_gcd(sz, SDA_CACHE_LINE);
+    size_t to_line = (SDA_CACHE_LINE - (uintptr_t)job->out%SDA_CACHE_LINE) % SDA_CACHE_LINE;
+    size_t chunk;
+    if (nthreads == 1 || job->len*sz < SDA_PARALLEL_MIN) {
+        job->chunk = job->len ? job->len : 1;
+        job->shift = 0;
+        job->nchunks = 1;
+        return;
+    }
+    chunk = job->len/(nthreads*_SDA_CHUNKS_PER_THREAD);
+    if (chunk < _SDA_CHUNK_MIN/sz) chunk = _SDA_CHUNK_MIN/sz;
+    //elements over _SDA_CHUNK_MIN bytes on a short array
+    if (chunk == 0) chunk = 1;
+    chunk += (line_elems - chunk%line_elems) % line_elems;
+    job->chunk = chunk;
+    //first chunk ends on the first line boundary, if elements line up with one
+    job->shift = (to_line && to_line%sz == 0) ? chunk - to_line/sz : 0;
+    job->nchunks = (job->len + job->shift + chunk-1)/chunk;
+}
+
+/* Run chunk c of job */
+static inline void _sda_job_chunk(struct _sda_job *job, size_t c) {
+    size_t start = c ? c*job->chunk - job->shift : 0;
+    size_t end = (c+1)*job->chunk - job->shift;
+    if (end > job->len) end = job->len;
+    job->run(job, c, start, end-start);
+}
+
+/******* Pool *******/
+
+static struct {
+    /// Held for the whole of a job, so callers take turns
+    pthread_mutex_t lock;
+    /// Protects everything below
+    pthread_mutex_t wake_lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    /// Threads including the caller, 0 until started
+    size_t nthreads;
+    /// Threads asked for with sda_parallel_set_threads, 0 for the cpu count
+    size_t want;
+    pthread_t *threads;
+    /// Number of threads that fit in threads
+    size_t max_threads;
+    /// Workers still on the current job
+    size_t busy;
+    /// Bumped for every job
+    unsigned gen;
+    int quit;
+    struct _sda_job *job;
+    /// Chunks left for each thread, an sda aligned to a cache line
+    struct _sda_range *ranges;
+} _sda_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake_lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static inline uint64_t _sda_range_pack(size_t lo, size_t hi) {
+    return ((uint64_t)hi << 32) | (uint64_t)lo;
+}
+
+/* Take the next chunk from the front of thread id's range */
+static int _sda_pool_take(size_t id, size_t *c) {
+    uint64_t *r = &_sda_pool.ranges[id].v;
+    uint64_t v = __atomic_load_n(r, __ATOMIC_ACQUIRE);
+    for (;;) {
+        size_t lo = (uint32_t)v, hi = v >> 32;
+        if (lo >= hi) return 0;
+        if (__atomic_compare_exchange_n(r, &v, _sda_range_pack(lo+1, hi), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *c = lo;
+            return 1;
+        }
+    }
+}
+
+/* Steal the back half of another thread's range into thread id's, which
+ * has to be empty. Chunks are never handed out twice in a job, so a stale
+ * range can't come back and fool the compare and swap. */
+static int _sda_pool_steal(size_t id) {
+    size_t n = _sda_pool.nthreads;
+    for (size_t k = 1; k < n; k++) {
+        uint64_t *r = &_sda_pool.ranges[(id+k)%n].v;
+        uint64_t v = __atomic_load_n(r, __ATOMIC_ACQUIRE);
+        for (;;) {
+            size_t lo = (uint32_t)v, hi = v >> 32;
+            size_t take = (hi > lo) ? (hi-lo+1)/2 : 0;
+            if (take == 0) break;
+            if (__atomic_compare_exchange_n(r, &v, _sda_range_pack(lo, hi-take), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&_sda_pool.ranges[id].v, _sda_range_pack(hi-take, hi), __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Work on job as thread id until there's nothing left anywhere */
+static void _sda_pool_work(struct _sda_job *job, size_t id) {
+    size_t c;
+    for (;;) {
+        while (_sda_pool_take(id, &c)) _sda_job_chunk(job, c);
+        if (!_sda_pool_steal(id)) return;
+    }
+}
+
+static void *_sda_pool_worker(void *arg) {
+    size_t id = (uintptr_t)arg;
+    unsigned seen = 0;
+    struct _sda_job *job;
+    for (;;) {
+        pthread_mutex_lock(&_sda_pool.wake_lock);
+        while (_sda_pool.gen == seen && !_sda_pool.quit) {
+            pthread_cond_wait(&_sda_pool.wake, &_sda_pool.wake_lock);
+        }
+        if (_sda_pool.quit) {
+            pthread_mutex_unlock(&_sda_pool.wake_lock);
+            return NULL;
+        }
+        seen = _sda_pool.gen;
+        job = _sda_pool.job;
+        pthread_mutex_unlock(&_sda_pool.wake_lock);
+
+        _sda_pool_work(job, id);
+
+        pthread_mutex_lock(&_sda_pool.wake_lock);
+        if (--_sda_pool.busy == 0) pthread_cond_signal(&_sda_pool.done);
+        pthread_mutex_unlock(&_sda_pool.wake_lock);
+    }
+}
+
+/* Start the workers, called with lock held. Falls back to fewer threads
+ * (down to just the caller) if they can't be made. */
+static void _sda_pool_start(void) {
+    size_t n = _sda_pool.want;
+    size_t started = 0;
+    if (n == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = (cpus > 0) ? (size_t)cpus : 1;
+    }
+    _sda_pool.gen = 0;
+    _sda_pool.quit = 0;
+    _sda_pool.ranges = _sda_new_ext(NULL, n*sizeof(struct _sda_range), 1, SDA_CACHE_LINE, NULL);
+    _sda_pool.threads = _sda_malloc(NULL, n*sizeof(pthread_t));
+    _sda_pool.max_threads = n;
+    if (_sda_pool.ranges == NULL || _sda_pool.threads == NULL) n = 1;
+    //thread 0 is whoever called
+    for (; started+1 < n; started++) {
+        if (pthread_create(&_sda_pool.threads[started], NULL, _sda_pool_worker, (void *)(uintptr_t)(started+1)) != 0) break;
+    }
+    _sda_pool.nthreads = started+1;
+}
+
+/* Stop the workers, called with lock held */
+static void _sda_pool_stop(void) {
+    if (_sda_pool.nthreads == 0) return;
+    pthread_mutex_lock(&_sda_pool.wake_lock);
+    _sda_pool.quit = 1;
+    pthread_cond_broadcast(&_sda_pool.wake);
+    pthread_mutex_unlock(&_sda_pool.wake_lock);
+    for (size_t i = 0; i+1 < _sda_pool.nthreads; i++) pthread_join(_sda_pool.threads[i], NULL);
+    if (_sda_pool.threads != NULL) _sda_free(NULL, _sda_pool.threads, _sda_pool.max_threads*sizeof(pthread_t));
+    sda_free(_sda_pool.ranges);
+    _sda_pool.threads = NULL;
+    _sda_pool.ranges = NULL;
+    _sda_pool.nthreads = 0;
+}
+
+/* Run the chunks of job on the pool, cutting it into chunks first if that
+ * hasn't been done */
+static void _sda_pool_run(struct _sda_job *job) {
+    size_t n;
+    pthread_mutex_lock(&_sda_pool.lock);
+    if (_sda_pool.nthreads == 0) _sda_pool_start();
+    n = _sda_pool.nthreads;
+    if (job->nchunks == 0) _sda_job_chunks(job, n);
+    if (n == 1 || job->nchunks == 1) {
+        for (size_t c = 0; c < job->nchunks; c++) _sda_job_chunk(job, c);
+        pthread_mutex_unlock(&_sda_pool.lock);
+        return;
+    }
+    //even shares to start with
+    for (size_t t = 0; t < n; t++) {
+        _sda_pool.ranges[t].v = _sda_range_pack(job->nchunks*t/n, job->nchunks*(t+1)/n);
+    }
+    pthread_mutex_lock(&_sda_pool.wake_lock);
+    _sda_pool.job = job;
+    _sda_pool.busy = n-1;
+    _sda_pool.gen++;
+    pthread_cond_broadcast(&_sda_pool.wake);
+    pthread_mutex_unlock(&_sda_pool.wake_lock);
+
+    _sda_pool_work(job, 0);
+
+    pthread_mutex_lock(&_sda_pool.wake_lock);
+    while (_sda_pool.busy) pthread_cond_wait(&_sda_pool.done, &_sda_pool.wake_lock);
+    pthread_mutex_unlock(&_sda_pool.wake_lock);
+    pthread_mutex_unlock(&_sda_pool.lock);
+}
+
+void sda_parallel_set_threads(size_t n) {
+    pthread_mutex_lock(&_sda_pool.lock);
+    _sda_pool_stop();
+    _sda_pool.want = n;
+    pthread_mutex_unlock(&_sda_pool.lock);
+}
+
+size_t sda_parallel_threads(void) {
+    size_t n;
+    pthread_mutex_lock(&_sda_pool.lock);
+    if (_sda_pool.nthreads == 0) _sda_pool_start();
+    n = _sda_pool.nthreads;
+    pthread_mutex_unlock(&_sda_pool.lock);
+    return n;
+}
+
+/******* Parallel methods *******/
+
+void sda_parallel_for(sda s, sda_for_fn fn, void *ctx) {
+    struct _sda_job job = {0};
+    job.run = _sda_run_for;
+    job.out = s;
+    job.out_sz = sda_sz(s);
+    job.for_fn = fn;
+    job.ctx = ctx;
+    job.len = sda_len(s);
+    _sda_pool_run(&job);
+}
+
+void sda_parallel_map(const sda s, sda out, sda_map_fn fn, void *ctx) {
+    struct _sda_job job = {0};
+    assert(sda_len(out) >= sda_len(s));
+    job.run = _sda_run_map;
+    job.in = s;
+    job.in_sz = sda_sz(s);
+    job.out = out;
+    job.out_sz = sda_sz(out);
+    job.map_fn = fn;
+    job.ctx = ctx;
+    job.len = sda_len(s);
+    _sda_pool_run(&job);
+}
+
+void sda_parallel_reduce(const sda s, sda_fold_fn fold, sda_combine_fn combine, void *acc, size_t acc_sz, void *ctx) {
+    struct _sda_job job = {0};
+    size_t nthreads = sda_parallel_threads();
+    size_t accs_sz;
+    job.run = _sda_run_fold;
+    job.in = s;
+    job.in_sz = sda_sz(s);
+    //chunks are cut by the input since nothing else gets written
+    job.out = s;
+    job.out_sz = job.in_sz;
+    job.fold = fold;
+    job.ctx = ctx;
+    job.len = sda_len(s);
+    //each accumulator on its own cache lines
+    job.acc_stride = (acc_sz + SDA_CACHE_LINE-1) & ~(size_t)(SDA_CACHE_LINE-1);
+    //cut it up now to know how many accumulators there are
+    _sda_job_chunks(&job, nthreads);
+    accs_sz = job.nchunks*job.acc_stride;
+    job.accs = _sda_new_ext(NULL, accs_sz, 1, SDA_CACHE_LINE, NULL);
+    if (job.accs == NULL) {
+        //no room for the accumulators, do it all on this thread
+        fold(s, sda_len(s), acc, ctx);
+        return;
+    }
+    for (size_t c = 0; c < job.nchunks; c++) memcpy(job.accs + c*job.acc_stride, acc, acc_sz);
+    _sda_pool_run(&job);
+    for (size_t c = 0; c < job.nchunks; c++) combine(acc, job.accs + c*job.acc_stride, ctx);
+    sda_free(job.accs);
+}
+
+
+/******* Test stuff *******/
+
+#if defined(SDA_PARALLEL_TEST_MAIN)
+
+struct _test_ctx {
+    //element index each chunk started at, to check them afterwards
+    size_t starts[4096];
+    size_t nstarts;
+    size_t calls;
+};
+
+static void _test_for(void *elems, size_t i, size_t n, void *ctx) {
+    struct _test_ctx *t = ctx;
+    uint32_t *p = elems;
+    size_t slot = __atomic_fetch_add(&t->nstarts, 1, __ATOMIC_RELAXED);
+    if (slot < 4096) t->starts[slot] = i;
+    for (size_t k = 0; k < n; k++) p[k] = (uint32_t)(i+k)*3;
+}
+
+static void _test_map(const void *in, void *out, size_t n, void *ctx) {
+    const uint32_t *src = in;
+    uint64_t *dst = out;
+    (void)ctx;
+    for (size_t k = 0; k < n; k++) dst[k] = (uint64_t)src[k]*src[k];
+}
+
+static void _test_fold(const void *elems, size_t n, void *acc, void *ctx) {
+    const uint64_t *p = elems;
+    uint64_t *sum = acc;
+    struct _test_ctx *t = ctx;
+    __atomic_fetch_add(&t->calls, 1, __ATOMIC_RELAXED);
+    for (size_t k = 0; k < n; k++) *sum += p[k];
+}
+
+static void _test_combine(void *acc, const void *other, void *ctx) {
+    (void)ctx;
+    *(uint64_t *)acc += *(const uint64_t *)other;
+}
+
+static void _test_alloc(void *elems, size_t i, size_t n, void *ctx) {
+    size_t *calls = ctx;
+    uint8_t *tmp = sda_new_sz(tmp, NULL, 16);
+    (void)elems;
+    (void)i;
+    (void)n;
+    sda_free(tmp);
+    __atomic_fetch_add(calls, 1, __ATOMIC_RELAXED);
+}
+
+//bigger than _SDA_CHUNK_MIN on its own
+struct _test_wide {
+    uint64_t id;
+    char pad[32768-sizeof(uint64_t)];
+};
+
+static void _test_for_wide(void *elems, size_t i, size_t n, void *ctx) {
+    struct _test_wide *p = elems;
+    (void)ctx;
+    for (size_t k = 0; k < n; k++) p[k].id = i+k+1;
+}
+
+static void _test_map_wide(const void *in, void *out, size_t n, void *ctx) {
+    const struct _test_wide *src = in;
+    uint64_t *dst = out;
+    (void)ctx;
+    for (size_t k = 0; k < n; k++) dst[k] = src[k].id*2;
+}
+
+static void _test_fold_wide(const void *elems, size_t n, void *acc, void *ctx) {
+    const struct _test_wide *p = elems;
+    (void)ctx;
+    for (size_t k = 0; k < n; k++) *(uint64_t *)acc += p[k].id;
+}
+
+/* Run everything with nthreads threads on n elements */
+static void _test_run(size_t nthreads, size_t n) {
+    static struct _test_ctx t;
+    uint64_t sum = 0, want = 0;
+    printf("threads %zu len %zu\n", nthreads, n);
+    sda_parallel_set_threads(nthreads);
+    assert(sda_parallel_threads() == nthreads);
+
+    memset(&t, 0, sizeof(t));
+    uint32_t *s = sda_new_sz(s, NULL, n*sizeof(uint32_t));
+    sda_parallel_for(s, _test_for, &t);
+    for (size_t i = 0; i < n; i++) assert(s[i] == (uint32_t)i*3);
+    //every chunk after the first starts on a cache line
+    assert(t.nstarts >= 1);
+    for (size_t c = 0; c < t.nstarts && c < 4096; c++) {
+        if (t.starts[c]) assert((uintptr_t)(s + t.starts[c]) % SDA_CACHE_LINE == 0);
+    }
+    if (nthreads > 1 && n*sizeof(uint32_t) >= SDA_PARALLEL_MIN) assert(t.nstarts > 1);
+
+    uint64_t *sq = sda_new_sz(sq, NULL, n*sizeof(uint64_t));
+    sda_parallel_map(s, sq, _test_map, NULL);
+    for (size_t i = 0; i < n; i++) {
+        assert(sq[i] == (uint64_t)s[i]*s[i]);
+        want += sq[i];
+    }
+
+    sda_parallel_reduce(sq, _test_fold, _test_combine, &sum, sizeof(sum), &t);
+    assert(sum == want);
+    sda_free(s);
+    sda_free(sq);
+}
+
+int main(void) {
+    static const size_t lens[] = {0, 1, 1000, 100000, 1000003};
+    for (size_t l = 0; l < sizeof(lens)/sizeof(*lens); l++) {
+        _test_run(1, lens[l]);
+        _test_run(3, lens[l]);
+        _test_run(8, lens[l]);
+    }
+    //back to one per cpu
+    sda_parallel_set_threads(0);
+    assert(sda_parallel_threads() >= 1);
+    _test_run(4, 12345);
+
+    //counters from the pool threads show up in the snapshot
+    struct sda_stats before, after;
+    size_t calls = 0;
+    uint32_t *s = sda_new_sz(s, NULL, 1000000*sizeof(uint32_t));
+    sda_parallel_set_threads(4);
+    sda_stats_snapshot(&before);
+    sda_parallel_for(s, _test_alloc, &calls);
+    sda_stats_snapshot(&after);
+    assert(calls > 1);
+    assert(after.mallocs - before.mallocs >= calls);
+    assert(after.frees - before.frees >= calls);
+    sda_free(s);
+
+    //fewer elements than threads, each one too big to share a chunk
+    struct _test_wide *wide = sda_new_sz(wide, NULL, 4*sizeof(*wide));
+    uint64_t *ids = sda_new_sz(ids, NULL, 4*sizeof(*ids));
+    uint64_t total = 0;
+    sda_parallel_set_threads(8);
+    sda_parallel_for(wide, _test_for_wide, NULL);
+    for (size_t i = 0; i < 4; i++) assert(wide[i].id == i+1);
+    sda_parallel_map(wide, ids, _test_map_wide, NULL);
+    for (size_t i = 0; i < 4; i++) assert(ids[i] == 2*(i+1));
+    sda_parallel_reduce(wide, _test_fold_wide, _test_combine, &total, sizeof(total), NULL);
+    assert(total == 1+2+3+4);
+    sda_free(ids);
+    sda_free(wide);
+    sda_parallel_set_threads(1);
+    puts("done");
+    return 0;
+}
+#endif
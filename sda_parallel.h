@@ -0,0 +1,90 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Parallel for/map/reduce over sda arrays.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifndef __SDA_PARALLEL_H
+#define __SDA_PARALLEL_H
+
+#include "sda.h"
+
+/* The array is cut into chunks that are handed out to a pool of threads,
+ * the calling thread works on chunks too. Every thread starts with an even
+ * share of the chunks and steals half of what's left from another thread
+ * when it runs out, so uneven chunks still keep everyone busy.
+ *
+ * Chunks are a multiple of a cache line long and their boundaries fall on
+ * cache lines of the array being written (when the element size allows), so
+ * threads never write to the same line. Arrays under SDA_PARALLEL_MIN bytes
+ * aren't worth waking the pool for and run on the caller.
+ *
+ * The callbacks run concurrently and can't call sda_parallel_* themselves.
+ * Calls from different threads take turns on the pool.
+ */
+
+//arrays smaller than this many bytes are done by the calling thread
+#define SDA_PARALLEL_MIN (64*1024)
+
+/**
+ * Called with n elements of s starting at index i, elems points to element i.
+ */
+typedef void (*sda_for_fn)(void *elems, size_t i, size_t n, void *ctx);
+/** Called to fill n elements of out from n elements of in */
+typedef void (*sda_map_fn)(const void *in, void *out, size_t n, void *ctx);
+/** Called to fold n elements into the accumulator acc */
+typedef void (*sda_fold_fn)(const void *elems, size_t n, void *acc, void *ctx);
+/** Called to fold the accumulator other into acc */
+typedef void (*sda_combine_fn)(void *acc, const void *other, void *ctx);
+
+/** Call fn on every element of s, a chunk at a time */
+void sda_parallel_for(sda s, sda_for_fn fn, void *ctx);
+
+/**
+ * Fill out from s a chunk at a time. out must already have at least
+ * sda_len(s) elements (see sda_resize), its element size can be different.
+ */
+void sda_parallel_map(const sda s, sda out, sda_map_fn fn, void *ctx);
+
+/**
+ * Reduce s into acc. Every chunk gets its own copy of the acc_sz bytes at acc,
+ * so acc has to hold the identity of the reduction when called. The chunk
+ * results are then combined into acc in index order, so the result doesn't
+ * depend on which thread ran what.
+ */
+void sda_parallel_reduce(const sda s, sda_fold_fn fold, sda_combine_fn combine, void *acc, size_t acc_sz, void *ctx);
+
+/**
+ * Number of threads to use including the caller, 0 for one per online cpu
+ * (the default) and 1 to do everything on the calling thread.
+ * Not thread safe, the pool can't be in use.
+ */
+void sda_parallel_set_threads(size_t n);
+/** Number of threads being used, including the caller */
+size_t sda_parallel_threads(void);
+
+#endif //__SDA_PARALLEL_H
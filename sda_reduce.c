@@ -0,0 +1,416 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Reductions (sum/min/max/count) over sda arrays of numbers.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include "sda_reduce.h"
+
+#if defined(SDA_REDUCE_TEST_MAIN)
+#include <stdio.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SDA_HAVE_X86 1
+#endif
+
+/******* Kernels *******/
+
+/* Every kernel is plain C written so the compiler can vectorize it: the loop
+ * body works on a fixed block of independent lanes, which keeps the order of
+ * float adds the same no matter how wide the vectors are. The same source is
+ * then built once per instruction set, with the function attributes below. */
+
+//accumulators for sums and counts
+#define _SDA_SUM_LANES 16
+//one block of min/max lanes is 64 bytes
+#define _SDA_MM_LANES(T) (64/sizeof(T))
+
+#if defined(__clang__)
+#define _SDA_ATTR_SCALAR
+#else
+#define _SDA_ATTR_SCALAR __attribute__((optimize("no-tree-vectorize")))
+#endif
+#define _SDA_ATTR_SSE2 __attribute__((target("sse2")))
+#define _SDA_ATTR_AVX2 __attribute__((target("avx2")))
+
+struct _sda_reduce_kernels {
+    //integer kernels are indexed by 1, 2, 4, 8 byte elements
+    uint64_t (*sum_i[4])(const void *p, size_t n);
+    uint64_t (*sum_u[4])(const void *p, size_t n);
+    int64_t (*min_i[4])(const void *p, size_t n);
+    int64_t (*max_i[4])(const void *p, size_t n);
+    uint64_t (*min_u[4])(const void *p, size_t n);
+    uint64_t (*max_u[4])(const void *p, size_t n);
+    size_t (*count[4])(const void *p, size_t n, const void *x);
+    //float kernels by 4 (float), 8 (double) byte elements
+    double (*sum_f[2])(const void *p, size_t n);
+    double (*min_f[2])(const void *p, size_t n);
+    double (*max_f[2])(const void *p, size_t n);
+};
+
+/* Integer sums are done mod 2^64, which works for signed elements as well */
+#define _SDA_SUM(ISA, NAME, T, R, ACC) \
+static _SDA_ATTR_##ISA R _sda_sum_##NAME##_##ISA(const void *v, size_t n) { \
+    const T *p = v; \
+    ACC acc[_SDA_SUM_LANES] = {0}; \
+    ACC r = 0; \
+    size_t i = 0, j; \
+    for (; i+_SDA_SUM_LANES <= n; i += _SDA_SUM_LANES) { \
+        for (j = 0; j < _SDA_SUM_LANES; j++) acc[j] += (ACC)p[i+j]; \
+    } \
+    for (j = 0; j < _SDA_SUM_LANES; j++) r += acc[j]; \
+    for (; i < n; i++) r += (ACC)p[i]; \
+    return r; \
+}
+
+#define _SDA_MINMAX(ISA, NAME, T, R, OP, INIT) \
+static _SDA_ATTR_##ISA R _sda_##NAME##_##ISA(const void *v, size_t n) { \
+    const T *p = v; \
+    T acc[_SDA_MM_LANES(T)]; \
+    T r = (INIT); \
+    size_t i = 0, j; \
+    for (j = 0; j < _SDA_MM_LANES(T); j++) acc[j] = (INIT); \
+    for (; i+_SDA_MM_LANES(T) <= n; i += _SDA_MM_LANES(T)) { \
+        for (j = 0; j < _SDA_MM_LANES(T); j++) acc[j] = (p[i+j] OP acc[j]) ? p[i+j] : acc[j]; \
+    } \
+    for (j = 0; j < _SDA_MM_LANES(T); j++) r = (acc[j] OP r) ? acc[j] : r; \
+    for (; i < n; i++) r = (p[i] OP r) ? p[i] : r; \
+    return r; \
+}
+
+#define _SDA_COUNT(ISA, NAME, T) \
+static _SDA_ATTR_##ISA size_t _sda_count_##NAME##_##ISA(const void *v, size_t n, const void *x) { \
+    const T *p = v; \
+    T val; \
+    size_t acc[_SDA_SUM_LANES] = {0}; \
+    size_t r = 0; \
+    size_t i = 0, j; \
+    memcpy(&val, x, sizeof(val)); \
+    for (; i+_SDA_SUM_LANES <= n; i += _SDA_SUM_LANES) { \
+        for (j = 0; j < _SDA_SUM_LANES; j++) acc[j] += (p[i+j] == val); \
+    } \
+    for (j = 0; j < _SDA_SUM_LANES; j++) r += acc[j]; \
+    for (; i < n; i++) r += (p[i] == val); \
+    return r; \
+}
+
+/* Every kernel for one instruction set, and the table pointing to them */
+#define _SDA_KERNELS(ISA) \
+    _SDA_SUM(ISA, i8, int8_t, uint64_t, uint64_t) \
+    _SDA_SUM(ISA, i16, int16_t, uint64_t, uint64_t) \
+    _SDA_SUM(ISA, i32, int32_t, uint64_t, uint64_t) \
+    _SDA_SUM(ISA, i64, int64_t, uint64_t, uint64_t) \
+    _SDA_SUM(ISA, u8, uint8_t, uint64_t, uint64_t) \
+    _SDA_SUM(ISA, u16, uint16_t, uint64_t, uint64_t) \
+    _SDA_SUM(ISA, u32, uint32_t, uint64_t, uint64_t) \
+    _SDA_SUM(ISA, u64, uint64_t, uint64_t, uint64_t) \
+    _SDA_SUM(ISA, f32, float, double, double) \
+    _SDA_SUM(ISA, f64, double, double, double) \
+    _SDA_MINMAX(ISA, min_i8, int8_t, int64_t, <, INT8_MAX) \
+    _SDA_MINMAX(ISA, min_i16, int16_t, int64_t, <, INT16_MAX) \
+    _SDA_MINMAX(ISA, min_i32, int32_t, int64_t, <, INT32_MAX) \
+    _SDA_MINMAX(ISA, min_i64, int64_t, int64_t, <, INT64_MAX) \
+    _SDA_MINMAX(ISA, max_i8, int8_t, int64_t, >, INT8_MIN) \
+    _SDA_MINMAX(ISA, max_i16, int16_t, int64_t, >, INT16_MIN) \
+    _SDA_MINMAX(ISA, max_i32, int32_t, int64_t, >, INT32_MIN) \
+    _SDA_MINMAX(ISA, max_i64, int64_t, int64_t, >, INT64_MIN) \
+    _SDA_MINMAX(ISA, min_u8, uint8_t, uint64_t, <, UINT8_MAX) \
+    _SDA_MINMAX(ISA, min_u16, uint16_t, uint64_t, <, UINT16_MAX) \
+    _SDA_MINMAX(ISA, min_u32, uint32_t, uint64_t, <, UINT32_MAX) \
+    _SDA_MINMAX(ISA, min_u64, uint64_t, uint64_t, <, UINT64_MAX) \
+    _SDA_MINMAX(ISA, max_u8, uint8_t, uint64_t, >, 0) \
+    _SDA_MINMAX(ISA, max_u16, uint16_t, uint64_t, >, 0) \
+    _SDA_MINMAX(ISA, max_u32, uint32_t, uint64_t, >, 0) \
+    _SDA_MINMAX(ISA, max_u64, uint64_t, uint64_t, >, 0) \
+    _SDA_MINMAX(ISA, min_f32, float, double, <, INFINITY) \
+    _SDA_MINMAX(ISA, min_f64, double, double, <, INFINITY) \
+    _SDA_MINMAX(ISA, max_f32, float, double, >, -INFINITY) \
+    _SDA_MINMAX(ISA, max_f64, double, double, >, -INFINITY) \
+    _SDA_COUNT(ISA, u8, uint8_t) \
+    _SDA_COUNT(ISA, u16, uint16_t) \
+    _SDA_COUNT(ISA, u32, uint32_t) \
+    _SDA_COUNT(ISA, u64, uint64_t) \
+    static const struct _sda_reduce_kernels _sda_kernels_##ISA = { \
+        {_sda_sum_i8_##ISA, _sda_sum_i16_##ISA, _sda_sum_i32_##ISA, _sda_sum_i64_##ISA}, \
+        {_sda_sum_u8_##ISA, _sda_sum_u16_##ISA, _sda_sum_u32_##ISA, _sda_sum_u64_##ISA}, \
+        {_sda_min_i8_##ISA, _sda_min_i16_##ISA, _sda_min_i32_##ISA, _sda_min_i64_##ISA}, \
+        {_sda_max_i8_##ISA, _sda_max_i16_##ISA, _sda_max_i32_##ISA, _sda_max_i64_##ISA}, \
+        {_sda_min_u8_##ISA, _sda_min_u16_##ISA, _sda_min_u32_##ISA, _sda_min_u64_##ISA}, \
+        {_sda_max_u8_##ISA, _sda_max_u16_##ISA, _sda_max_u32_##ISA, _sda_max_u64_##ISA}, \
+        {_sda_count_u8_##ISA, _sda_count_u16_##ISA, _sda_count_u32_##ISA, _sda_count_u64_##ISA}, \
+        {_sda_sum_f32_##ISA, _sda_sum_f64_##ISA}, \
+        {_sda_min_f32_##ISA, _sda_min_f64_##ISA}, \
+        {_sda_max_f32_##ISA, _sda_max_f64_##ISA}, \
+    };
+
+_SDA_KERNELS(SCALAR)
+#if defined(SDA_HAVE_X86)
+_SDA_KERNELS(SSE2)
+_SDA_KERNELS(AVX2)
+#endif
+
+/******* Dispatch *******/
+
+static const struct _sda_reduce_kernels *_sda_kernels = NULL;
+static int _sda_isa = SDA_ISA_SCALAR;
+
+static int _sda_best_isa(void) {
+#if defined(SDA_HAVE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SDA_ISA_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SDA_ISA_SSE2;
+#endif
+    return SDA_ISA_SCALAR;
+}
+
+int sda_reduce_set_isa(int isa) {
+    const struct _sda_reduce_kernels *k = &_sda_kernels_SCALAR;
+    int best = _sda_best_isa();
+    if (isa > best) isa = best;
+    switch (isa) {
+#if defined(SDA_HAVE_X86)
+        case SDA_ISA_AVX2:
+            k = &_sda_kernels_AVX2;
+            break;
+        case SDA_ISA_SSE2:
+            k = &_sda_kernels_SSE2;
+            break;
+#endif
+        default:
+            isa = SDA_ISA_SCALAR;
+            break;
+    }
+    _sda_isa = isa;
+    __atomic_store_n(&_sda_kernels, k, __ATOMIC_RELEASE);
+    return isa;
+}
+
+int sda_reduce_isa(void) {
+    if (__atomic_load_n(&_sda_kernels, __ATOMIC_ACQUIRE) == NULL) sda_reduce_set_isa(SDA_ISA_AVX2);
+    return _sda_isa;
+}
+
+/* Kernels for this cpu, picked the first time they're needed */
+static inline const struct _sda_reduce_kernels *_sda_k(void) {
+    const struct _sda_reduce_kernels *k = __atomic_load_n(&_sda_kernels, __ATOMIC_ACQUIRE);
+    if (k == NULL) {
+        sda_reduce_set_isa(SDA_ISA_AVX2);
+        k = __atomic_load_n(&_sda_kernels, __ATOMIC_ACQUIRE);
+    }
+    return k;
+}
+
+/* Kernel index for integer elements of sz bytes, -1 if there isn't one */
+static inline int _sda_int_idx(size_t sz) {
+    switch (sz) {
+        case 1: return 0;
+        case 2: return 1;
+        case 4: return 2;
+        case 8: return 3;
+    }
+    assert(0 && "integer elements must be 1, 2, 4 or 8 bytes");
+    return -1;
+}
+
+/* Kernel index for float elements of sz bytes, -1 if there isn't one */
+static inline int _sda_float_idx(size_t sz) {
+    switch (sz) {
+        case sizeof(float): return 0;
+        case sizeof(double): return 1;
+    }
+    assert(0 && "float elements must be float or double");
+    return -1;
+}
+
+/******* Reductions *******/
+
+/* Decode the header once and call the kernel for its element size, empty
+ * arrays get EMPTY instead of the identity for the element type */
+#define _SDA_REDUCE(s, KIND, OP, EMPTY) ({ \
+    struct sda_hdr_uni shadow; \
+    sda_hdr((s), &shadow); \
+    int idx = _sda_##KIND##_idx(shadow.sz); \
+    (idx < 0 || shadow.len == 0) ? (EMPTY) : _sda_k()->OP[idx]((s), shadow.len); \
+    })
+
+int64_t sda_sum_i(const sda s) {
+    return (int64_t)_SDA_REDUCE(s, int, sum_i, 0);
+}
+
+uint64_t sda_sum_u(const sda s) {
+    return _SDA_REDUCE(s, int, sum_u, 0);
+}
+
+double sda_sum_f(const sda s) {
+    return _SDA_REDUCE(s, float, sum_f, 0);
+}
+
+int64_t sda_min_i(const sda s) {
+    return _SDA_REDUCE(s, int, min_i, INT64_MAX);
+}
+
+uint64_t sda_min_u(const sda s) {
+    return _SDA_REDUCE(s, int, min_u, UINT64_MAX);
+}
+
+double sda_min_f(const sda s) {
+    return _SDA_REDUCE(s, float, min_f, INFINITY);
+}
+
+int64_t sda_max_i(const sda s) {
+    return _SDA_REDUCE(s, int, max_i, INT64_MIN);
+}
+
+uint64_t sda_max_u(const sda s) {
+    return _SDA_REDUCE(s, int, max_u, 0);
+}
+
+double sda_max_f(const sda s) {
+    return _SDA_REDUCE(s, float, max_f, -INFINITY);
+}
+
+size_t _sda_count(const sda s, const void *x, size_t size) {
+    struct sda_hdr_uni shadow;
+    int idx;
+    sda_hdr(s, &shadow);
+    assert(size == shadow.sz);
+    (void)size;
+    //any other size just compares bytes
+    switch (shadow.sz) {
+        case 1: case 2: case 4: case 8:
+            idx = _sda_int_idx(shadow.sz);
+            return _sda_k()->count[idx](s, shadow.len, x);
+    }
+    size_t r = 0;
+    for (size_t i = 0; i < shadow.len; i++) {
+        r += (memcmp((const char *)s + i*shadow.sz, x, shadow.sz) == 0);
+    }
+    return r;
+}
+
+
+/******* Test stuff *******/
+
+#if defined(SDA_REDUCE_TEST_MAIN)
+
+/* Compare every reduction to a plain sda_get loop for array type T */
+#define _TEST_INT(T, len, sign) do { \
+    T *s = sda_new_sz(s, NULL, (len)*sizeof(T)); \
+    int64_t sum = 0, mn = INT64_MAX, mx = INT64_MIN; \
+    uint64_t usum = 0, umn = UINT64_MAX, umx = 0; \
+    size_t cnt = 0; \
+    for (size_t i = 0; i < (len); i++) s[i] = (T)rand(); \
+    if ((len) > 3) s[(len)/2] = s[3]; \
+    for (size_t i = 0; i < sda_len(s); i++) { \
+        T x = sda_get(s, i); \
+        sum += x; usum += x; \
+        if (x < mn) mn = x; \
+        if (x > mx) mx = x; \
+        if ((uint64_t)x < umn) umn = (uint64_t)x; \
+        if ((uint64_t)x > umx) umx = (uint64_t)x; \
+        if ((len) > 3 && x == s[3]) cnt++; \
+    } \
+    if (sign) { \
+        assert(sda_sum_i(s) == sum); \
+        assert(sda_min_i(s) == mn); \
+        assert(sda_max_i(s) == mx); \
+    } else { \
+        assert(sda_sum_u(s) == usum); \
+        assert(sda_min_u(s) == umn); \
+        assert(sda_max_u(s) == umx); \
+    } \
+    if ((len) > 3) assert(sda_count(s, s[3]) == cnt); \
+    sda_free(s); \
+    } while(0)
+
+#define _TEST_FLOAT(T, len) do { \
+    T *s = sda_new_sz(s, NULL, (len)*sizeof(T)); \
+    double mn = INFINITY, mx = -INFINITY; \
+    double lanes[_SDA_SUM_LANES] = {0}, sum = 0; \
+    size_t i; \
+    for (i = 0; i < (len); i++) s[i] = (T)(rand() - RAND_MAX/2) / 1000; \
+    for (i = 0; i+_SDA_SUM_LANES <= sda_len(s); i += _SDA_SUM_LANES) { \
+        for (size_t j = 0; j < _SDA_SUM_LANES; j++) lanes[j] += sda_get(s, i+j); \
+    } \
+    for (size_t j = 0; j < _SDA_SUM_LANES; j++) sum += lanes[j]; \
+    for (; i < sda_len(s); i++) sum += sda_get(s, i); \
+    for (i = 0; i < sda_len(s); i++) { \
+        T x = sda_get(s, i); \
+        if (x < mn) mn = x; \
+        if (x > mx) mx = x; \
+    } \
+    assert(sda_sum_f(s) == sum); \
+    assert(sda_min_f(s) == mn); \
+    assert(sda_max_f(s) == mx); \
+    sda_free(s); \
+    } while(0)
+
+int main(void) {
+    static const size_t lens[] = {0, 1, 5, 63, 64, 65, 1000, UINT16_MAX+100};
+    int best = sda_reduce_isa();
+    printf("best isa %d\n", best);
+
+    for (int isa = SDA_ISA_SCALAR; isa <= best; isa++) {
+        assert(sda_reduce_set_isa(isa) == isa);
+        assert(sda_reduce_isa() == isa);
+        for (size_t l = 0; l < sizeof(lens)/sizeof(*lens); l++) {
+            printf("isa %d len %zu\n", isa, lens[l]);
+            _TEST_INT(int8_t, lens[l], 1);
+            _TEST_INT(int16_t, lens[l], 1);
+            _TEST_INT(int32_t, lens[l], 1);
+            _TEST_INT(int64_t, lens[l], 1);
+            _TEST_INT(uint8_t, lens[l], 0);
+            _TEST_INT(uint16_t, lens[l], 0);
+            _TEST_INT(uint32_t, lens[l], 0);
+            _TEST_INT(uint64_t, lens[l], 0);
+            _TEST_FLOAT(float, lens[l]);
+            _TEST_FLOAT(double, lens[l]);
+        }
+    }
+    //can't go past what the cpu has
+    assert(sda_reduce_set_isa(SDA_ISA_AVX2+1) == best);
+
+    //empty arrays give the identity
+    sda_raii sdaint e = sda_empty(e);
+    assert(sda_sum_i(e) == 0);
+    assert(sda_min_i(e) == INT64_MAX);
+    assert(sda_max_i(e) == INT64_MIN);
+    assert(sda_count(e, 1) == 0);
+
+    //odd sized elements can still be counted
+    struct rgb { uint8_t r, g, b; } rgbs[] = {{1,2,3}, {4,5,6}, {1,2,3}};
+    sda_raii struct rgb *c = sda_new(c, rgbs);
+    struct rgb want = {1,2,3};
+    assert(_sda_count(c, &want, sizeof(want)) == 2);
+
+    puts("done");
+    return 0;
+}
+#endif
@@ -0,0 +1,85 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Reductions (sum/min/max/count) over sda arrays of numbers.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __SDA_REDUCE_H
+#define __SDA_REDUCE_H
+
+#include "sda.h"
+
+/* The element size comes from sda_sz(s), the caller picks how the elements
+ * are read by calling the _i (signed), _u (unsigned) or _f (float/double)
+ * version. Integer arrays can have 1, 2, 4 or 8 byte elements, float arrays
+ * 4 (float) or 8 (double).
+ *
+ * Empty arrays return the identity of the reduction: 0 for sums, the largest
+ * value of the return type for min and the smallest for max (+/-INFINITY for
+ * floats).
+ */
+
+//instruction sets the kernels can be built for
+#define SDA_ISA_SCALAR 0
+#define SDA_ISA_SSE2 1
+#define SDA_ISA_AVX2 2
+
+/** Sum of every element, integer sums wrap around on overflow */
+int64_t sda_sum_i(const sda s);
+uint64_t sda_sum_u(const sda s);
+double sda_sum_f(const sda s);
+
+/** Smallest element */
+int64_t sda_min_i(const sda s);
+uint64_t sda_min_u(const sda s);
+double sda_min_f(const sda s);
+
+/** Biggest element */
+int64_t sda_max_i(const sda s);
+uint64_t sda_max_u(const sda s);
+double sda_max_f(const sda s);
+
+/**
+ * Returns the number of elements in s equal to x.
+ * x must be a rvalue and not a pointer.
+ */
+#define sda_count(s, x) ({ \
+    __typeof__(*(s)) tmp = (x); \
+    _sda_count((s), &tmp, sizeof(tmp)); \
+    })
+/** Number of elements that are bitwise equal to the size bytes at x, size must be sda_sz(s) */
+size_t _sda_count(const sda s, const void *x, size_t size);
+
+/** Returns the instruction set the kernels were picked for (SDA_ISA_*) */
+int sda_reduce_isa(void);
+/**
+ * Use the kernels for isa instead of the best one for this cpu.
+ * Returns the isa that's in use after the call, which is the best supported
+ * one at or below isa.
+ */
+int sda_reduce_set_isa(int isa);
+
+#endif //__SDA_REDUCE_H
@@ -0,0 +1,315 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Sorting and binary search for sda arrays.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdlib.h>
+#include <assert.h>
+#include "sda_sort.h"
+
+#if defined(SDA_SORT_TEST_MAIN)
+#include <stdio.h>
+#include <math.h>
+#endif
+
+//arrays shorter than this are introsorted, the radix histograms cost more
+#define _SDA_RADIX_MIN 256
+
+/******* Radix keys *******/
+
+/* Each element maps to an unsigned key that sorts in the same order: signed
+ * integers flip their sign bit, floats flip every bit when negative and just
+ * the sign bit otherwise. */
+
+#define _SDA_KEY_U(x) (x)
+#define _SDA_KEY_I8(x) ((uint8_t)(x) ^ UINT8_C(0x80))
+#define _SDA_KEY_I16(x) ((uint16_t)(x) ^ UINT16_C(0x8000))
+#define _SDA_KEY_I32(x) ((uint32_t)(x) ^ UINT32_C(0x80000000))
+#define _SDA_KEY_I64(x) ((uint64_t)(x) ^ UINT64_C(0x8000000000000000))
+
+static inline uint32_t _sda_key_f32(float x) {
+    uint32_t k;
+    memcpy(&k, &x, sizeof(k));
+    return (k & UINT32_C(0x80000000)) ? ~k : (k | UINT32_C(0x80000000));
+}
+
+static inline uint64_t _sda_key_f64(double x) {
+    uint64_t k;
+    memcpy(&k, &x, sizeof(k));
+    return (k & UINT64_C(0x8000000000000000)) ? ~k : (k | UINT64_C(0x8000000000000000));
+}
+
+//the introsort fallback has to agree with the radix order
+#define _SDA_LESS(a, b) ((a) < (b))
+#define _SDA_LESS_F32(a, b) (_sda_key_f32(a) < _sda_key_f32(b))
+#define _SDA_LESS_F64(a, b) (_sda_key_f64(a) < _sda_key_f64(b))
+
+/******* Sorts *******/
+
+/* LSD radix sort of n elements of a using tmp as scratch, one pass per key
+ * byte. The histograms for every byte are made in a single read of a, and
+ * bytes that are the same for every element are skipped. */
+#define _SDA_RADIX(NAME, T, UT, KEY) \
+static void _sda_radix_##NAME(T *a, T *tmp, size_t n) { \
+    size_t hist[sizeof(T)][256]; \
+    T *src = a, *dst = tmp, *swap; \
+    size_t i, b; \
+    memset(hist, 0, sizeof(hist)); \
+    for (i = 0; i < n; i++) { \
+        UT k = KEY(a[i]); \
+        for (b = 0; b < sizeof(T); b++) hist[b][(uint8_t)(k >> (8*b))]++; \
+    } \
+    for (b = 0; b < sizeof(T); b++) { \
+        size_t *h = hist[b], sum = 0; \
+        UT k0 = KEY(a[0]); \
+        if (h[(uint8_t)(k0 >> (8*b))] == n) continue; \
+        for (i = 0; i < 256; i++) { \
+            size_t c = h[i]; \
+            h[i] = sum; \
+            sum += c; \
+        } \
+        for (i = 0; i < n; i++) { \
+            UT k = KEY(src[i]); \
+            dst[h[(uint8_t)(k >> (8*b))]++] = src[i]; \
+        } \
+        swap = src; \
+        src = dst; \
+        dst = swap; \
+    } \
+    if (src != a) memcpy(a, src, n*sizeof(T)); \
+}
+
+/* Radix sort with scratch from the array's allocator, or introsort */
+#define _SDA_SORT(NAME, T, UT, KEY, LESS) \
+_SDA_RADIX(NAME, T, UT, KEY) \
+SDA_SORT_DEFINE(_sda_introsort_##NAME, T, LESS) \
+static void _sda_sort_##NAME(T *s) { \
+    size_t n = sda_len(s); \
+    const struct sda_allocator *a = _sda_allocator(s); \
+    T *tmp = NULL; \
+    if (n >= _SDA_RADIX_MIN) tmp = _sda_malloc(a, n*sizeof(T)); \
+    if (tmp == NULL) { \
+        _sda_introsort_##NAME(s); \
+        return; \
+    } \
+    _sda_radix_##NAME(s, tmp, n); \
+    _sda_free(a, tmp, n*sizeof(T)); \
+}
+
+_SDA_SORT(i8, int8_t, uint8_t, _SDA_KEY_I8, _SDA_LESS)
+_SDA_SORT(i16, int16_t, uint16_t, _SDA_KEY_I16, _SDA_LESS)
+_SDA_SORT(i32, int32_t, uint32_t, _SDA_KEY_I32, _SDA_LESS)
+_SDA_SORT(i64, int64_t, uint64_t, _SDA_KEY_I64, _SDA_LESS)
+_SDA_SORT(u8, uint8_t, uint8_t, _SDA_KEY_U, _SDA_LESS)
+_SDA_SORT(u16, uint16_t, uint16_t, _SDA_KEY_U, _SDA_LESS)
+_SDA_SORT(u32, uint32_t, uint32_t, _SDA_KEY_U, _SDA_LESS)
+_SDA_SORT(u64, uint64_t, uint64_t, _SDA_KEY_U, _SDA_LESS)
+_SDA_SORT(f32, float, uint32_t, _sda_key_f32, _SDA_LESS_F32)
+_SDA_SORT(f64, double, uint64_t, _sda_key_f64, _SDA_LESS_F64)
+
+void sda_sort_i(sda s) {
+    switch (sda_sz(s)) {
+        case 1: _sda_sort_i8(s); break;
+        case 2: _sda_sort_i16(s); break;
+        case 4: _sda_sort_i32(s); break;
+        case 8: _sda_sort_i64(s); break;
+        default: assert(0 && "integer elements must be 1, 2, 4 or 8 bytes");
+    }
+}
+
+void sda_sort_u(sda s) {
+    switch (sda_sz(s)) {
+        case 1: _sda_sort_u8(s); break;
+        case 2: _sda_sort_u16(s); break;
+        case 4: _sda_sort_u32(s); break;
+        case 8: _sda_sort_u64(s); break;
+        default: assert(0 && "integer elements must be 1, 2, 4 or 8 bytes");
+    }
+}
+
+void sda_sort_f(sda s) {
+    switch (sda_sz(s)) {
+        case sizeof(float): _sda_sort_f32(s); break;
+        case sizeof(double): _sda_sort_f64(s); break;
+        default: assert(0 && "float elements must be float or double");
+    }
+}
+
+
+/******* Test stuff *******/
+
+#if defined(SDA_SORT_TEST_MAIN)
+
+static int _cmp_i32(const void *a, const void *b) {
+    int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Sort a random array of T with f and check it against qsort on a copy */
+#define _TEST_SORT(T, f, len, gen) do { \
+    T *s = sda_new_sz(s, NULL, (len)*sizeof(T)); \
+    T *want = malloc((len)*sizeof(T) + 1); \
+    for (size_t i = 0; i < (len); i++) s[i] = (T)(gen); \
+    memcpy(want, s, (len)*sizeof(T)); \
+    f(s); \
+    assert(sda_len(s) == (len)); \
+    for (size_t i = 1; i < sda_len(s); i++) assert(!(s[i] < s[i-1])); \
+    /* same elements as before, checked by sorting the copy the slow way */ \
+    T *w = sda_new_sz(w, want, (len)*sizeof(T)); \
+    _sda_introsort_check_##T(w); \
+    assert(memcmp(s, w, (len)*sizeof(T)) == 0); \
+    sda_free(w); \
+    free(want); \
+    sda_free(s); \
+    } while(0)
+
+#define _LESS(a, b) ((a) < (b))
+SDA_SORT_DEFINE(_sda_introsort_check_int8_t, int8_t, _LESS)
+SDA_SORT_DEFINE(_sda_introsort_check_int16_t, int16_t, _LESS)
+SDA_SORT_DEFINE(_sda_introsort_check_int32_t, int32_t, _LESS)
+SDA_SORT_DEFINE(_sda_introsort_check_int64_t, int64_t, _LESS)
+SDA_SORT_DEFINE(_sda_introsort_check_uint8_t, uint8_t, _LESS)
+SDA_SORT_DEFINE(_sda_introsort_check_uint16_t, uint16_t, _LESS)
+SDA_SORT_DEFINE(_sda_introsort_check_uint32_t, uint32_t, _LESS)
+SDA_SORT_DEFINE(_sda_introsort_check_uint64_t, uint64_t, _LESS)
+SDA_SORT_DEFINE(_sda_introsort_check_float, float, _LESS)
+SDA_SORT_DEFINE(_sda_introsort_check_double, double, _LESS)
+
+struct point {
+    int x, y;
+};
+#define _point_less(a, b) ((a).x < (b).x || ((a).x == (b).x && (a).y < (b).y))
+SDA_SORT_DEFINE(sort_points, struct point, _point_less)
+
+//an allocator that runs out after *ctx mallocs, to hit the introsort fallback
+static void *_fail_malloc(void *ctx, size_t size) {
+    int *left = ctx;
+    if (*left == 0) return NULL;
+    (*left)--;
+    return malloc(size);
+}
+static void *_fail_realloc(void *ctx, void *ptr, size_t old_size, size_t size) {
+    (void)ctx; (void)old_size;
+    return realloc(ptr, size);
+}
+static void _fail_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx; (void)size;
+    free(ptr);
+}
+
+int main(void) {
+    static const size_t lens[] = {0, 1, 2, 15, 17, 255, 256, 1000, 100000};
+    int *ints;
+
+    for (size_t l = 0; l < sizeof(lens)/sizeof(*lens); l++) {
+        size_t n = lens[l];
+        printf("len %zu\n", n);
+        _TEST_SORT(int8_t, sda_sort_i, n, rand());
+        _TEST_SORT(int16_t, sda_sort_i, n, rand());
+        _TEST_SORT(int32_t, sda_sort_i, n, rand() - RAND_MAX/2);
+        _TEST_SORT(int64_t, sda_sort_i, n, (int64_t)(((uint64_t)rand() << 33) ^ rand()));
+        _TEST_SORT(uint8_t, sda_sort_u, n, rand());
+        _TEST_SORT(uint16_t, sda_sort_u, n, rand());
+        _TEST_SORT(uint32_t, sda_sort_u, n, (uint32_t)rand() << 1);
+        _TEST_SORT(uint64_t, sda_sort_u, n, ((uint64_t)rand() << 40) ^ rand());
+        _TEST_SORT(float, sda_sort_f, n, (rand() - RAND_MAX/2) / 1000.0f);
+        _TEST_SORT(double, sda_sort_f, n, (rand() - RAND_MAX/2) / 1000.0);
+        //lots of duplicates and already sorted input
+        _TEST_SORT(int32_t, sda_sort_i, n, rand() % 3);
+        _TEST_SORT(int32_t, sda_sort_i, n, n);
+    }
+
+    //the introsort has to survive input that's bad for quicksort
+    ints = sda_new_sz(ints, NULL, 100000*sizeof(int));
+    for (int i = 0; i < 100000; i++) ints[i] = (i & 1) ? i : 100000-i;
+    _sda_introsort_check_int32_t((int32_t *)ints);
+    for (size_t i = 1; i < sda_len(ints); i++) assert(ints[i-1] <= ints[i]);
+    sda_free(ints);
+
+    //floats go by their bits, -0 before 0 and NaNs at the ends
+    double fs[] = {1.0, NAN, 0.0, -INFINITY, -0.0, -NAN, -1.0, INFINITY};
+    sda_raii double *f = sda_new(f, fs);
+    sda_sort_f(f);
+    assert(isnan(f[0]) && signbit(f[0]));
+    assert(f[1] == -INFINITY && f[2] == -1.0);
+    assert(f[3] == 0 && signbit(f[3]));
+    assert(f[4] == 0 && !signbit(f[4]));
+    assert(f[5] == 1.0 && f[6] == INFINITY);
+    assert(isnan(f[7]) && !signbit(f[7]));
+
+    //no scratch memory, so the radix sort can't run
+    int left = 1;
+    const struct sda_allocator fail = {_fail_malloc, _fail_realloc, _fail_free, &left};
+    int32_t *nomem = sda_new_sz_with(nomem, NULL, 1000*sizeof(int32_t), &fail);
+    for (int i = 0; i < 1000; i++) nomem[i] = rand() - RAND_MAX/2;
+    sda_sort_i(nomem);
+    assert(left == 0);
+    for (size_t i = 1; i < sda_len(nomem); i++) assert(nomem[i-1] <= nomem[i]);
+    sda_free(nomem);
+
+    //binary search
+    int sorted[] = {1, 3, 3, 3, 7, 9};
+    sda_raii int *b = sda_new(b, sorted);
+    assert(sda_lower_bound(b, 0) == 0);
+    assert(sda_upper_bound(b, 0) == 0);
+    assert(sda_lower_bound(b, 3) == 1);
+    assert(sda_upper_bound(b, 3) == 4);
+    assert(sda_lower_bound(b, 4) == 4);
+    assert(sda_upper_bound(b, 4) == 4);
+    assert(sda_lower_bound(b, 9) == 5);
+    assert(sda_upper_bound(b, 9) == 6);
+    assert(sda_lower_bound(b, 10) == 6);
+    sda_raii int *e = sda_empty(e);
+    assert(sda_lower_bound(e, 1) == 0);
+    assert(sda_upper_bound(e, 1) == 0);
+
+    //structs with a typed comparator
+    struct point pts[] = {{3,1}, {1,2}, {3,0}, {2,5}, {1,1}};
+    sda_raii struct point *p = sda_new(p, pts);
+    sort_points(p);
+    for (size_t i = 1; i < sda_len(p); i++) assert(!_point_less(p[i], p[i-1]));
+    assert(p[0].x == 1 && p[0].y == 1);
+    assert(p[4].x == 3 && p[4].y == 1);
+    struct point key = {3, 0};
+    assert(sort_points_lower_bound(p, key) == 3);
+    assert(sort_points_upper_bound(p, key) == 4);
+
+    //same answer as qsort
+    int32_t *q = sda_new_sz(q, NULL, 5000*sizeof(int32_t));
+    int32_t *r = sda_new_sz(r, NULL, 5000*sizeof(int32_t));
+    for (int i = 0; i < 5000; i++) q[i] = r[i] = rand() % 1000;
+    qsort(q, sda_len(q), sda_sz(q), _cmp_i32);
+    sda_sort_i(r);
+    assert(memcmp(q, r, 5000*sizeof(int32_t)) == 0);
+    sda_free(q);
+    sda_free(r);
+
+    puts("done");
+    return 0;
+}
+#endif
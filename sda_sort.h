@@ -0,0 +1,207 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Sorting and binary search for sda arrays.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifndef __SDA_SORT_H
+#define __SDA_SORT_H
+
+#include "sda.h"
+
+/* Arrays of numbers are sorted with an LSD radix sort picked by sda_sz(s),
+ * the caller says how the elements are read by calling the _i (signed),
+ * _u (unsigned) or _f (float/double) version. Integer arrays can have 1, 2, 4
+ * or 8 byte elements, float arrays 4 (float) or 8 (double).
+ *
+ * The radix sort needs a scratch buffer as big as the array, which comes from
+ * the array's allocator. Small arrays, or a failed scratch allocation, fall
+ * back to an in-place introsort so sorting never fails.
+ *
+ * Floats are sorted by their bits: -0.0 comes before 0.0 and NaNs go to the
+ * ends (negative NaNs first, positive ones last).
+ */
+
+/** Sort s in ascending order */
+void sda_sort_i(sda s);
+void sda_sort_u(sda s);
+void sda_sort_f(sda s);
+
+/**
+ * Index of the first element of sorted s that's not less than x, or
+ * sda_len(s) if there isn't one.
+ * s must be an array of an arithmetic type, x must be a rvalue.
+ */
+#define sda_lower_bound(s, x) ({ \
+    __typeof__(*(s)) tmp = (x); \
+    _SDA_BOUND((s), sda_len(s), tmp, _SDA_LESS_LOWER); \
+    })
+/** Index of the first element of sorted s that's greater than x, or sda_len(s) */
+#define sda_upper_bound(s, x) ({ \
+    __typeof__(*(s)) tmp = (x); \
+    _SDA_BOUND((s), sda_len(s), tmp, _SDA_LESS_UPPER); \
+    })
+
+/**
+ * Define typed sort and search functions for arrays of T ordered by the
+ * less(a, b) expression, which can be a function or a macro. Compares are
+ * inlined instead of going through a function pointer like qsort does.
+ *
+ * Defines:
+ *   void name(T *s)                              sort s
+ *   size_t name##_lower_bound(const T *s, T key) see sda_lower_bound
+ *   size_t name##_upper_bound(const T *s, T key) see sda_upper_bound
+ *
+ * e.g.
+ *   #define point_less(a, b) ((a).x < (b).x)
+ *   SDA_SORT_DEFINE(sort_points, struct point, point_less)
+ *   ...
+ *   sort_points(points);
+ */
+#define SDA_SORT_DEFINE(name, T, less) \
+static inline void name##_isort(T *a, size_t n) { \
+    for (size_t i = 1; i < n; i++) { \
+        T x = a[i]; \
+        size_t j = i; \
+        for (; j > 0 && less(x, a[j-1]); j--) a[j] = a[j-1]; \
+        a[j] = x; \
+    } \
+} \
+static inline void name##_sift(T *a, size_t root, size_t n) { \
+    T x = a[root]; \
+    size_t child; \
+    while ((child = 2*root+1) < n) { \
+        if (child+1 < n && less(a[child], a[child+1])) child++; \
+        if (!less(x, a[child])) break; \
+        a[root] = a[child]; \
+        root = child; \
+    } \
+    a[root] = x; \
+} \
+static inline void name##_hsort(T *a, size_t n) { \
+    for (size_t i = n/2; i-- > 0; ) name##_sift(a, i, n); \
+    while (n > 1) { \
+        T x = a[0]; \
+        a[0] = a[--n]; \
+        a[n] = x; \
+        name##_sift(a, 0, n); \
+    } \
+} \
+static inline void name##_intro(T *a, size_t n, unsigned depth) { \
+    while (n > _SDA_SORT_ISORT_MAX) { \
+        T *m = a + n/2, *hi = a + n-1, x; \
+        if (depth-- == 0) { \
+            name##_hsort(a, n); \
+            return; \
+        } \
+        /* median of 3, which also leaves a sentinel at each end */ \
+        if (less(*m, *a)) { x = *m; *m = *a; *a = x; } \
+        if (less(*hi, *m)) { \
+            x = *m; *m = *hi; *hi = x; \
+            if (less(*m, *a)) { x = *m; *m = *a; *a = x; } \
+        } \
+        T pivot = *m; \
+        size_t i = 0, j = n-1; \
+        for (;;) { \
+            while (less(a[++i], pivot)); \
+            while (less(pivot, a[--j])); \
+            if (i >= j) break; \
+            x = a[i]; a[i] = a[j]; a[j] = x; \
+        } \
+        /* recurse into the smaller side to bound the stack */ \
+        if (i < n-i) { \
+            name##_intro(a, i, depth); \
+            a += i; \
+            n -= i; \
+        } \
+        else { \
+            name##_intro(a+i, n-i, depth); \
+            n = i; \
+        } \
+    } \
+    name##_isort(a, n); \
+} \
+static inline void name(T *s) { \
+    size_t n = sda_len(s); \
+    name##_intro(s, n, _sda_sort_depth(n)); \
+} \
+static inline size_t name##_lower_bound(const T *s, T key) { \
+    _SDA_BOUND_FN(s, key, less, 0); \
+} \
+static inline size_t name##_upper_bound(const T *s, T key) { \
+    _SDA_BOUND_FN(s, key, less, 1); \
+}
+
+/******* Don't call these directly *******/
+
+//runs shorter than this are insertion sorted
+#define _SDA_SORT_ISORT_MAX 16
+
+/* Introsort depth limit for n elements, 2*log2(n) */
+static inline unsigned _sda_sort_depth(size_t n) {
+    unsigned d = 0;
+    while (n >>= 1) d++;
+    return 2*d;
+}
+
+#define _SDA_LESS_LOWER(a, key) ((a) < (key))
+#define _SDA_LESS_UPPER(a, key) (!((key) < (a)))
+
+/* Binary search over n elements of a sorted array a, evaluates to the first
+ * index where pred(a[i], key) is false */
+#define _SDA_BOUND(a, n, key, pred) ({ \
+    size_t lo = 0, len = (n); \
+    while (len > 0) { \
+        size_t half = len/2; \
+        if (pred((a)[lo+half], (key))) { \
+            lo += half+1; \
+            len -= half+1; \
+        } \
+        else { \
+            len = half; \
+        } \
+    } \
+    lo; \
+    })
+
+/* Body of the lower/upper bound functions made by SDA_SORT_DEFINE */
+#define _SDA_BOUND_FN(s, key, less, upper) \
+    size_t lo = 0, len = sda_len((sda)(s)); \
+    while (len > 0) { \
+        size_t half = len/2; \
+        int go_right = (upper) ? !less(key, s[lo+half]) : less(s[lo+half], key); \
+        if (go_right) { \
+            lo += half+1; \
+            len -= half+1; \
+        } \
+        else { \
+            len = half; \
+        } \
+    } \
+    return lo;
+
+#endif //__SDA_SORT_H
@@ -0,0 +1,180 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Lock-free single producer, single consumer queue on sda storage.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdlib.h>
+#include <assert.h>
+#include "sda_spsc.h"
+
+#if defined(SDA_SPSC_TEST_MAIN)
+#include <stdio.h>
+#include <pthread.h>
+#endif
+
+/* head and tail count up forever, the position in the ring is the count
+ * masked with cap-1 and tail-head is the number of elements queued. */
+
+struct sda_spsc *sda_spsc_new(size_t cap, size_t sz) {
+    struct sda_spsc *q;
+    size_t pow2 = 1;
+    assert(sz > 0 && sz <= SDA_MAX_SZ);
+    while (pow2 < cap) {
+        pow2 <<= 1;
+        if (pow2 == 0) return NULL;
+    }
+    if (pow2 > SIZE_MAX/sz) return NULL;
+    //the struct is an sda too, so the indexes get their own cache lines
+    q = _sda_new_ext(NULL, sizeof(*q), 1, SDA_CACHE_LINE, NULL);
+    if (q == NULL) return NULL;
+    q->buf = _sda_new_sz(NULL, pow2*sz, sz);
+    if (q->buf == NULL) {
+        sda_free(q);
+        return NULL;
+    }
+    q->cap = pow2;
+    q->sz = sda_sz(q->buf);
+    return q;
+}
+
+void sda_spsc_free(struct sda_spsc *q) {
+    if (q == NULL) return;
+    sda_free(q->buf);
+    sda_free(q);
+}
+
+size_t sda_spsc_push_n(struct sda_spsc *q, const void *x, size_t n) {
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    size_t room = q->cap - (tail - q->head_cache);
+    size_t pos, first;
+    if (room < n) {
+        //only look at the consumer's line when the old head isn't enough
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        room = q->cap - (tail - q->head_cache);
+    }
+    if (n > room) n = room;
+    if (n == 0) return 0;
+    //one copy up to the end of the ring, and one more if it wraps
+    pos = tail & (q->cap-1);
+    first = q->cap - pos;
+    if (first > n) first = n;
+    memcpy(q->buf + pos*q->sz, x, first*q->sz);
+    if (n > first) memcpy(q->buf, (const char *)x + first*q->sz, (n-first)*q->sz);
+    __atomic_store_n(&q->tail, tail+n, __ATOMIC_RELEASE);
+    return n;
+}
+
+size_t sda_spsc_pop_n(struct sda_spsc *q, void *out, size_t n) {
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    size_t avail = q->tail_cache - head;
+    size_t pos, first;
+    if (avail < n) {
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        avail = q->tail_cache - head;
+    }
+    if (n > avail) n = avail;
+    if (n == 0) return 0;
+    pos = head & (q->cap-1);
+    first = q->cap - pos;
+    if (first > n) first = n;
+    memcpy(out, q->buf + pos*q->sz, first*q->sz);
+    if (n > first) memcpy((char *)out + first*q->sz, q->buf, (n-first)*q->sz);
+    __atomic_store_n(&q->head, head+n, __ATOMIC_RELEASE);
+    return n;
+}
+
+
+/******* Test stuff *******/
+
+#if defined(SDA_SPSC_TEST_MAIN)
+
+#define _TEST_COUNT 2000000
+
+static void *_test_producer(void *arg) {
+    struct sda_spsc *q = arg;
+    uint64_t batch[37];
+    uint64_t next = 0;
+    size_t n, done;
+    while (next < _TEST_COUNT) {
+        //odd sized batches so they keep landing across the wrap
+        n = 1 + next%37;
+        if (n > _TEST_COUNT-next) n = _TEST_COUNT-next;
+        for (size_t i = 0; i < n; i++) batch[i] = next+i;
+        done = 0;
+        while (done < n) done += sda_spsc_push_n(q, batch+done, n-done);
+        next += n;
+    }
+    return NULL;
+}
+
+int main(void) {
+    struct sda_spsc *q;
+    uint32_t in[10], out[10];
+    pthread_t producer;
+
+    //rounded up to a power of 2
+    q = sda_spsc_new(5, sizeof(uint32_t));
+    assert(q != NULL);
+    assert(sda_spsc_cap(q) == 8);
+    assert(sda_spsc_len(q) == 0);
+    assert(((uintptr_t)&q->head)%SDA_CACHE_LINE == 0);
+    assert(((uintptr_t)&q->tail)%SDA_CACHE_LINE == 0);
+    assert(&q->head != &q->tail);
+    assert(sda_len(q->buf) == 8 && sda_sz(q->buf) == sizeof(uint32_t));
+    assert(sda_spsc_pop(q, out) == 0);
+    for (uint32_t i = 0; i < 10; i++) in[i] = i;
+    //only 8 fit
+    assert(sda_spsc_push_n(q, in, 10) == 8);
+    assert(sda_spsc_push(q, in) == 0);
+    assert(sda_spsc_len(q) == 8);
+    assert(sda_spsc_pop_n(q, out, 5) == 5);
+    for (uint32_t i = 0; i < 5; i++) assert(out[i] == i);
+    //this one wraps around the end of the ring
+    assert(sda_spsc_push_n(q, in, 4) == 4);
+    assert(sda_spsc_pop_n(q, out, 10) == 7);
+    assert(out[0] == 5 && out[1] == 6 && out[2] == 7);
+    for (uint32_t i = 0; i < 4; i++) assert(out[3+i] == i);
+    assert(sda_spsc_len(q) == 0);
+    sda_spsc_free(q);
+
+    //two threads, everything has to come out in order
+    q = sda_spsc_new(1000, sizeof(uint64_t));
+    assert(pthread_create(&producer, NULL, _test_producer, q) == 0);
+    uint64_t expect = 0, batch[64];
+    while (expect < _TEST_COUNT) {
+        size_t n = sda_spsc_pop_n(q, batch, 1 + expect%64);
+        for (size_t i = 0; i < n; i++) assert(batch[i] == expect++);
+    }
+    pthread_join(producer, NULL);
+    assert(sda_spsc_len(q) == 0);
+    sda_spsc_free(q);
+
+    puts("done");
+    return 0;
+}
+#endif
@@ -0,0 +1,101 @@
+/* libsda - Simple dynamic array library
+ *
+ * Copyright (c) 2017 - Devin Linnington
+ *
+ * Lock-free single producer, single consumer queue on sda storage.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifndef __SDA_SPSC_H
+#define __SDA_SPSC_H
+
+#include "sda.h"
+
+/* Fixed capacity ring for passing elements of one size from exactly one
+ * producer thread to exactly one consumer thread without locks. The ring is
+ * an sda array made with _sda_new_sz, its sda_sz is the element size.
+ *
+ * Only the producer may call the push functions and only the consumer the
+ * pop ones. None of them block, they move as many elements as fit/are there
+ * and return how many that was.
+ */
+
+struct sda_spsc {
+    /// Next position the producer writes to, only written by the producer
+    size_t tail __attribute__((aligned(SDA_CACHE_LINE)));
+    /// Last head the producer saw, saves reading the consumer's line every push
+    size_t head_cache;
+    /// Next position the consumer reads from, only written by the consumer
+    size_t head __attribute__((aligned(SDA_CACHE_LINE)));
+    /// Last tail the consumer saw
+    size_t tail_cache;
+    /// The ring, never changes after sda_spsc_new
+    char *buf __attribute__((aligned(SDA_CACHE_LINE)));
+    /// Number of elements the ring holds, a power of 2
+    size_t cap;
+    /// Element size
+    size_t sz;
+};
+
+/**
+ * Create a queue holding up to cap elements of sz bytes.
+ * cap is rounded up to a power of 2. Returns NULL if out of memory.
+ */
+struct sda_spsc *sda_spsc_new(size_t cap, size_t sz);
+/** Free q, neither thread can be using it anymore */
+void sda_spsc_free(struct sda_spsc *q);
+
+/**
+ * Producer only: copy up to n elements from x onto the queue, returns how
+ * many were added (less than n if the queue filled up).
+ */
+size_t sda_spsc_push_n(struct sda_spsc *q, const void *x, size_t n);
+/**
+ * Consumer only: move up to n elements off of the queue into out, returns
+ * how many were taken (less than n if the queue ran out).
+ */
+size_t sda_spsc_pop_n(struct sda_spsc *q, void *out, size_t n);
+
+/** Producer only: add the element x points to, returns 0 if the queue is full */
+static inline int sda_spsc_push(struct sda_spsc *q, const void *x) {
+    return sda_spsc_push_n(q, x, 1) == 1;
+}
+/** Consumer only: take one element into out, returns 0 if the queue is empty */
+static inline int sda_spsc_pop(struct sda_spsc *q, void *out) {
+    return sda_spsc_pop_n(q, out, 1) == 1;
+}
+
+/** Number of elements in q, only a snapshot if the other thread is active */
+static inline size_t sda_spsc_len(const struct sda_spsc *q) {
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+/** Max number of elements q can hold */
+static inline size_t sda_spsc_cap(const struct sda_spsc *q) {
+    return q->cap;
+}
+
+#endif //__SDA_SPSC_H